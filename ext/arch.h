@@ -44,6 +44,57 @@ arch_get_st2_tramp(size_t *size);
 int
 arch_insert_st1_tramp(void *start, void *trampee, void *tramp);
 
+/*
+ * arch_insert_st1_tramps - stage 1 trampoline insert for a whole text segment
+ *
+ * Given:
+ *  text - the start of a text segment
+ *  len - the length of the text segment
+ *  trampee - the address of the function to trampoline
+ *  tramp - a pointer to the trampoline
+ *
+ *  is_insn - optional, returns 0 if a would-be call site is really just
+ *            part of some other instruction
+ *
+ * This function does what arch_insert_st1_tramp does, for every call to
+ * trampee in the text segment. The calls in a segment are indexed the first
+ * time it is searched, so later searches don't have to scan it again.
+ *
+ * Returns the number of calls redirected.
+ */
+int
+arch_insert_st1_tramps(void *text, size_t len, void *trampee, void *tramp,
+                       int (*is_insn)(void *site));
+
+/*
+ * arch_insn_length - decode the length of an instruction
+ *
+ * Given:
+ *  ins - the start of an instruction
+ *  max - how many bytes there are left to read (e.g. to the end of the
+ *        function)
+ *
+ * Returns the length of the instruction in bytes, or 0 if it could not be
+ * decoded or runs past max.
+ */
+size_t
+arch_insn_length(const void *ins, size_t max);
+
+/*
+ * arch_insn_boundary - check that an instruction starts at addr
+ *
+ * Given:
+ *  start - the start of a function (or anywhere an instruction is known to
+ *          start)
+ *  len - the length of the function
+ *  addr - the address to check
+ *
+ * Returns 1 if decoding from start lands on addr, 0 if addr is in the middle
+ * of an instruction, or -1 if something before addr could not be decoded.
+ */
+int
+arch_insn_boundary(const void *start, size_t len, const void *addr);
+
 /*
  * arch_get_inline_st2_tramp - architecture specific inline stage 2 tramp getter
  *
@@ -75,4 +126,33 @@ arch_get_inline_st2_tramp(size_t *size);
  */
 int
 arch_insert_inline_st2_tramp(void *addr, void *marker, void *trampoline, void *table_entry);
+
+/*
+ * arch_tramp_caller - find the return address of whoever called a trampolined
+ * function.
+ *
+ * Given:
+ *    - frame - the frame address (__builtin_frame_address(0)) of a handler
+ *      called from a stage 2 trampoline.
+ *
+ * The handler's own return address points back into the stage 2 trampoline,
+ * so this digs the original caller's return address out from underneath the
+ * trampoline's frame instead.
+ */
+void *
+arch_tramp_caller(void *frame);
+
+/*
+ * arch_tramp_caller_frame - find the frame pointer of whoever called a
+ * trampolined function.
+ *
+ * Given:
+ *    - frame - the frame address of a handler called from a stage 2
+ *      trampoline, as for arch_tramp_caller.
+ *
+ * The result is only a real frame if the caller was built with frame
+ * pointers; otherwise it is whatever the caller kept in %rbp/%ebp.
+ */
+void *
+arch_tramp_caller_frame(void *frame);
 #endif
@@ -40,17 +40,41 @@ bin_find_symbol(const char *sym, size_t *size, int search_libs);
  *  - sym - a symbol address
  *
  * This function will search for the symbol sym and return its name if
- * found, or NULL if the symbol could not be found.
+ * found, or NULL if the symbol could not be found. On ELF systems, an address
+ * inside a function (such as a return address) is resolved to the name of
+ * that function.
  */
 const char *
 bin_find_symbol_name(void *sym);
 
+/*
+ * bin_find_symbol_names - name a batch of code addresses
+ *
+ * Given:
+ *  - addrs - code addresses, such as return addresses; NULLs are skipped
+ *  - names - out parameter, the function containing each address
+ *  - objects - out parameter, the binary or library containing each address
+ *  - count - the number of addresses
+ *
+ * Unlike bin_find_symbol_name, this searches shared libraries too, reading
+ * each library's symbols once for the whole batch, so it is meant to be
+ * called with everything that needs a name at once.
+ *
+ * Entries which could not be resolved are set to NULL. Everything else is
+ * malloc'd and must be freed by the caller.
+ */
+void
+bin_find_symbol_names(void **addrs, char **names, char **objects, size_t count);
+
 /*
  * bin_allocate_page - allocate a page suitable for trampolines
  *
  * This function will allocate a page of memory in the right area of the
  * virtual address space and with the appropriate permissions for stage 2
  * trampoline code to live and execute.
+ *
+ * Each call maps a new page. Returns NULL if no page could be found within
+ * reach of the Ruby code.
  */
 void *
 bin_allocate_page(void);
@@ -81,6 +105,22 @@ bin_type_size(const char *type);
 int
 bin_type_member_offset(const char *type, const char *member);
 
+/*
+ * bin_build_key - a string identifying this particular ruby build.
+ *
+ * Given:
+ *  - buf - where to write the key
+ *  - len - size of buf
+ *
+ * The key is made from ruby's (or libruby's) build-id if it has one, or the
+ * checksum of its separate debug file, or failing both, the file's inode,
+ * size and modification time.
+ *
+ * Returns 0 on success, or -1 if no key could be made.
+ */
+int
+bin_build_key(char *buf, size_t len);
+
 /*
  * bin_update_image - Update a binary image in memory
  *
@@ -97,4 +137,14 @@ bin_type_member_offset(const char *type, const char *member);
  */
 int
 bin_update_image(const char *trampee, struct tramp_st2_entry *tramp, void **orig_func);
+
+/*
+ * bin_check_unloaded - look for libraries unloaded since the last look, and
+ * pass the address range of each to tramp_forget_range.
+ *
+ * Called before trampolines are removed or switched, so nothing is written
+ * to (or read from) a library that has since been dlclose'd.
+ */
+void
+bin_check_unloaded(void);
 #endif
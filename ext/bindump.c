@@ -0,0 +1,421 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bindump.h"
+#include "output.h"
+#include "util.h"
+
+/* only strings up to this length are put in the string table */
+#define BINDUMP_MAX_INTERNED_LEN 128
+#define BINDUMP_MAX_INTERNED     (1 << 20)
+
+struct bindump_str {
+  char *ptr;
+  unsigned int len;
+  uint32_t hash;
+};
+
+struct bindump_writer {
+  struct memprof_output *out;
+
+  struct bindump_str *strs;
+  size_t num_strs;
+  size_t strs_capa;
+
+  /* open-addressing index into strs (stored as id + 1, 0 is empty) */
+  uint32_t *str_index;
+  size_t str_index_capa;
+};
+
+static void
+bindump_print(void *ctx, const char *str, unsigned int len)
+{
+  /* all events are intercepted in json.c, so yajl never prints anything */
+  assert(0 && "yajl tried to print to a binary dump");
+}
+
+int
+bindump_gen_p(json_gen gen)
+{
+  return gen->print == (json_print_t)&bindump_print;
+}
+
+static inline void
+write_varint(struct memprof_output *out, uint64_t val)
+{
+  unsigned char buf[10];
+  unsigned int len = 0;
+
+  while (val >= 0x80) {
+    buf[len++] = (unsigned char)((val & 0x7f) | 0x80);
+    val >>= 7;
+  }
+  buf[len++] = (unsigned char)val;
+
+  output_write(out, buf, len);
+}
+
+static inline void
+write_bytes(struct memprof_output *out, const void *ptr, unsigned int len)
+{
+  write_varint(out, len);
+  output_write(out, ptr, len);
+}
+
+static void
+write_header(struct bindump_writer *writer)
+{
+  output_putc(writer->out, BINDUMP_HEADER);
+  output_write(writer->out, BINDUMP_MAGIC, 4);
+  output_putc(writer->out, BINDUMP_VERSION);
+}
+
+json_gen
+bindump_gen_alloc(struct memprof_output *out)
+{
+  static json_gen_config conf = { .beautify = 0, .indentString = "" };
+  struct bindump_writer *writer = calloc(1, sizeof(*writer));
+  assert(writer != NULL);
+
+  assert(out != NULL);
+  writer->out = out;
+  writer->str_index_capa = 1024;
+  writer->str_index = calloc(writer->str_index_capa, sizeof(*writer->str_index));
+  assert(writer->str_index != NULL);
+
+  write_header(writer);
+
+  return json_gen_alloc2((json_print_t)&bindump_print, &conf, NULL, writer);
+}
+
+void
+bindump_gen_free(json_gen gen)
+{
+  struct bindump_writer *writer = gen->ctx;
+  size_t i;
+
+  assert(bindump_gen_p(gen));
+
+  for (i = 0; i < writer->num_strs; i++)
+    free(writer->strs[i].ptr);
+  free(writer->strs);
+  free(writer->str_index);
+  free(writer);
+
+  json_gen_free(gen);
+}
+
+static inline uint32_t
+str_hash(const unsigned char *str, unsigned int len)
+{
+  /* FNV-1a */
+  uint32_t h = 2166136261U;
+  while (len--)
+    h = (h ^ *str++) * 16777619U;
+  return h;
+}
+
+static int
+str_index_grow(struct bindump_writer *writer)
+{
+  size_t capa = writer->str_index_capa * 2, i, idx;
+  uint32_t *index = calloc(capa, sizeof(*index));
+
+  if (!index)
+    return -1;
+
+  for (i = 0; i < writer->num_strs; i++) {
+    idx = writer->strs[i].hash & (capa - 1);
+    while (index[idx])
+      idx = (idx + 1) & (capa - 1);
+    index[idx] = i + 1;
+  }
+
+  free(writer->str_index);
+  writer->str_index = index;
+  writer->str_index_capa = capa;
+  return 0;
+}
+
+/*
+ * Find str in the string table. If it's not there yet, add it and return
+ * -1 so the caller writes out its definition.
+ */
+static int64_t
+str_intern(struct bindump_writer *writer, const unsigned char *str, unsigned int len)
+{
+  uint32_t hash = str_hash(str, len);
+  size_t idx = hash & (writer->str_index_capa - 1);
+  struct bindump_str *entry = NULL;
+
+  while (writer->str_index[idx]) {
+    entry = &writer->strs[writer->str_index[idx] - 1];
+    if (entry->hash == hash && entry->len == len && memcmp(entry->ptr, str, len) == 0)
+      return writer->str_index[idx] - 1;
+    idx = (idx + 1) & (writer->str_index_capa - 1);
+  }
+
+  if (writer->num_strs == BINDUMP_MAX_INTERNED)
+    return -2;
+
+  if (writer->num_strs == writer->strs_capa) {
+    size_t capa = writer->strs_capa ? writer->strs_capa * 2 : 1024;
+    struct bindump_str *strs = realloc(writer->strs, capa * sizeof(*strs));
+    if (!strs)
+      return -2;
+    writer->strs = strs;
+    writer->strs_capa = capa;
+  }
+
+  entry = &writer->strs[writer->num_strs];
+  entry->ptr = malloc(len);
+  if (!entry->ptr)
+    return -2;
+  memcpy(entry->ptr, str, len);
+  entry->len = len;
+  entry->hash = hash;
+
+  writer->str_index[idx] = ++writer->num_strs;
+
+  if (writer->num_strs * 2 > writer->str_index_capa && str_index_grow(writer) != 0)
+    dbg_printf("unable to grow the string index past %zd entries\n", writer->str_index_capa);
+
+  return -1;
+}
+
+json_gen_status
+bindump_tag_only(json_gen gen, bindump_tag tag)
+{
+  struct bindump_writer *writer = gen->ctx;
+  output_putc(writer->out, tag);
+  return json_gen_status_ok;
+}
+
+json_gen_status
+bindump_integer(json_gen gen, long int number)
+{
+  struct bindump_writer *writer = gen->ctx;
+  int64_t n = number;
+
+  output_putc(writer->out, BINDUMP_INTEGER);
+  write_varint(writer->out, ((uint64_t)n << 1) ^ (uint64_t)(n >> 63));
+  return json_gen_status_ok;
+}
+
+json_gen_status
+bindump_double(json_gen gen, double number)
+{
+  struct bindump_writer *writer = gen->ctx;
+
+  /* memprof only runs on x86, so this is always little-endian */
+  output_putc(writer->out, BINDUMP_DOUBLE);
+  output_write(writer->out, &number, sizeof(number));
+  return json_gen_status_ok;
+}
+
+json_gen_status
+bindump_number(json_gen gen, const char *num, unsigned int len)
+{
+  struct bindump_writer *writer = gen->ctx;
+
+  output_putc(writer->out, BINDUMP_NUMBER);
+  write_bytes(writer->out, num, len);
+  return json_gen_status_ok;
+}
+
+json_gen_status
+bindump_string(json_gen gen, const unsigned char *str, unsigned int len)
+{
+  struct bindump_writer *writer = gen->ctx;
+  int64_t id = -2;
+
+  if (len <= BINDUMP_MAX_INTERNED_LEN)
+    id = str_intern(writer, str, len);
+
+  if (id >= 0) {
+    output_putc(writer->out, BINDUMP_STRING_REF);
+    write_varint(writer->out, id);
+  } else {
+    output_putc(writer->out, id == -1 ? BINDUMP_STRING_DEF : BINDUMP_STRING);
+    write_bytes(writer->out, str, len);
+  }
+
+  return json_gen_status_ok;
+}
+
+json_gen_status
+bindump_pointer(json_gen gen, void *ptr)
+{
+  struct bindump_writer *writer = gen->ctx;
+
+  output_putc(writer->out, BINDUMP_POINTER);
+  write_varint(writer->out, (uintptr_t)ptr);
+  return json_gen_status_ok;
+}
+
+static int
+read_varint(FILE *in, uint64_t *val)
+{
+  int c, shift = 0;
+
+  *val = 0;
+  do {
+    if ((c = getc(in)) == EOF || shift > 63)
+      return -1;
+    *val |= (uint64_t)(c & 0x7f) << shift;
+    shift += 7;
+  } while (c & 0x80);
+
+  return 0;
+}
+
+static char *
+read_bytes(FILE *in, unsigned int *len)
+{
+  uint64_t val;
+  char *buf = NULL;
+
+  if (read_varint(in, &val) != 0 || val > UINT32_MAX)
+    return NULL;
+
+  buf = malloc(val ? val : 1);
+  if (!buf)
+    return NULL;
+
+  if (fread(buf, 1, val, in) != val) {
+    free(buf);
+    return NULL;
+  }
+
+  *len = val;
+  return buf;
+}
+
+int
+bindump_convert(FILE *in, json_gen out)
+{
+  struct bindump_str *strs = NULL;
+  size_t num_strs = 0, strs_capa = 0, i;
+  char magic[4], *buf = NULL;
+  unsigned int len = 0;
+  uint64_t val;
+  double dbl;
+  int c, ret = -1, started = 0;
+
+  while ((c = getc(in)) != EOF) {
+    if (!started && c != BINDUMP_HEADER)
+      goto out;
+
+    switch (c) {
+      case BINDUMP_HEADER:
+        if (fread(magic, 1, 4, in) != 4 || memcmp(magic, BINDUMP_MAGIC, 4) != 0)
+          goto out;
+        if (getc(in) != BINDUMP_VERSION)
+          goto out;
+
+        /* each stream has its own string table */
+        for (i = 0; i < num_strs; i++)
+          free(strs[i].ptr);
+        num_strs = 0;
+        started = 1;
+        break;
+
+      case BINDUMP_MAP_OPEN:
+        json_gen_map_open(out);
+        break;
+      case BINDUMP_MAP_CLOSE:
+        json_gen_map_close(out);
+        break;
+      case BINDUMP_ARRAY_OPEN:
+        json_gen_array_open(out);
+        break;
+      case BINDUMP_ARRAY_CLOSE:
+        json_gen_array_close(out);
+        break;
+      case BINDUMP_NULL:
+        json_gen_null(out);
+        break;
+      case BINDUMP_TRUE:
+        json_gen_bool(out, 1);
+        break;
+      case BINDUMP_FALSE:
+        json_gen_bool(out, 0);
+        break;
+      case BINDUMP_RECORD_END:
+        json_gen_reset(out);
+        break;
+
+      case BINDUMP_INTEGER:
+        if (read_varint(in, &val) != 0)
+          goto out;
+        json_gen_integer(out, (long int)((val >> 1) ^ -(int64_t)(val & 1)));
+        break;
+
+      case BINDUMP_DOUBLE:
+        if (fread(&dbl, 1, sizeof(dbl), in) != sizeof(dbl))
+          goto out;
+        json_gen_double(out, dbl);
+        break;
+
+      case BINDUMP_POINTER:
+        if (read_varint(in, &val) != 0)
+          goto out;
+        json_gen_pointer(out, (void *)(uintptr_t)val);
+        break;
+
+      case BINDUMP_NUMBER:
+      case BINDUMP_STRING:
+        if (!(buf = read_bytes(in, &len)))
+          goto out;
+        if (c == BINDUMP_NUMBER)
+          json_gen_number(out, buf, len);
+        else
+          json_gen_string(out, (unsigned char *)buf, len);
+        free(buf);
+        break;
+
+      case BINDUMP_STRING_DEF:
+        if (!(buf = read_bytes(in, &len)))
+          goto out;
+
+        if (num_strs == strs_capa) {
+          size_t capa = strs_capa ? strs_capa * 2 : 1024;
+          struct bindump_str *new_strs = realloc(strs, capa * sizeof(*strs));
+          if (!new_strs) {
+            free(buf);
+            goto out;
+          }
+          strs = new_strs;
+          strs_capa = capa;
+        }
+
+        strs[num_strs].ptr = buf;
+        strs[num_strs].len = len;
+        num_strs++;
+
+        json_gen_string(out, (unsigned char *)buf, len);
+        break;
+
+      case BINDUMP_STRING_REF:
+        if (read_varint(in, &val) != 0 || val >= num_strs)
+          goto out;
+        json_gen_string(out, (unsigned char *)strs[val].ptr, strs[val].len);
+        break;
+
+      default:
+        dbg_printf("unknown tag %d in binary dump\n", c);
+        goto out;
+    }
+  }
+
+  ret = started ? 0 : -1;
+
+out:
+  for (i = 0; i < num_strs; i++)
+    free(strs[i].ptr);
+  free(strs);
+  return ret;
+}
@@ -0,0 +1,89 @@
+#if !defined(__bindump_h__)
+#define __bindump_h__
+
+#include <stdio.h>
+
+#include "json.h"
+#include "output.h"
+
+/*
+ * memprof's binary dump format.
+ *
+ * A binary dump is the same stream of events that would have been handed to
+ * yajl (map/array open and close, strings, integers, ...), with each event
+ * encoded as a one byte tag followed by its payload:
+ *
+ *  - integers and object ids are (zigzag) varints
+ *  - short strings (keys, class names, ivar names, file names, symbols) are
+ *    only written out once per stream, and referred to by a varint index
+ *    into a string table afterwards
+ *  - the end of each top-level record is marked with its own tag
+ *
+ * Each stream starts with a header, which also resets the string table, so
+ * binary dumps can be concatenated.
+ */
+typedef enum {
+  BINDUMP_MAP_OPEN = 1,
+  BINDUMP_MAP_CLOSE,
+  BINDUMP_ARRAY_OPEN,
+  BINDUMP_ARRAY_CLOSE,
+  BINDUMP_NULL,
+  BINDUMP_TRUE,
+  BINDUMP_FALSE,
+  BINDUMP_INTEGER,
+  BINDUMP_DOUBLE,
+  BINDUMP_NUMBER,
+  BINDUMP_STRING,
+  BINDUMP_STRING_DEF,
+  BINDUMP_STRING_REF,
+  BINDUMP_POINTER,
+  BINDUMP_RECORD_END,
+  BINDUMP_HEADER = 0x7f,
+} bindump_tag;
+
+#define BINDUMP_MAGIC "MPRF"
+#define BINDUMP_VERSION 1
+
+/*
+ * bindump_gen_alloc - create a generator which writes binary dumps.
+ *
+ * Given:
+ *  - out: sink to write the dump to.
+ *
+ * The returned generator can be passed to all the usual json_gen_* calls.
+ */
+json_gen
+bindump_gen_alloc(struct memprof_output *out);
+
+/*
+ * bindump_gen_free - free a binary dump generator (but not its output).
+ */
+void
+bindump_gen_free(json_gen gen);
+
+/*
+ * bindump_gen_p - is this a binary dump generator?
+ */
+int
+bindump_gen_p(json_gen gen);
+
+/*
+ * bindump_convert - convert a binary dump back to json.
+ *
+ * Given:
+ *  - in:  a binary dump, read as a stream.
+ *  - out: generator to replay the dump onto.
+ *
+ * Returns 0 on success, or -1 if the input is not a valid binary dump.
+ */
+int
+bindump_convert(FILE *in, json_gen out);
+
+/* event encoders, used by the json_gen_* wrappers in json.c */
+json_gen_status bindump_tag_only(json_gen gen, bindump_tag tag);
+json_gen_status bindump_integer(json_gen gen, long int number);
+json_gen_status bindump_double(json_gen gen, double number);
+json_gen_status bindump_number(json_gen gen, const char *num, unsigned int len);
+json_gen_status bindump_string(json_gen gen, const unsigned char *str, unsigned int len);
+json_gen_status bindump_pointer(json_gen gen, void *ptr);
+#endif
@@ -0,0 +1,183 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bin_api.h"
+#include "config_cache.h"
+#include "util.h"
+
+#define CONFIG_CACHE_MAGIC   "memprof"
+/* bump this whenever the meaning of the cached fields changes */
+#define CONFIG_CACHE_VERSION 1
+
+/* the cached fields, from sizeof_RVALUE up to (but not including) pagesize */
+#define TYPES_START offsetof(struct memprof_config, sizeof_RVALUE)
+#define TYPES_SIZE  (offsetof(struct memprof_config, pagesize) - TYPES_START)
+
+struct config_cache_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t size;
+};
+
+static int
+cache_dir(char *buf, size_t len, int create)
+{
+  const char *dir = getenv("MEMPROF_CACHE_DIR"), *base = NULL;
+  size_t n;
+
+  if (dir) {
+    if (dir[0] == '\0')
+      return -1;
+    if ((size_t)snprintf(buf, len, "%s", dir) >= len)
+      return -1;
+  } else {
+    if ((base = getenv("XDG_CACHE_HOME")) != NULL && base[0] != '\0')
+      n = snprintf(buf, len, "%s", base);
+    else if ((base = getenv("HOME")) != NULL && base[0] != '\0')
+      n = snprintf(buf, len, "%s/.cache", base);
+    else
+      return -1;
+
+    if (n >= len)
+      return -1;
+    if (create && mkdir(buf, 0755) == -1 && errno != EEXIST)
+      return -1;
+    if ((size_t)snprintf(buf + n, len - n, "/memprof") >= len - n)
+      return -1;
+  }
+
+  if (create && mkdir(buf, 0755) == -1 && errno != EEXIST)
+    return -1;
+
+  return 0;
+}
+
+static int
+cache_path(char *buf, size_t len, int create)
+{
+  char key[128];
+  size_t n;
+
+  if (bin_build_key(key, sizeof(key)) != 0)
+    return -1;
+
+  if (cache_dir(buf, len, create) != 0)
+    return -1;
+
+  n = strlen(buf);
+  if ((size_t)snprintf(buf + n, len - n, "/%s.config", key) >= len - n)
+    return -1;
+
+  return 0;
+}
+
+int
+config_cache_load(struct memprof_config *config)
+{
+  struct config_cache_header *header = NULL;
+  char path[PATH_MAX];
+  size_t size = sizeof(*header) + TYPES_SIZE;
+  struct stat st;
+  void *map = NULL;
+  int fd, ret = -1;
+
+  if (cache_path(path, sizeof(path), 0) != 0)
+    return -1;
+
+  if ((fd = open(path, O_RDONLY)) == -1)
+    return -1;
+
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size == size) {
+    map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+      header = map;
+      if (memcmp(header->magic, CONFIG_CACHE_MAGIC, sizeof(CONFIG_CACHE_MAGIC)) == 0 &&
+          header->version == CONFIG_CACHE_VERSION &&
+          header->size == TYPES_SIZE) {
+        memcpy((char *)config + TYPES_START, header + 1, TYPES_SIZE);
+        ret = 0;
+      }
+      munmap(map, size);
+    }
+  }
+
+  close(fd);
+  dbg_printf("config cache %s: %s\n", ret == 0 ? "hit" : "invalid", path);
+  return ret;
+}
+
+static int
+write_fully(int fd, const void *ptr, size_t len)
+{
+  ssize_t ret;
+
+  while (len > 0) {
+    ret = write(fd, ptr, len);
+    if (ret == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    ptr = (const char *)ptr + ret;
+    len -= ret;
+  }
+
+  return 0;
+}
+
+int
+config_cache_save(const struct memprof_config *config)
+{
+  struct config_cache_header header;
+  char path[PATH_MAX], tmp[PATH_MAX];
+  const size_t *field = NULL;
+  int fd, ret = 0;
+
+  /* every cached field is a size_t, and SIZE_MAX means it wasn't found */
+  if (config->sizeof_RVALUE == 0 || config->sizeof_heaps_slot == 0)
+    return -1;
+
+  for (field = (const size_t *)((const char *)config + TYPES_START);
+       (const char *)field < (const char *)config + TYPES_START + TYPES_SIZE;
+       field++) {
+    if (*field == SIZE_MAX)
+      return -1;
+  }
+
+  if (cache_path(path, sizeof(path), 1) != 0)
+    return -1;
+  if ((size_t)snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid()) >= sizeof(tmp))
+    return -1;
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CONFIG_CACHE_MAGIC, sizeof(CONFIG_CACHE_MAGIC));
+  header.version = CONFIG_CACHE_VERSION;
+  header.size = TYPES_SIZE;
+
+  /* written to a temporary file and renamed, so other processes never see half of it */
+  if ((fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0644)) == -1)
+    return -1;
+
+  if (write_fully(fd, &header, sizeof(header)) != 0 ||
+      write_fully(fd, (const char *)config + TYPES_START, TYPES_SIZE) != 0)
+    ret = -1;
+  if (close(fd) != 0)
+    ret = -1;
+
+  if (ret == 0 && rename(tmp, path) != 0)
+    ret = -1;
+  if (ret != 0)
+    unlink(tmp);
+
+  dbg_printf("config cache %s: %s\n", ret == 0 ? "saved" : "not saved", path);
+  return ret;
+}
@@ -0,0 +1,38 @@
+#if !defined(__config_cache_h__)
+#define __config_cache_h__
+
+#include "util.h"
+
+/*
+ * An on-disk cache of the type sizes and member offsets in memprof_config.
+ *
+ * Working these out means walking ruby's DWARF debugging data, which is slow
+ * enough to show up in the boot time of every process that loads memprof.
+ * Since they only change when ruby is rebuilt, they are saved to a file
+ * named after the ruby build (see bin_build_key) and read back from it on
+ * later boots.
+ *
+ * The cache lives in $MEMPROF_CACHE_DIR, $XDG_CACHE_HOME/memprof or
+ * ~/.cache/memprof, whichever is set first. Setting MEMPROF_CACHE_DIR to an
+ * empty string turns it off.
+ */
+
+/*
+ * config_cache_load - fill in config's types from the cache.
+ *
+ * Returns 0 on a hit, or -1 (leaving config untouched) on a miss.
+ */
+int
+config_cache_load(struct memprof_config *config);
+
+/*
+ * config_cache_save - save config's types to the cache.
+ *
+ * Types which could not be found are not worth saving, so nothing is saved
+ * unless all of them were.
+ *
+ * Returns 0 on success, -1 otherwise.
+ */
+int
+config_cache_save(const struct memprof_config *config);
+#endif
@@ -2,6 +2,7 @@
 #define _GNU_SOURCE
 #include "bin_api.h"
 #include "arch.h"
+#include "tramp.h"
 #include "util.h"
 
 #include <assert.h>
@@ -15,6 +16,7 @@
 #include <libgen.h>
 #include <limits.h>
 #include <link.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -63,6 +65,7 @@ struct elf_info {
   size_t plt_count;
 
   Elf_Data *debuglink_data;
+  Elf_Data *build_id_data;
 
   GElf_Ehdr ehdr;
 
@@ -76,6 +79,36 @@ struct elf_info {
   const char *filename;
 
   struct elf_info *debug_data;
+
+  /* built on the first symbol lookup */
+  struct elf_symbols *symbols;
+};
+
+/*
+ * An index of an object's symbols, so lookups don't have to walk the whole
+ * symtab (tens of thousands of entries for a libruby with debug symbols)
+ * calling strcmp on each one.
+ *
+ * Names are found through an open addressed hash table, and addresses
+ * through a sorted array of the symbols names are looked up from.
+ */
+struct elf_sym {
+  const char *name;
+  void *addr;
+  size_t size;
+  unsigned char info;
+};
+
+struct elf_symbols {
+  struct elf_sym *syms;
+  size_t count;
+
+  /* indexes into syms plus one, 0 for empty slots */
+  uint32_t *hash;
+  size_t hash_mask;
+
+  struct elf_sym **by_addr;
+  size_t by_addr_count;
 };
 
 /* These callback return statuses are used to tell the invoker of the callback
@@ -96,6 +129,8 @@ static void open_elf(struct elf_info *info);
 static int dissect_elf(struct elf_info *info, int find_debug);
 static void *find_plt_addr(const char *symname, struct elf_info *info);
 static void walk_linkmap(linkmap_cb cb, void *data);
+static void free_symbols(struct elf_info *elf);
+static char *get_debuglink_info(struct elf_info *elf, unsigned long *crc_out);
 
 /*
  * plt_entry - procedure linkage table entry
@@ -179,19 +214,93 @@ struct plt_hook_data {
   void *addr;
 };
 
-struct dso_iter_data {
-  linkmap_lib_cb cb;
-  void *passthru;
+/*
+ * Every shared library memprof has looked at, parsed once and kept around,
+ * so searching all of them (which bin_update_image does for every trampoline)
+ * doesn't mean opening and dissecting every library again each time.
+ *
+ * The list is brought up to date with the link map before each search, but
+ * only when dl_iterate_phdr says libraries have been loaded or unloaded
+ * since the last time. It is kept in link map order, which is the order the
+ * dynamic linker resolves symbols in.
+ *
+ * Nothing ties the bin_* lookups to the ruby thread, so refreshing and
+ * walking the list happen under dso_lock.
+ */
+struct dso {
+  struct dso *next;
+  struct elf_info info;
+  ElfW(Addr) l_addr;
+
+  /* where its loadable segments are mapped, so patches in it can be forgotten */
+  void *start;
+  void *end;
+
+  /* libraries which couldn't be parsed are remembered, so they aren't retried */
+  int usable;
+};
+
+static struct dso *dsos = NULL;
+static pthread_mutex_t dso_lock = PTHREAD_MUTEX_INITIALIZER;
+static int dso_refreshed = 0;
+static unsigned long long dso_adds = 0, dso_subs = 0;
+
+struct dso_refresh_data {
+  unsigned long long adds;
+  unsigned long long subs;
+  int counted;
+
+  /* libraries not (yet) seen on the link map, and where the next one goes */
+  struct dso *unseen;
+  struct dso **tail;
 };
 
+static void
+free_dso(struct dso *dso)
+{
+  dbg_printf("forgetting elf object: %s\n", dso->info.filename);
+  if (dso->usable) {
+    free_symbols(&dso->info);
+    elf_end(dso->info.elf);
+  }
+  free((char *)dso->info.filename);
+  free(dso);
+}
+
+static void
+dso_find_extent(struct dso *dso)
+{
+  GElf_Phdr phdr;
+  GElf_Addr lo = ~(GElf_Addr)0, hi = 0;
+  int i;
+
+  for (i = 0; i < dso->info.ehdr.e_phnum; i++) {
+    if (gelf_getphdr(dso->info.elf, i, &phdr) != &phdr || phdr.p_type != PT_LOAD)
+      continue;
+
+    if (phdr.p_vaddr < lo)
+      lo = phdr.p_vaddr;
+    if (phdr.p_vaddr + phdr.p_memsz > hi)
+      hi = phdr.p_vaddr + phdr.p_memsz;
+  }
+
+  if (lo < hi) {
+    dso->start = (void *)(dso->l_addr + lo);
+    dso->end = (void *)(dso->l_addr + hi);
+  }
+}
+
 static linkmap_cb_status
-for_each_dso_cb(struct link_map *map, void *data)
+dso_refresh_cb(struct link_map *map, void *data)
 {
-  struct dso_iter_data *iter_data = data;
-  struct elf_info curr_lib;
+  struct dso_refresh_data *refresh = data;
+  struct dso *dso = NULL, **prev = NULL;
 
   /* skip a few things we don't care about */
-  if (strstr(map->l_name, "linux-vdso")) {
+  if (!map->l_name || map->l_name[0] == '\0') {
+    dbg_printf("found an empty string (skipping)\n");
+    return CB_CONTINUE;
+  } else if (strstr(map->l_name, "linux-vdso")) {
     dbg_printf("found vdso (skipping): %s\n", map->l_name);
     return CB_CONTINUE;
   } else if (strstr(map->l_name, "ld-linux")) {
@@ -203,47 +312,132 @@ for_each_dso_cb(struct link_map *map, void *data)
   } else if (strstr(map->l_name, "memprof")) {
     dbg_printf("found memprof (skipping): %s\n", map->l_name);
     return CB_CONTINUE;
-  } else if (!map->l_name || map->l_name[0] == '\0') {
-    dbg_printf("found an empty string (skipping)\n");
-    return CB_CONTINUE;
   }
-  memset(&curr_lib, 0, sizeof(curr_lib));
+
+  for (prev = &refresh->unseen; *prev; prev = &(*prev)->next) {
+    dso = *prev;
+    if (dso->l_addr == map->l_addr && strcmp(dso->info.filename, map->l_name) == 0) {
+      *prev = dso->next;
+      dso->next = NULL;
+      *refresh->tail = dso;
+      refresh->tail = &dso->next;
+      return CB_CONTINUE;
+    }
+  }
+
+  dso = calloc(1, sizeof(*dso));
+  if (!dso)
+    errx(EX_UNAVAILABLE, "Unable to allocate memory for elf object %s", map->l_name);
+
   dbg_printf("trying to open elf object: %s\n", map->l_name);
-  curr_lib.filename = map->l_name;
-  open_elf(&curr_lib);
+  dso->info.filename = strdup(map->l_name);
+  open_elf(&dso->info);
 
-  if (curr_lib.elf == NULL) {
+  dso->l_addr = map->l_addr;
+  *refresh->tail = dso;
+  refresh->tail = &dso->next;
+
+  if (dso->info.elf == NULL) {
     dbg_printf("opening the elf object (%s) failed! (skipping)\n", map->l_name);
     return CB_CONTINUE;
   }
 
-  curr_lib.base_addr = map->l_addr;
-  curr_lib.filename = map->l_name;
+  dso->info.base_addr = map->l_addr;
 
-  if (dissect_elf(&curr_lib, 0) == 2) {
+  if (dissect_elf(&dso->info, 0) == 2) {
     dbg_printf("elf file, %s hit an unrecoverable error (skipping)\n", map->l_name);
-    elf_end(curr_lib.elf);
-    close(curr_lib.fd);
+    elf_end(dso->info.elf);
+    close(dso->info.fd);
     return CB_CONTINUE;
   }
 
-  dbg_printf("dissected the elf file: %s, base: %lx\n",
-      curr_lib.filename, (unsigned long)curr_lib.base_addr);
+  /*
+   * libelf maps (or failing that, reads in) the whole file up front, so it
+   * can be closed instead of holding on to a descriptor for every library
+   */
+  elf_cntl(dso->info.elf, ELF_C_FDDONE);
+  close(dso->info.fd);
+  dso->info.fd = -1;
+  dso->usable = 1;
+  dso_find_extent(dso);
 
-  iter_data->cb(&curr_lib, iter_data->passthru);
+  dbg_printf("dissected the elf file: %s, base: %lx\n",
+      dso->info.filename, (unsigned long)dso->info.base_addr);
 
-  elf_end(curr_lib.elf);
-  close(curr_lib.fd);
   return CB_CONTINUE;
 }
 
+static int
+dso_count_cb(struct dl_phdr_info *info, size_t size, void *data)
+{
+  struct dso_refresh_data *refresh = data;
+
+  /* older glibcs don't count loads and unloads */
+  if (size >= offsetof(struct dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs)) {
+    refresh->adds = info->dlpi_adds;
+    refresh->subs = info->dlpi_subs;
+    refresh->counted = 1;
+  }
+
+  /* the counts are the same for every object, so one is enough */
+  return 1;
+}
+
+/* must be called with dso_lock held */
+static void
+dso_refresh()
+{
+  struct dso_refresh_data refresh;
+  struct dso *gone = NULL;
+
+  memset(&refresh, 0, sizeof(refresh));
+  dl_iterate_phdr(dso_count_cb, &refresh);
+
+  if (refresh.counted && dso_refreshed &&
+      refresh.adds == dso_adds && refresh.subs == dso_subs)
+    return;
+
+  dso_adds = refresh.adds;
+  dso_subs = refresh.subs;
+  dso_refreshed = 1;
+
+  /* rebuild the list in link map order, reusing what was already parsed */
+  refresh.unseen = dsos;
+  dsos = NULL;
+  refresh.tail = &dsos;
+
+  walk_linkmap(dso_refresh_cb, &refresh);
+
+  /* forget anything that has been unloaded, and any trampolines inside it */
+  while ((gone = refresh.unseen)) {
+    refresh.unseen = gone->next;
+    if (gone->start)
+      tramp_forget_range(gone->start, gone->end);
+    free_dso(gone);
+  }
+}
+
+void
+bin_check_unloaded()
+{
+  pthread_mutex_lock(&dso_lock);
+  dso_refresh();
+  pthread_mutex_unlock(&dso_lock);
+}
+
 static void
 for_each_dso(linkmap_lib_cb cb, void *passthru)
 {
-  struct dso_iter_data data;
-  data.cb = cb;
-  data.passthru = passthru;
-  walk_linkmap(for_each_dso_cb, &data);
+  struct dso *dso = NULL;
+
+  pthread_mutex_lock(&dso_lock);
+  dso_refresh();
+
+  for (dso = dsos; dso; dso = dso->next) {
+    if (dso->usable)
+      cb(&dso->info, passthru);
+  }
+  pthread_mutex_unlock(&dso_lock);
 }
 
 static void
@@ -269,7 +463,9 @@ hook_required_objects(struct elf_info *info, void *data)
  * or libruby.
  *
  * The page has to be located in a 32bit window from the Ruby code so that
- * jump and call instructions can redirect execution there.
+ * jump and call instructions can redirect execution there. It is called
+ * again each time the trampoline tables fill up, so the search covers the
+ * whole window rather than just the pages after the text segment.
  *
  * This function returns the address of the page found or NULL if no page was
  * found.
@@ -278,7 +474,7 @@ static void *
 do_bin_allocate_page(struct elf_info *info)
 {
   void * ret = NULL, *addr = NULL;
-  uint32_t count = 0;
+  size_t count = 0, reach = 0;
 
   if (!info)
     return NULL;
@@ -288,12 +484,21 @@ do_bin_allocate_page(struct elf_info *info)
      * a page.
      */
     addr = info->text_segment + info->text_segment_len;
-    for (; count < USHRT_MAX; addr += memprof_config.pagesize, count += memprof_config.pagesize) {
+    reach = INT_MAX - info->text_segment_len - memprof_config.pagesize;
+    for (; count < reach; addr += memprof_config.pagesize, count += memprof_config.pagesize) {
       ret = mmap(addr, memprof_config.pagesize, PROT_WRITE|PROT_READ|PROT_EXEC, MAP_ANON|MAP_PRIVATE, -1, 0);
-      if (ret != MAP_FAILED) {
-        memset(ret, 0x90, memprof_config.pagesize);
-        return ret;
+      if (ret == MAP_FAILED)
+        continue;
+
+      /* addr is only a hint, and the kernel may have put the page anywhere */
+      if (ret < info->text_segment ||
+          (size_t)((char *)ret - (char *)info->text_segment) > reach + info->text_segment_len) {
+        munmap(ret, memprof_config.pagesize);
+        continue;
       }
+
+      memset(ret, 0x90, memprof_config.pagesize);
+      return ret;
     }
   } else {
     /* if there is no libruby, use the linux specific MAP_32BIT flag which will
@@ -303,7 +508,9 @@ do_bin_allocate_page(struct elf_info *info)
 #ifndef MAP_32BIT
 #define MAP_32BIT 0 // no MAP_32BIT defined on certain 32bit systems
 #endif
-    return mmap(NULL, memprof_config.pagesize, PROT_WRITE|PROT_READ|PROT_EXEC, MAP_ANON|MAP_PRIVATE|MAP_32BIT, -1, 0);
+    ret = mmap(NULL, memprof_config.pagesize, PROT_WRITE|PROT_READ|PROT_EXEC, MAP_ANON|MAP_PRIVATE|MAP_32BIT, -1, 0);
+    if (ret != MAP_FAILED)
+      return ret;
   }
 
   return NULL;
@@ -404,6 +611,175 @@ find_plt_addr(const char *symname, struct elf_info *info)
   return NULL;
 }
 
+static uint32_t
+sym_hash(const char *name)
+{
+  /* FNV-1a */
+  uint32_t hash = 2166136261U;
+
+  for (; *name; name++) {
+    hash ^= (unsigned char)*name;
+    hash *= 16777619U;
+  }
+
+  return hash;
+}
+
+static struct elf_sym *
+symbols_lookup(struct elf_symbols *symbols, const char *name)
+{
+  size_t i = sym_hash(name) & symbols->hash_mask;
+  struct elf_sym *esym = NULL;
+
+  for (; symbols->hash[i]; i = (i + 1) & symbols->hash_mask) {
+    esym = &symbols->syms[symbols->hash[i] - 1];
+    if (strcmp(esym->name, name) == 0)
+      return esym;
+  }
+
+  return NULL;
+}
+
+static int
+by_addr_cmp(const void *a, const void *b)
+{
+  const struct elf_sym *sa = *(struct elf_sym * const *)a;
+  const struct elf_sym *sb = *(struct elf_sym * const *)b;
+
+  if (sa->addr != sb->addr)
+    return sa->addr < sb->addr ? -1 : 1;
+
+  /* keep symbols at the same address in table order */
+  return sa < sb ? -1 : sa > sb;
+}
+
+static void
+add_symbols(struct elf_info *elf, struct elf_symbols *symbols, Elf_Data *data, int symtab)
+{
+  ElfW(Sym) *esym = (ElfW(Sym) *) data->d_buf;
+  ElfW(Sym) *lastsym = (ElfW(Sym) *) ((char *) data->d_buf + data->d_size);
+  struct elf_sym *sym = NULL;
+  const char *name = NULL;
+  size_t i;
+
+  assert(esym <= lastsym);
+
+  for (; esym < lastsym; esym++) {
+    /* ignore numeric/empty symbols */
+    if ((esym->st_value == 0) ||
+        (ELF32_ST_BIND(esym->st_info)== STB_NUM))
+      continue;
+
+    if (symtab)
+      name = elf_strptr(elf->elf, elf->symtab_shdr.sh_link, (size_t)esym->st_name);
+    else
+      name = elf->dynstr + esym->st_name;
+
+    if (!name)
+      continue;
+
+    sym = &symbols->syms[symbols->count];
+    sym->name = name;
+    sym->addr = elf->base_addr + (void *)esym->st_value;
+    sym->size = esym->st_size;
+    sym->info = esym->st_info;
+
+    /* the first symbol with a name wins, and symtab symbols go in first */
+    if (!symbols_lookup(symbols, name)) {
+      i = sym_hash(name) & symbols->hash_mask;
+      while (symbols->hash[i])
+        i = (i + 1) & symbols->hash_mask;
+      symbols->hash[i] = symbols->count + 1;
+    }
+
+    symbols->count++;
+
+    /* names are looked up in the symtab if there is one, and the dynsym otherwise */
+    if (symtab == (elf->symtab_data && elf->symtab_data->d_buf) &&
+        ELF32_ST_BIND(esym->st_info) != STB_WEAK)
+      symbols->by_addr[symbols->by_addr_count++] = sym;
+  }
+}
+
+static void
+free_symbol_index(struct elf_symbols *symbols)
+{
+  free(symbols->syms);
+  free(symbols->hash);
+  free(symbols->by_addr);
+  free(symbols);
+}
+
+static void
+free_symbols(struct elf_info *elf)
+{
+  if (!elf->symbols)
+    return;
+
+  free_symbol_index(elf->symbols);
+  elf->symbols = NULL;
+}
+
+/*
+ * get_symbols - the symbol index for an elf object, built the first time
+ * it's needed.
+ *
+ * Returns NULL if the index could not be allocated.
+ */
+static struct elf_symbols *
+get_symbols(struct elf_info *elf)
+{
+  struct elf_symbols *symbols = NULL;
+  int has_symtab = elf->symtab_data && elf->symtab_data->d_buf;
+  int has_dynsym = elf->dynsym && elf->dynsym->d_buf && elf->dynstr;
+  size_t max = 0, hash_size = 1;
+
+  if (elf->symbols)
+    return elf->symbols;
+
+  if (has_symtab)
+    max += elf->symtab_data->d_size / sizeof(ElfW(Sym));
+  if (has_dynsym)
+    max += elf->dynsym->d_size / sizeof(ElfW(Sym));
+
+  /* keep the table at most half full */
+  while (hash_size < max * 2)
+    hash_size <<= 1;
+
+  symbols = calloc(1, sizeof(*symbols));
+  if (!symbols)
+    return NULL;
+
+  symbols->syms = calloc(max + 1, sizeof(*symbols->syms));
+  symbols->by_addr = calloc(max + 1, sizeof(*symbols->by_addr));
+  symbols->hash = calloc(hash_size, sizeof(*symbols->hash));
+  symbols->hash_mask = hash_size - 1;
+
+  if (!symbols->syms || !symbols->by_addr || !symbols->hash) {
+    free_symbol_index(symbols);
+    return NULL;
+  }
+
+  if (has_symtab)
+    add_symbols(elf, symbols, elf->symtab_data, 1);
+  if (has_dynsym)
+    add_symbols(elf, symbols, elf->dynsym, 0);
+
+  qsort(symbols->by_addr, symbols->by_addr_count, sizeof(*symbols->by_addr), by_addr_cmp);
+
+  /*
+   * only publish the index once it is complete; if another thread beat us
+   * to it, use theirs
+   */
+  if (!__sync_bool_compare_and_swap(&elf->symbols, NULL, symbols)) {
+    free_symbol_index(symbols);
+    return elf->symbols;
+  }
+
+  dbg_printf("indexed %zd symbols in %s\n", symbols->count, elf->filename);
+  return symbols;
+}
+
 /*
  * do_bin_find_symbol - internal symbol lookup function.
  *
@@ -414,66 +790,28 @@ find_plt_addr(const char *symname, struct elf_info *info)
  *
  * This function will return the address of the symbol (setting size if desired)
  * or NULL if nothing can be found.
+ *
+ * Symbols in the symtab are preferred over those in the dynsym.
  */
 static void *
 do_bin_find_symbol(const char *sym, size_t *size, struct elf_info *elf)
 {
-  const char *name = NULL;
+  struct elf_symbols *symbols = NULL;
+  struct elf_sym *esym = NULL;
 
   assert(sym != NULL);
   assert(elf != NULL);
 
-  ElfW(Sym) *esym, *lastsym = NULL;
-  if (elf->symtab_data && elf->symtab_data->d_buf) {
-    dbg_printf("checking symtab....\n");
-    esym = (ElfW(Sym)*) elf->symtab_data->d_buf;
-    lastsym = (ElfW(Sym)*) ((char*) elf->symtab_data->d_buf + elf->symtab_data->d_size);
-
-    assert(esym <= lastsym);
-
-    for (; esym < lastsym; esym++){
-      /* ignore numeric/empty symbols */
-      if ((esym->st_value == 0) ||
-          (ELF32_ST_BIND(esym->st_info)== STB_NUM))
-        continue;
-
-      name = elf_strptr(elf->elf, elf->symtab_shdr.sh_link, (size_t)esym->st_name);
-
-      if (name && strcmp(name, sym) == 0) {
-        if (size) {
-          *size = esym->st_size;
-        }
-        dbg_printf("Found symbol: %s in symtab\n", sym);
-        return elf->base_addr + (void *)esym->st_value;
-      }
-    }
-  }
-
-  if (elf->dynsym && elf->dynsym->d_buf) {
-    dbg_printf("checking dynsymtab....\n");
-    esym = (ElfW(Sym) *) elf->dynsym->d_buf;
-    lastsym = (ElfW(Sym) *) ((char *) elf->dynsym->d_buf + elf->dynsym->d_size);
-
-    for (; esym < lastsym; esym++){
-      /* ignore numeric/empty symbols */
-      if ((esym->st_value == 0) ||
-          (elf->dynstr == 0) ||
-          (ELF32_ST_BIND(esym->st_info)== STB_NUM))
-        continue;
-
-      name = elf->dynstr + esym->st_name;
-
-      if (name && strcmp(name, sym) == 0) {
-        if (size) {
-          *size = esym->st_size;
-        }
-        dbg_printf("Found symbol: %s in dynsym\n", sym);
-        return elf->base_addr + (void *)esym->st_value;
-      }
+  symbols = get_symbols(elf);
+  if (symbols && (esym = symbols_lookup(symbols, sym)) != NULL) {
+    if (size) {
+      *size = esym->size;
     }
+    dbg_printf("Found symbol: %s in %s\n", sym, elf->filename);
+    return esym->addr;
   }
 
-  dbg_printf("Couldn't find symbol: %s in dynsym\n", sym);
+  dbg_printf("Couldn't find symbol: %s in %s\n", sym, elf->filename);
   return NULL;
 }
 
@@ -483,7 +821,13 @@ find_symbol_cb(struct elf_info *info, void *data)
   assert(info != NULL);
   void *trampee_addr = NULL;
   struct plt_hook_data *hook_data = data;
-  void *ret = do_bin_find_symbol(hook_data->sym, NULL, info);
+  void *ret = NULL;
+
+  /* libraries are searched in link map order, and the first one wins */
+  if (hook_data->addr)
+    return;
+
+  ret = do_bin_find_symbol(hook_data->sym, NULL, info);
   if (ret) {
     hook_data->addr = ret;
     dbg_printf("found %s @ %p, fn addr: %p\n", hook_data->sym, trampee_addr,
@@ -521,49 +865,170 @@ bin_find_symbol(const char *sym, size_t *size, int search_libs)
  *  - sym - the symbol address to look up
  *  - elf - an elf information structure
  *
- * This function will return the name of the symbol
+ * This function will return the name of the symbol starting at sym, or of the
+ * function containing sym (so return addresses can be looked up too),
  * or NULL if nothing can be found.
+ *
+ * The symtab is searched if there is one, and the dynsym otherwise, since
+ * most shared libraries are stripped down to their dynamic symbols.
  */
+/*
+ * containing_function - the function addr falls in, given the position of
+ * the first symbol after it in the address index.
+ */
+static struct elf_sym *
+containing_function(struct elf_symbols *symbols, void *addr, size_t pos)
+{
+  struct elf_sym *esym = NULL;
+
+  /* the function it falls in is the closest one before it */
+  while (pos-- > 0) {
+    esym = symbols->by_addr[pos];
+    if (ELF32_ST_TYPE(esym->info) != STT_FUNC)
+      continue;
+
+    if (addr >= esym->addr && addr < esym->addr + esym->size)
+      return esym;
+
+    /* zero sized functions (hand written asm, mostly) don't end anything */
+    if (esym->size)
+      break;
+  }
+
+  return NULL;
+}
+
 static const char *
 do_bin_find_symbol_name(void *sym, struct elf_info *elf)
 {
-  char *name = NULL;
-  void *ptr;
+  struct elf_symbols *symbols = NULL;
+  struct elf_sym *esym = NULL;
+  size_t lo = 0, hi = 0, mid = 0;
 
   assert(sym != NULL);
   assert(elf != NULL);
 
-  assert(elf->symtab_data != NULL);
-  assert(elf->symtab_data->d_buf != NULL);
+  symbols = get_symbols(elf);
+  if (!symbols)
+    return NULL;
 
-  ElfW(Sym) *esym = (ElfW(Sym)*) elf->symtab_data->d_buf;
-  ElfW(Sym) *lastsym = (ElfW(Sym)*) ((char*) elf->symtab_data->d_buf + elf->symtab_data->d_size);
+  /* find the first symbol at or after sym */
+  hi = symbols->by_addr_count;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (symbols->by_addr[mid]->addr < sym)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
 
-  assert(esym <= lastsym);
+  if (lo < symbols->by_addr_count && symbols->by_addr[lo]->addr == sym)
+    return symbols->by_addr[lo]->name;
 
-  for (; esym < lastsym; esym++){
-    /* ignore weak/numeric/empty symbols */
-    if ((esym->st_value == 0) ||
-        (ELF32_ST_BIND(esym->st_info)== STB_WEAK) ||
-        (ELF32_ST_BIND(esym->st_info)== STB_NUM))
+  esym = containing_function(symbols, sym, lo);
+  return esym ? esym->name : NULL;
+}
+
+/*
+ * Do the same thing as in bin_find_symbol above, but compare addresses and return the string name.
+ */
+const char *
+bin_find_symbol_name(void *sym) {
+  return do_bin_find_symbol_name(sym, ruby_info);
+}
+
+struct symbol_names_data {
+  void **addrs;
+  char **names;
+  char **objects;
+  size_t count;
+};
+
+static int
+text_contains(struct elf_info *info, void *addr)
+{
+  return addr >= info->text_segment &&
+         addr < info->text_segment + info->text_segment_len;
+}
+
+static void
+find_symbol_names_cb(struct elf_info *info, void *passthru)
+{
+  struct symbol_names_data *data = passthru;
+  const char *name = NULL;
+  size_t i;
+
+  for (i = 0; i < data->count; i++) {
+    if (data->objects[i] || !data->addrs[i] || !text_contains(info, data->addrs[i]))
       continue;
 
-    ptr = elf->base_addr + (void *)esym->st_value;
-    name = elf_strptr(elf->elf, elf->symtab_shdr.sh_link, (size_t)esym->st_name);
+    data->objects[i] = strdup(info->filename);
+    if ((name = do_bin_find_symbol_name(data->addrs[i], info)) != NULL)
+      data->names[i] = strdup(name);
+  }
+}
+
+/*
+ * bin_find_symbol_names - look up a batch of addresses in ruby and every
+ * loaded library, opening each library once for the whole batch.
+ */
+void
+bin_find_symbol_names(void **addrs, char **names, char **objects, size_t count)
+{
+  struct symbol_names_data data;
+  size_t i;
 
-    if (ptr == sym)
-      return name;
+  for (i = 0; i < count; i++) {
+    names[i] = NULL;
+    objects[i] = NULL;
   }
 
-  return NULL;
+  data.addrs = addrs;
+  data.names = names;
+  data.objects = objects;
+  data.count = count;
+
+  find_symbol_names_cb(ruby_info, &data);
+
+  for (i = 0; i < count; i++) {
+    if (addrs[i] && !objects[i]) {
+      for_each_dso(find_symbol_names_cb, &data);
+      break;
+    }
+  }
 }
 
 /*
- * Do the same thing as in bin_find_symbol above, but compare addresses and return the string name.
+ * is_call_insn - check a call site found by arch_insert_st1_tramps really is
+ * the start of an instruction, by decoding its function from the top.
+ *
+ * Sites in code with no function symbol, or with instructions the decoder
+ * doesn't know, are given the benefit of the doubt.
  */
-const char *
-bin_find_symbol_name(void *sym) {
-  return do_bin_find_symbol_name(sym, ruby_info);
+static int
+is_call_insn(void *site)
+{
+  struct elf_symbols *symbols = get_symbols(ruby_info);
+  struct elf_sym *func = NULL;
+  size_t lo = 0, hi = 0, mid = 0;
+
+  if (!symbols)
+    return 1;
+
+  /* find the first symbol after site */
+  hi = symbols->by_addr_count;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (symbols->by_addr[mid]->addr <= site)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  if ((func = containing_function(symbols, site, lo)) == NULL)
+    return 1;
+
+  return arch_insn_boundary(func->addr, func->size, site) != 0;
 }
 
 /*
@@ -608,21 +1073,16 @@ bin_update_image(const char *trampee, struct tramp_st2_entry *tramp, void **orig
     dbg_printf("Couldn't find %s in the PLT...\n", trampee);
 
     if (trampee_addr) {
-      unsigned char *byte = ruby_info->text_segment;
-      size_t count = 0;
       int num = 0;
 
-      assert(byte != NULL);
+      assert(ruby_info->text_segment != NULL);
 
       if (orig_func) {
         *orig_func = trampee_addr;
       }
 
-      for(; count < ruby_info->text_segment_len; byte++, count++) {
-        if (arch_insert_st1_tramp(byte, trampee_addr, tramp) == 0) {
-          num++;
-        }
-      }
+      num = arch_insert_st1_tramps(ruby_info->text_segment, ruby_info->text_segment_len,
+                                   trampee_addr, tramp, is_call_insn);
 
       dbg_printf("Inserted %d tramps for: %s\n", num, trampee);
     }
@@ -725,6 +1185,25 @@ search_dies(Dwarf_Die die, const char *name, Dwarf_Half type)
   return 0;
 }
 
+/*
+ * dwarf_open - start reading ruby's debugging data.
+ *
+ * This is put off until a type is first looked up, since the types can
+ * usually be found in the config cache, and then DWARF is never needed.
+ */
+static void
+dwarf_open()
+{
+  Dwarf_Error dwrf_err;
+
+  if (dwrf)
+    return;
+
+  if (dwarf_elf_init(ruby_info->elf, DW_DLC_READ, NULL, NULL, &dwrf, &dwrf_err) != DW_DLV_OK) {
+    errx(EX_DATAERR, "unable to read debugging data from binary. was it compiled with -g? is it unstripped?");
+  }
+}
+
 static Dwarf_Die
 find_die(const char *name, Dwarf_Half type)
 {
@@ -741,6 +1220,8 @@ find_die(const char *name, Dwarf_Half type)
   Dwarf_Die cu_die = 0;
   int res = DW_DLV_ERROR;
 
+  dwarf_open();
+
   for (;;++cu_number) {
     no_die = 0;
     cu_die = 0;
@@ -914,6 +1395,46 @@ bin_type_member_offset(const char *type, const char *member)
   return -1;
 }
 
+int
+bin_build_key(char *buf, size_t len)
+{
+  Elf_Data *note = ruby_info->build_id_data;
+  unsigned char *desc = NULL;
+  uint32_t namesz, descsz;
+  unsigned long crc = 0;
+  struct stat st;
+  size_t i, n = 0;
+
+  /* a note is a namesz, descsz and type header, then the name and desc, each 4 byte aligned */
+  if (note && note->d_size >= 12) {
+    memcpy(&namesz, note->d_buf, 4);
+    memcpy(&descsz, (char *)note->d_buf + 4, 4);
+    desc = (unsigned char *)note->d_buf + 12 + ((namesz + 3) & ~3);
+
+    if (descsz > 0 && desc + descsz <= (unsigned char *)note->d_buf + note->d_size &&
+        len > descsz * 2) {
+      for (i = 0; i < descsz; i++)
+        n += snprintf(buf + n, len - n, "%02x", desc[i]);
+      return 0;
+    }
+  }
+
+  if (ruby_info->debuglink_data) {
+    get_debuglink_info(ruby_info, &crc);
+    if ((size_t)snprintf(buf, len, "crc-%08lx", crc) < len)
+      return 0;
+  }
+
+  /* without either, settle for the file itself not having changed */
+  if (stat(ruby_info->filename, &st) == 0 &&
+      (size_t)snprintf(buf, len, "stat-%lx-%lx-%lx-%lx", (unsigned long)st.st_dev,
+                       (unsigned long)st.st_ino, (unsigned long)st.st_size,
+                       (unsigned long)st.st_mtime) < len)
+    return 0;
+
+  return -1;
+}
+
 /*
  * open_elf - Opens a file from disk and gets the elf reader started.
  *
@@ -1180,6 +1701,13 @@ dissect_elf(struct elf_info *info, int find_debug)
         dbg_printf("gnu_debuglink section read (size: %zd)\n", shdr.sh_size);
       }
     }
+    /*
+     * The build-id identifies this exact build, for bin_build_key.
+     */
+    else if (shdr.sh_type == SHT_NOTE &&
+        strcmp(elf_strptr(elf, shstrndx, shdr.sh_name), ".note.gnu.build-id") == 0) {
+      info->build_id_data = elf_getdata(scn, NULL);
+    }
     /*
      * The symbol table is also needed for bin_find_symbol
      */
@@ -1249,8 +1777,6 @@ out:
 void
 bin_init()
 {
-  Dwarf_Error dwrf_err;
-
   ruby_info = calloc(1, sizeof(*ruby_info));
 
   if (!ruby_info) {
@@ -1274,10 +1800,6 @@ bin_init()
     errx(EX_DATAERR, "Error trying to parse elf file: %s\n", ruby_info->filename);
   }
 
-  if (dwarf_elf_init(ruby_info->elf, DW_DLC_READ, NULL, NULL, &dwrf, &dwrf_err) != DW_DLV_OK) {
-    errx(EX_DATAERR, "unable to read debugging data from binary. was it compiled with -g? is it unstripped?");
-  }
-
   dbg_printf("bin_init finished\n");
 }
 #endif
@@ -71,10 +71,24 @@ unless have_library('yajl_ext') and have_header('json/json_gen.h')
   raise 'Yajl build failed'
 end
 
+###
+# pthreads (for Memprof.dump_all :threads)
+
+unless have_header('pthread.h') and have_library('pthread', 'pthread_create')
+  raise 'pthreads are required'
+end
+
 def add_define(name)
   $defs.push("-D#{name}")
 end
 
+###
+# zlib (optional, for compressed dumps and traces)
+
+if have_header('zlib.h') and have_library('z', 'deflateInit2_')
+  add_define 'HAVE_ZLIB'
+end
+
 if RUBY_PLATFORM =~ /linux/
   ###
   # libelf
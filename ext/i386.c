@@ -103,4 +103,21 @@ arch_insert_inline_st2_tramp(void *addr, void *marker, void *trampoline, void *t
 
   return 1;
 }
+/*
+ * The stage 2 trampoline only pushes %ebx before calling the handler, so the
+ * caller's return address sits above the handler's saved %ebp, its return
+ * address into the trampoline, and the saved %ebx.
+ */
+void *
+arch_tramp_caller(void *frame)
+{
+  return ((void **)frame)[3];
+}
+
+/* the trampoline leaves %ebp alone, so the handler saved the caller's */
+void *
+arch_tramp_caller_frame(void *frame)
+{
+  return ((void **)frame)[0];
+}
 #endif
@@ -6,9 +6,13 @@
 
 /*
  * This is the "normal" stage 2 trampoline with a default entry pre-filled
+ *
+ * Entries are 12 bytes and addr sits at offset 4, so it can be switched
+ * with a single atomic store.
  */
 static struct tramp_st2_entry {
   unsigned char ebx_save;
+  unsigned char pad[2];
   unsigned char mov;
   void *addr;
   unsigned char call[2];
@@ -16,6 +20,7 @@ static struct tramp_st2_entry {
   unsigned char ret;
 } __attribute__((__packed__)) default_st2_tramp = {
   .ebx_save      = 0x53,            /* push ebx */
+  .pad           = {0x66, 0x90},    /* xchg ax, ax (nop), to align addr */
   .mov           = 0xbb,            /* mov addr into ebx */
   .addr          = 0,               /* this is filled in later */
   .call          = {0xff, 0xd3},    /* calll *ebx */
@@ -3,15 +3,109 @@
 #endif
 
 #include <assert.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "bindump.h"
 #include "json.h"
 
+json_gen_status
+memprof_gen_integer(json_gen gen, long int number)
+{
+  if (bindump_gen_p(gen))
+    return bindump_integer(gen, number);
+  return (json_gen_integer)(gen, number);
+}
+
+json_gen_status
+memprof_gen_double(json_gen gen, double number)
+{
+  if (bindump_gen_p(gen))
+    return bindump_double(gen, number);
+  return (json_gen_double)(gen, number);
+}
+
+json_gen_status
+memprof_gen_number(json_gen gen, const char *num, unsigned int len)
+{
+  if (bindump_gen_p(gen))
+    return bindump_number(gen, num, len);
+  return (json_gen_number)(gen, num, len);
+}
+
+json_gen_status
+memprof_gen_string(json_gen gen, const unsigned char *str, unsigned int len)
+{
+  if (bindump_gen_p(gen))
+    return bindump_string(gen, str, len);
+  return (json_gen_string)(gen, str, len);
+}
+
+json_gen_status
+memprof_gen_null(json_gen gen)
+{
+  if (bindump_gen_p(gen))
+    return bindump_tag_only(gen, BINDUMP_NULL);
+  return (json_gen_null)(gen);
+}
+
+json_gen_status
+memprof_gen_bool(json_gen gen, int boolean)
+{
+  if (bindump_gen_p(gen))
+    return bindump_tag_only(gen, boolean ? BINDUMP_TRUE : BINDUMP_FALSE);
+  return (json_gen_bool)(gen, boolean);
+}
+
+json_gen_status
+memprof_gen_map_open(json_gen gen)
+{
+  if (bindump_gen_p(gen))
+    return bindump_tag_only(gen, BINDUMP_MAP_OPEN);
+  return (json_gen_map_open)(gen);
+}
+
+json_gen_status
+memprof_gen_map_close(json_gen gen)
+{
+  if (bindump_gen_p(gen))
+    return bindump_tag_only(gen, BINDUMP_MAP_CLOSE);
+  return (json_gen_map_close)(gen);
+}
+
+json_gen_status
+memprof_gen_array_open(json_gen gen)
+{
+  if (bindump_gen_p(gen))
+    return bindump_tag_only(gen, BINDUMP_ARRAY_OPEN);
+  return (json_gen_array_open)(gen);
+}
+
+json_gen_status
+memprof_gen_array_close(json_gen gen)
+{
+  if (bindump_gen_p(gen))
+    return bindump_tag_only(gen, BINDUMP_ARRAY_CLOSE);
+  return (json_gen_array_close)(gen);
+}
+
+void
+memprof_gen_clear(json_gen gen)
+{
+  if (!bindump_gen_p(gen))
+    (json_gen_clear)(gen);
+}
+
 void
 json_gen_reset(json_gen gen)
 {
+  if (bindump_gen_p(gen)) {
+    bindump_tag_only(gen, BINDUMP_RECORD_END);
+    return;
+  }
+
   json_gen_clear(gen);
   assert (gen->state[gen->depth] == json_gen_complete);
   gen->state[gen->depth] = json_gen_start;
@@ -49,5 +143,16 @@ json_gen_format(json_gen gen, char *format, ...)
 json_gen_status
 json_gen_pointer(json_gen gen, void* ptr)
 {
+  if (bindump_gen_p(gen))
+    return bindump_pointer(gen, ptr);
   return json_gen_format(gen, "0x%x", ptr);
 }
+
+json_gen_status
+json_gen_ms(json_gen gen, uint64_t ns)
+{
+  char buf[32];
+  uint64_t us = ns / 1000;
+  int len = snprintf(buf, sizeof(buf), "%" PRIu64 ".%03" PRIu64, us / 1000, us % 1000);
+  return json_gen_number(gen, buf, len);
+}
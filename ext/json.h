@@ -2,6 +2,7 @@
 #define __JSON__H_
 
 #include <stdarg.h>
+#include <stdint.h>
 #include <json/json_gen.h>
 
 /* HAX: copied from internal json_gen.c (PATCH json before building instead)
@@ -33,6 +34,35 @@ struct json_gen_t
 /* END HAX
  */
 
+/*
+ * Route all generator calls through the wrappers in json.c, so the same
+ * dump code can also write memprof's binary format (see bindump.h).
+ * The real yajl functions are still reachable as (json_gen_integer)(...).
+ */
+#define json_gen_integer(gen, number)    memprof_gen_integer(gen, number)
+#define json_gen_double(gen, number)     memprof_gen_double(gen, number)
+#define json_gen_number(gen, num, len)   memprof_gen_number(gen, num, len)
+#define json_gen_string(gen, str, len)   memprof_gen_string(gen, str, len)
+#define json_gen_null(gen)               memprof_gen_null(gen)
+#define json_gen_bool(gen, boolean)      memprof_gen_bool(gen, boolean)
+#define json_gen_map_open(gen)           memprof_gen_map_open(gen)
+#define json_gen_map_close(gen)          memprof_gen_map_close(gen)
+#define json_gen_array_open(gen)         memprof_gen_array_open(gen)
+#define json_gen_array_close(gen)        memprof_gen_array_close(gen)
+#define json_gen_clear(gen)              memprof_gen_clear(gen)
+
+json_gen_status memprof_gen_integer(json_gen gen, long int number);
+json_gen_status memprof_gen_double(json_gen gen, double number);
+json_gen_status memprof_gen_number(json_gen gen, const char *num, unsigned int len);
+json_gen_status memprof_gen_string(json_gen gen, const unsigned char *str, unsigned int len);
+json_gen_status memprof_gen_null(json_gen gen);
+json_gen_status memprof_gen_bool(json_gen gen, int boolean);
+json_gen_status memprof_gen_map_open(json_gen gen);
+json_gen_status memprof_gen_map_close(json_gen gen);
+json_gen_status memprof_gen_array_open(json_gen gen);
+json_gen_status memprof_gen_array_close(json_gen gen);
+void memprof_gen_clear(json_gen gen);
+
 void
 json_gen_reset(json_gen gen);
 
@@ -45,4 +75,11 @@ json_gen_format(json_gen gen, char *format, ...);
 json_gen_status
 json_gen_pointer(json_gen gen, void* ptr);
 
+/*
+ * json_gen_ms - print a duration given in ns as milliseconds, with
+ * microsecond precision (i.e. 1.234)
+ */
+json_gen_status
+json_gen_ms(json_gen gen, uint64_t ns);
+
 #endif
\ No newline at end of file
@@ -272,11 +272,8 @@ update_mach_section(const struct mach_header *header, const struct section_64 *s
   }
 
   if (strcmp(sect->sectname, "__text") == 0) {
-    size_t count = 0;
-    for(; count < len; section++, count++) {
-      if (arch_insert_st1_tramp(section, trampee_addr, tramp) == 0) {
-        ret = 0;
-      }
+    if (arch_insert_st1_tramps(section, len, trampee_addr, tramp, NULL) > 0) {
+      ret = 0;
     }
   }
   return ret;
@@ -636,6 +633,30 @@ bin_find_symbol_name(void *symbol) {
   return sym_data.name;
 }
 
+/*
+ * dyld already keeps track of which image an address belongs to, and the
+ * closest exported symbol below it, which is close enough for naming callers.
+ */
+void
+bin_find_symbol_names(void **addrs, char **names, char **objects, size_t count)
+{
+  Dl_info info;
+  size_t i;
+
+  for (i = 0; i < count; i++) {
+    names[i] = NULL;
+    objects[i] = NULL;
+
+    if (!addrs[i] || !dladdr(addrs[i], &info))
+      continue;
+
+    if (info.dli_sname)
+      names[i] = strdup(info.dli_sname);
+    if (info.dli_fname)
+      objects[i] = strdup(info.dli_fname);
+  }
+}
+
 /*
  * I will explain bin_update_image with imaginary Ruby code:
  *
@@ -749,6 +770,21 @@ bin_type_member_offset(const char *type, const char *member)
   return -1;
 }
 
+int
+bin_build_key(char *buf, size_t len)
+{
+  /* types never come from debug info here, so there is nothing to cache */
+  (void) buf;
+  (void) len;
+  return -1;
+}
+
+void
+bin_check_unloaded()
+{
+  /* ruby never unloads the bundles it loads, and dyld can't unload dylibs */
+}
+
 void
 bin_init()
 {
@@ -6,8 +6,11 @@
 
 #include <assert.h>
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -21,6 +24,13 @@
 
 #include "arch.h"
 #include "bin_api.h"
+#include "bindump.h"
+#include "config_cache.h"
+#include "objtable.h"
+#include "output.h"
+#include "sites.h"
+#include "slab.h"
+#include "stacks.h"
 #include "tracer.h"
 #include "tramp.h"
 #include "util.h"
@@ -31,12 +41,30 @@
 static VALUE eUnsupported;
 static int track_objs = 0;
 static int memprof_started = 0;
-static st_table *objs = NULL;
+static struct obj_table objs;
+
+/*
+ * Objects freed while track_objs is off (by a GC during Memprof.stats, say)
+ * keep their entries, since the table may be being walked. Once that has
+ * happened, stale entries are dropped when their slot is handed out again.
+ */
+static int objs_stale = 0;
+static struct slab_allocator tracker_slab;
+
+/*
+ * allocation sampling: when sample_rate > 1, only one in sample_rate objects
+ * (on average) is tracked, and counts are scaled back up in Memprof.stats
+ */
+static unsigned long sample_rate = 1;
+static unsigned long sample_countdown = 1;
+static uint64_t sample_seed = 88172645463325252ULL;
 
 /*
  * stuff needed for heap dumping
  */
 static VALUE (*rb_classname)(VALUE);
+static int dump_threaded = 0;
+static struct obj_table dump_names;
 static RUBY_DATA_FUNC *rb_bm_mark;
 static RUBY_DATA_FUNC *rb_blk_free;
 static RUBY_DATA_FUNC *rb_thread_mark;
@@ -50,37 +78,124 @@ static void init_memprof_config_extended();
 
 struct obj_track {
   VALUE obj;
-  char *source;
-  int line;
-  int len;
-  struct timeval time[];
+  uint32_t site;
+  /* clock ticks since tracking_start_ticks */
+  uint64_t time;
 };
 
+/*
+ * allocation timestamps are stored as clock ticks relative to when tracking
+ * started, and converted back to wall clock microseconds when dumped
+ */
+static uint64_t tracking_start_ticks = 0;
+static uint64_t tracking_start_us = 0;
+
+/*
+ * An object's class isn't set until after rb_newobj() returns, so the most
+ * recently allocated tracker is kept here and only assigned a site on the
+ * next allocation (or before the next GC, or before stats are printed).
+ */
+static struct {
+  struct obj_track *tracker;
+  uint32_t stack;
+} pending;
+
+/* how many ruby frames to record for each allocation */
+static int stack_frames = 1;
+
 static VALUE gc_hook;
 static void **ptr_to_rb_mark_table_add_filename = NULL;
 static void (*rb_mark_table_add_filename)(char*);
 static void (*rb_add_freelist)(VALUE);
 
-static int
-ree_sourcefile_mark_each(st_data_t key, st_data_t val, st_data_t arg)
+/*
+ * Sites refer to classes by name rather than holding on to the class, so
+ * they never keep it alive. Names are looked up without calling back into
+ * ruby, since classname() may allocate the path it caches on the class and
+ * this runs from the newobj trampoline and during GC.
+ *
+ * Recent lookups are cached by class. A class can only be freed (and its
+ * slot reused) by a GC, so the cache is flushed when the GC marks us.
+ */
+#define CLASS_NAME_CACHE_SIZE 256
+
+static ID id_classpath, id_tmp_classpath, id_classid;
+static struct {
+  VALUE klass;
+  const char *name;
+} class_name_cache[CLASS_NAME_CACHE_SIZE];
+
+static void
+class_name_cache_flush()
 {
-  struct obj_track *tracker = (struct obj_track *)val;
-  assert(tracker != NULL);
+  memset(class_name_cache, 0, sizeof(class_name_cache));
+}
 
-  if (tracker->source)
-    rb_mark_table_add_filename(tracker->source);
-  return ST_CONTINUE;
+static const char *
+class_name_for_site(VALUE klass)
+{
+  size_t idx = (klass >> 3) & (CLASS_NAME_CACHE_SIZE - 1);
+  st_table *iv_tbl = RCLASS(klass)->iv_tbl;
+  st_data_t path = 0;
+  const char *name = NULL;
+  char anon[64];
+
+  if (class_name_cache[idx].klass == klass)
+    return class_name_cache[idx].name;
+
+  if (iv_tbl) {
+    if (st_lookup(iv_tbl, (st_data_t)id_classpath, &path) && TYPE(path) == T_STRING)
+      name = site_name_intern(RSTRING_PTR(path));
+    else if (st_lookup(iv_tbl, (st_data_t)id_classid, &path) && SYMBOL_P(path))
+      name = site_name_intern(rb_id2name(SYM2ID(path)));
+    else if (st_lookup(iv_tbl, (st_data_t)id_tmp_classpath, &path) && TYPE(path) == T_STRING)
+      name = site_name_intern(RSTRING_PTR(path));
+  }
+
+  if (name) {
+    class_name_cache[idx].klass = klass;
+    class_name_cache[idx].name = name;
+    return name;
+  }
+
+  /* anonymous for now, but it may be named later so don't cache this */
+  snprintf(anon, sizeof(anon), "#<%s:0x%lx>",
+           BUILTIN_TYPE(klass) == T_MODULE ? "Module" : "Class", (unsigned long)klass);
+  return site_name_intern(anon);
 }
 
-static int
-mri_sourcefile_mark_each(st_data_t key, st_data_t val, st_data_t arg)
+static void
+objs_record_pending()
 {
-  struct obj_track *tracker = (struct obj_track *)val;
-  assert(tracker != NULL);
+  struct obj_track *tracker = pending.tracker;
+  const char *klass_name = NULL;
+  int type;
 
-  if (tracker->source)
-    (tracker->source)[-1] = 1;
-  return ST_CONTINUE;
+  if (!tracker)
+    return;
+
+  pending.tracker = NULL;
+
+  switch (type = BUILTIN_TYPE(tracker->obj)) {
+    case T_NONE:
+    case T_BLKTAG:
+    case T_UNDEF:
+    case T_VARMAP:
+    case T_SCOPE:
+    case T_NODE:
+      break;
+    default:
+      if (RBASIC(tracker->obj)->klass)
+        klass_name = class_name_for_site(rb_class_real(RBASIC(tracker->obj)->klass));
+  }
+
+  tracker->site = site_intern(pending.stack, klass_name, type);
+
+  if (tracker->site != SITE_NONE) {
+    struct site *site = site_get(tracker->site);
+    site->allocated++;
+    site->live++;
+  }
 }
 
 /* Accomodate the different source file marking techniques of MRI and REE.
@@ -93,52 +208,180 @@ mri_sourcefile_mark_each(st_data_t key, st_data_t val, st_data_t arg)
 static void
 sourcefile_marker()
 {
+  struct stack_frame *frame = NULL;
+  size_t i;
+
+  objs_record_pending();
+
   if (ptr_to_rb_mark_table_add_filename) {
     rb_mark_table_add_filename = *ptr_to_rb_mark_table_add_filename;
     assert(rb_mark_table_add_filename != NULL);
-    st_foreach(objs, ree_sourcefile_mark_each, (st_data_t)NULL);
+  }
+
+  for (i = 0; i < stack_count(); i++) {
+    frame = stack_get(i);
+
+    if (frame->file) {
+      if (ptr_to_rb_mark_table_add_filename)
+        rb_mark_table_add_filename(frame->file);
+      else
+        (frame->file)[-1] = 1;
+    }
+  }
+
+  /* classes may be freed by this GC, so forget which names they had */
+  class_name_cache_flush();
+}
+
+/*
+ * Record the current ruby backtrace (up to stack_frames deep) in the stack
+ * trie, and return the id of its innermost frame.
+ *
+ * The first frame is the line currently being executed. Each ruby FRAME
+ * then holds the node its method was called from, like in rb_backtrace().
+ */
+static uint32_t
+stack_capture()
+{
+  char *files[STACK_MAX_FRAMES];
+  int lines[STACK_MAX_FRAMES];
+  int depth = 0;
+  struct FRAME *frame = NULL;
+  uint32_t id = STACK_NONE;
+
+  if (ruby_current_node && ruby_current_node->nd_file &&
+      *ruby_current_node->nd_file) {
+    files[0] = ruby_current_node->nd_file;
+    lines[0] = nd_line(ruby_current_node);
+  } else if (ruby_sourcefile) {
+    files[0] = ruby_sourcefile;
+    lines[0] = ruby_sourceline;
   } else {
-    st_foreach(objs, mri_sourcefile_mark_each, (st_data_t)NULL);
+    files[0] = NULL;
+    lines[0] = 0;
   }
+  depth = 1;
+
+  for (frame = ruby_frame; frame && depth < stack_frames; frame = frame->prev) {
+    if (!frame->node)
+      break;
+
+    /* cfuncs share the node of the ruby method that called them */
+    if (frame->node->nd_file == files[depth-1] && nd_line(frame->node) == lines[depth-1])
+      continue;
+
+    files[depth] = frame->node->nd_file;
+    lines[depth] = nd_line(frame->node);
+    depth++;
+  }
+
+  /* insert the outermost frame first, so common callers share nodes */
+  while (depth-- > 0) {
+    id = stack_intern(id, files[depth], lines[depth]);
+    if (id == STACK_NONE)
+      break;
+  }
+
+  return id;
+}
+
+/*
+ * Pick the number of allocations until the next sample from a geometric
+ * distribution with mean sample_rate, so sampled objects are a Poisson
+ * process over the allocation stream and can't alias with periodic
+ * allocation patterns.
+ */
+static unsigned long
+sample_next_interval()
+{
+  double u;
+
+  if (sample_rate <= 1)
+    return 1;
+
+  /* xorshift64*, so we don't disturb the state of any libc/ruby PRNG */
+  sample_seed ^= sample_seed >> 12;
+  sample_seed ^= sample_seed << 25;
+  sample_seed ^= sample_seed >> 27;
+  u = ((sample_seed * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+
+  if (u <= 0.0)
+    u = 1e-16;
+
+  return 1 + (unsigned long)(log(u) / log(1.0 - 1.0 / sample_rate));
+}
+
+static inline int
+sample_this_obj()
+{
+  if (sample_rate <= 1)
+    return 1;
+
+  if (--sample_countdown > 0)
+    return 0;
+
+  sample_countdown = sample_next_interval();
+  return 1;
+}
+
+/*
+ * Forget a tracked object that has been freed, and count it against its
+ * site.
+ */
+static void
+objs_forget(struct obj_track *tracker)
+{
+  if (tracker == pending.tracker) {
+    pending.tracker = NULL;
+  } else if (tracker->site != SITE_NONE) {
+    struct site *site = site_get(tracker->site);
+    site->freed++;
+    site->live--;
+  }
+  slab_free(&tracker_slab, tracker);
 }
 
 static VALUE
 newobj_tramp()
 {
-  VALUE ret = rb_newobj();
-  struct obj_track *tracker = NULL;
+  VALUE ret;
+  struct obj_track *tracker = NULL, *stale = NULL;
 
-  if (track_objs && objs) {
-    tracker = malloc(sizeof(*tracker) + sizeof(struct timeval));
+  /* must happen before rb_newobj(), which might GC the pending object */
+  objs_record_pending();
+
+  ret = rb_newobj();
+
+  if (track_objs && sample_this_obj()) {
+    tracker = slab_alloc(&tracker_slab);
 
     if (tracker) {
-      if (ruby_current_node && ruby_current_node->nd_file &&
-          *ruby_current_node->nd_file) {
-        tracker->source = ruby_current_node->nd_file;
-        tracker->line = nd_line(ruby_current_node);
-      } else if (ruby_sourcefile) {
-        tracker->source = ruby_sourcefile;
-        tracker->line = ruby_sourceline;
-      } else {
-        tracker->source = NULL;
-        tracker->line = 0;
-      }
+      pending.stack = stack_capture();
 
       tracker->obj = ret;
-      tracker->len = 1;
+      tracker->site = SITE_NONE;
 
-      /* TODO a way for the user to disallow time tracking */
-      if (gettimeofday(&tracker->time[0], NULL) == -1) {
-        perror("gettimeofday failed. Continuing anyway, error");
+      tracker->time = clock_ticks() - tracking_start_ticks;
+
+      /* the table never allocates through ruby, so no GC can happen here */
+      if (obj_table_insert(&objs, ret, tracker, (void **)&stale) != 0) {
+        slab_free(&tracker_slab, tracker);
+        tracker = NULL;
+      } else {
+        /* the slot's previous object was freed while we weren't looking */
+        if (stale)
+          objs_forget(stale);
+        pending.tracker = tracker;
       }
+    }
 
-      rb_gc_disable();
-      st_insert(objs, (st_data_t)ret, (st_data_t)tracker);
-      rb_gc_enable();
-    } else {
+    if (!tracker) {
       fprintf(stderr, "Warning, unable to allocate a tracker. "
               "You are running dangerously low on RAM!\n");
     }
+  } else if (track_objs && objs_stale) {
+    if ((stale = obj_table_delete(&objs, ret)))
+      objs_forget(stale);
   }
 
   return ret;
@@ -153,86 +396,147 @@ freelist_tramp(unsigned long rval)
     rb_add_freelist(rval);
   }
 
-  if (track_objs && objs) {
-    st_delete(objs, (st_data_t *) &rval, (st_data_t *) &tracker);
-    if (tracker) {
-      free(tracker);
-    }
+  if (track_objs) {
+    tracker = obj_table_delete(&objs, rval);
+    if (tracker)
+      objs_forget(tracker);
+  } else if (objs.num_entries) {
+    objs_stale = 1;
   }
 }
 
-static int
-objs_free(st_data_t key, st_data_t record, st_data_t arg)
+/*
+ * Drop every tracked object. The trackers themselves are released in bulk
+ * by unmapping their slabs, instead of being free'd one at a time.
+ */
+static void
+objs_free()
 {
-  struct obj_track *tracker = (struct obj_track *)record;
-  free(tracker);
-  return ST_DELETE;
+  pending.tracker = NULL;
+  obj_table_clear(&objs);
+  objs_stale = 0;
+  slab_release(&tracker_slab);
+  class_name_cache_flush();
+  site_table_clear();
+  stack_table_clear();
 }
 
-static int
-objs_tabulate(st_data_t key, st_data_t record, st_data_t arg)
+static const char *
+site_class_name(struct site *site)
 {
-  st_table *table = (st_table *)arg;
-  struct obj_track *tracker = (struct obj_track *)record;
-  char *source_key = NULL;
-  unsigned long count = 0;
-  char *type = NULL;
-  int bytes_printed = 0;
-
-  switch (TYPE(tracker->obj)) {
+  switch (site->type) {
     case T_NONE:
-      type = "__none__"; break;
+      return "__none__";
     case T_BLKTAG:
-      type = "__blktag__"; break;
+      return "__blktag__";
     case T_UNDEF:
-      type = "__undef__"; break;
+      return "__undef__";
     case T_VARMAP:
-      type = "__varmap__"; break;
+      return "__varmap__";
     case T_SCOPE:
-      type = "__scope__"; break;
+      return "__scope__";
     case T_NODE:
-      type = "__node__"; break;
+      return "__node__";
     default:
-      if (RBASIC(tracker->obj)->klass) {
-        type = (char*) rb_obj_classname(tracker->obj);
-      } else {
-        type = "__unknown__";
-      }
+      if (site->klass_name)
+        return site->klass_name;
+      else
+        return "__unknown__";
   }
+}
 
-  bytes_printed = asprintf(&source_key, "%s:%d:%s", tracker->source ? tracker->source : "__null__", tracker->line, type);
+/*
+ * Describe a site as file:line:Class, followed by " <- file:line" for each
+ * calling frame when backtraces are being recorded.
+ */
+static char *
+site_describe(struct site *site)
+{
+  struct stack_frame *frame = NULL;
+  char *str = NULL, *prev = NULL;
+  int bytes_printed = 0;
+  uint32_t id = site->stack;
+
+  frame = id == STACK_NONE ? NULL : stack_get(id);
+  bytes_printed = asprintf(&str, "%s:%d:%s",
+                           frame && frame->file ? frame->file : "__null__",
+                           frame ? frame->line : 0,
+                           site_class_name(site));
   assert(bytes_printed != -1);
-  st_lookup(table, (st_data_t)source_key, (st_data_t *)&count);
-  if (st_insert(table, (st_data_t)source_key, ++count)) {
-    free(source_key);
+
+  while (frame && frame->parent != STACK_NONE) {
+    frame = stack_get(frame->parent);
+    prev = str;
+    bytes_printed = asprintf(&str, "%s <- %s:%d", prev, frame->file ? frame->file : "__null__", frame->line);
+    assert(bytes_printed != -1);
+    free(prev);
   }
 
-  return ST_CONTINUE;
+  return str;
 }
 
-struct results {
-  char **entries;
-  size_t num_entries;
+struct site_result {
+  uint32_t site;
+  unsigned long count;
 };
 
 static int
-objs_to_array(st_data_t key, st_data_t record, st_data_t arg)
+site_result_cmp(const void *obj1, const void *obj2)
 {
-  struct results *res = (struct results *)arg;
-  unsigned long count = (unsigned long)record;
-  char *source = (char *)key;
-  int bytes_printed = 0;
+  const struct site_result *res1 = obj1;
+  const struct site_result *res2 = obj2;
 
-  bytes_printed = asprintf(&(res->entries[res->num_entries++]), "%7li %s", count, source);
-  assert(bytes_printed != -1);
+  if (res1->count != res2->count)
+    return res1->count < res2->count ? 1 : -1;
 
-  free(source);
-  return ST_DELETE;
+  return res1->site < res2->site ? -1 : res1->site > res2->site;
 }
 
 static VALUE
-memprof_start(VALUE self)
+memprof_start(int argc, VALUE *argv, VALUE self)
 {
+  VALUE opts = Qnil, rate = Qnil, clock = Qnil, frames = Qnil;
+  long new_rate = 1, new_frames = 1;
+  clock_source_t new_clock = CLOCK_SOURCE_TSC;
+  struct timeval now;
+
+  rb_scan_args(argc, argv, "01", &opts);
+
+  if (RTEST(opts)) {
+    if (TYPE(opts) != T_HASH)
+      rb_raise(rb_eArgError, "options must be a hash");
+
+    rate = rb_hash_aref(opts, ID2SYM(rb_intern("sample_rate")));
+    if (RTEST(rate)) {
+      new_rate = NUM2LONG(rate);
+      if (new_rate < 1)
+        rb_raise(rb_eArgError, "sample_rate must be at least 1");
+    }
+
+    frames = rb_hash_aref(opts, ID2SYM(rb_intern("frames")));
+    if (RTEST(frames)) {
+      new_frames = NUM2LONG(frames);
+      if (new_frames < 1 || new_frames > STACK_MAX_FRAMES)
+        rb_raise(rb_eArgError, "frames must be between 1 and %d", STACK_MAX_FRAMES);
+    }
+
+    clock = rb_hash_aref(opts, ID2SYM(rb_intern("clock")));
+    if (RTEST(clock)) {
+      if (!SYMBOL_P(clock))
+        rb_raise(rb_eArgError, "clock must be one of :tsc, :coarse or :off");
+      else if (SYM2ID(clock) == rb_intern("tsc"))
+        new_clock = CLOCK_SOURCE_TSC;
+      else if (SYM2ID(clock) == rb_intern("coarse"))
+        new_clock = CLOCK_SOURCE_COARSE;
+      else if (SYM2ID(clock) == rb_intern("off"))
+        new_clock = CLOCK_SOURCE_OFF;
+      else
+        rb_raise(rb_eArgError, "clock must be one of :tsc, :coarse or :off");
+    } else if (clock == Qfalse) {
+      new_clock = CLOCK_SOURCE_OFF;
+    }
+  }
+
   if (!memprof_started) {
     insert_tramp("rb_newobj", newobj_tramp);
     insert_tramp("add_freelist", freelist_tramp);
@@ -242,6 +546,20 @@ memprof_start(VALUE self)
   if (track_objs == 1)
     return Qfalse;
 
+  if (clock_source_set(new_clock) != 0) {
+    /* only complain if the TSC was asked for explicitly */
+    if (RTEST(clock))
+      rb_raise(eUnsupported, "no invariant TSC available on this cpu");
+    clock_source_set(CLOCK_SOURCE_COARSE);
+  }
+
+  gettimeofday(&now, NULL);
+  tracking_start_us = (uint64_t)now.tv_sec * 1000000 + now.tv_usec;
+  tracking_start_ticks = clock_ticks();
+
+  stack_frames = new_frames;
+  sample_rate = new_rate;
+  sample_countdown = sample_next_interval();
   track_objs = 1;
   return Qtrue;
 }
@@ -249,30 +567,27 @@ memprof_start(VALUE self)
 static VALUE
 memprof_stop(VALUE self)
 {
-  /* TODO: remove trampolines and set memprof_started = 0 */
-
   if (track_objs == 0)
     return Qfalse;
 
   track_objs = 0;
-  st_foreach(objs, objs_free, (st_data_t)0);
-  return Qtrue;
-}
+  objs_free();
 
-static int
-memprof_strcmp(const void *obj1, const void *obj2)
-{
-  char *str1 = *(char **)obj1;
-  char *str2 = *(char **)obj2;
-  return strcmp(str2, str1);
+  /* Memprof.start puts these back (without searching for them again) */
+  remove_tramp("rb_newobj", newobj_tramp);
+  remove_tramp("add_freelist", freelist_tramp);
+  memprof_started = 0;
+
+  return Qtrue;
 }
 
 static VALUE
 memprof_stats(int argc, VALUE *argv, VALUE self)
 {
-  st_table *tmp_table;
-  struct results res;
-  size_t i;
+  struct site_result *res = NULL;
+  size_t i, num_sites, num_res = 0;
+  struct site *site = NULL;
+  char *desc = NULL;
   VALUE str;
   FILE *out = NULL;
 
@@ -288,23 +603,29 @@ memprof_stats(int argc, VALUE *argv, VALUE self)
   }
 
   track_objs = 0;
+  objs_record_pending();
+
+  num_sites = site_count();
+  res = malloc(sizeof(*res) * (num_sites ? num_sites : 1));
+  assert(res != NULL);
+
+  for (i=0; i < num_sites; i++) {
+    site = site_get(i);
+    if (site->live) {
+      res[num_res].site = i;
+      res[num_res].count = site->live;
+      num_res++;
+    }
+  }
 
-  tmp_table = st_init_strtable();
-  st_foreach(objs, objs_tabulate, (st_data_t)tmp_table);
-
-  res.num_entries = 0;
-  res.entries = malloc(sizeof(char*) * tmp_table->num_entries);
-
-  st_foreach(tmp_table, objs_to_array, (st_data_t)&res);
-  st_free_table(tmp_table);
-
-  qsort(res.entries, res.num_entries, sizeof(char*), &memprof_strcmp);
+  qsort(res, num_res, sizeof(*res), &site_result_cmp);
 
-  for (i=0; i < res.num_entries; i++) {
-    fprintf(out ? out : stderr, "%s\n", res.entries[i]);
-    free(res.entries[i]);
+  for (i=0; i < num_res; i++) {
+    desc = site_describe(site_get(res[i].site));
+    fprintf(out ? out : stderr, "%7li %s\n", res[i].count * sample_rate, desc);
+    free(desc);
   }
-  free(res.entries);
+  free(res);
 
   if (out)
     fclose(out);
@@ -317,21 +638,114 @@ static VALUE
 memprof_stats_bang(int argc, VALUE *argv, VALUE self)
 {
   memprof_stats(argc, argv, self);
-  st_foreach(objs, objs_free, (st_data_t)0);
+  objs_free();
   return Qnil;
 }
 
+static VALUE
+memprof_site_counters(VALUE self)
+{
+  VALUE ret, counters, key;
+  struct site *site = NULL;
+  char *str = NULL;
+  size_t i;
+  int old = track_objs;
+
+  if (!track_objs)
+    rb_raise(rb_eRuntimeError, "object tracking disabled, call Memprof.start first");
+
+  track_objs = 0;
+  objs_record_pending();
+
+  ret = rb_hash_new();
+
+  for (i=0; i < site_count(); i++) {
+    site = site_get(i);
+
+    str = site_describe(site);
+    key = rb_str_new2(str);
+    free(str);
+
+    counters = rb_hash_new();
+    rb_hash_aset(counters, ID2SYM(rb_intern("allocated")), ULONG2NUM(site->allocated * sample_rate));
+    rb_hash_aset(counters, ID2SYM(rb_intern("freed")), ULONG2NUM(site->freed * sample_rate));
+    rb_hash_aset(counters, ID2SYM(rb_intern("live")), ULONG2NUM(site->live * sample_rate));
+    rb_hash_aset(ret, key, counters);
+  }
+
+  track_objs = old;
+  return ret;
+}
+
+static VALUE
+memprof_overhead(VALUE self)
+{
+  VALUE ret = rb_hash_new();
+  VALUE trackers = rb_hash_new();
+  VALUE tramps = rb_hash_new();
+  size_t tramp_entries = 0, tramp_pages = 0, tramp_bytes = 0;
+
+  rb_hash_aset(trackers, ID2SYM(rb_intern("count")), ULONG2NUM(tracker_slab.in_use));
+  rb_hash_aset(trackers, ID2SYM(rb_intern("slabs")), ULONG2NUM(tracker_slab.num_slabs));
+  rb_hash_aset(trackers, ID2SYM(rb_intern("bytes")), ULONG2NUM(slab_footprint(&tracker_slab)));
+  rb_hash_aset(trackers, ID2SYM(rb_intern("table_bytes")), ULONG2NUM(obj_table_footprint(&objs)));
+  rb_hash_aset(trackers, ID2SYM(rb_intern("sites")), ULONG2NUM(site_count()));
+  rb_hash_aset(trackers, ID2SYM(rb_intern("site_bytes")), ULONG2NUM(site_table_footprint()));
+  rb_hash_aset(trackers, ID2SYM(rb_intern("frames")), ULONG2NUM(stack_count()));
+  rb_hash_aset(trackers, ID2SYM(rb_intern("frame_bytes")), ULONG2NUM(stack_table_footprint()));
+  rb_hash_aset(ret, ID2SYM(rb_intern("trackers")), trackers);
+
+  tramp_usage(&tramp_entries, &tramp_pages, &tramp_bytes);
+  rb_hash_aset(tramps, ID2SYM(rb_intern("count")), ULONG2NUM(tramp_entries));
+  rb_hash_aset(tramps, ID2SYM(rb_intern("pages")), ULONG2NUM(tramp_pages));
+  rb_hash_aset(tramps, ID2SYM(rb_intern("bytes")), ULONG2NUM(tramp_bytes));
+  rb_hash_aset(ret, ID2SYM(rb_intern("tramps")), tramps);
+
+  return ret;
+}
+
 static void
 json_print(void *ctx, const char * str, unsigned int len)
 {
-  FILE *out = (FILE *)ctx;
-  size_t written = 0;
-  while(1) {
-    written += fwrite(str + written, sizeof(char), len - written, out ? out : stdout);
-    if (written == len) break;
-  }
-  if (str && len > 0 && str[0] == '\n' && out)
-    fflush(out);
+  output_write((struct memprof_output *)ctx, str, len);
+}
+
+static int
+filename_gz_p(const char *filename)
+{
+  size_t len = strlen(filename);
+  return len > 3 && strcmp(filename + len - 3, ".gz") == 0;
+}
+
+static int
+compress_flags(int compress)
+{
+  if (!compress)
+    return 0;
+
+  if (!output_compression_supported())
+    rb_raise(eUnsupported, "memprof was built without zlib, cannot compress output");
+
+  return OUTPUT_GZIP;
+}
+
+/*
+ * output_for_stdio - a sink for stdout or stderr
+ *
+ * anything ruby still has buffered in stdio goes out first, so output
+ * doesn't end up interleaved
+ */
+static struct memprof_output *
+output_for_stdio(FILE *file, int flags)
+{
+  struct memprof_output *out;
+
+  fflush(file);
+  out = output_fdopen(fileno(file), flags);
+  if (!out)
+    rb_raise(rb_eNoMemError, "unable to allocate output buffer");
+
+  return out;
 }
 
 static VALUE
@@ -340,19 +754,45 @@ memprof_track(int argc, VALUE *argv, VALUE self)
   if (!rb_block_given_p())
     rb_raise(rb_eArgError, "block required");
 
-  memprof_start(self);
+  memprof_start(0, NULL, self);
   rb_yield(Qnil);
   memprof_stats(argc, argv, self);
   memprof_stop(self);
   return Qnil;
 }
 
+/*
+ * rb_id2name interns "name=" the first time it is asked about a setter id
+ * made by rb_id_attrset (attr_writer, a.b = c), which must not happen while
+ * dump_all is walking the heap from several threads. Setters are named
+ * after their base id there instead, which is always interned already.
+ *
+ * Returns the base name of a setter id when dump_all is threaded, or NULL
+ * if rb_id2name can be used as is.
+ */
+static const char *
+dump_setter_base(ID id)
+{
+  const char *name = NULL;
+
+  if (!dump_threaded || (id & 0x07) != 0x04 || !RTEST(rb_is_local_id((id & ~0x07) | 0x01)))
+    return NULL;
+
+  if (!(name = rb_id2name((id & ~0x07) | 0x01)))
+    name = rb_id2name((id & ~0x07) | 0x05);
+  return name ? name : "";
+}
+
 static json_gen_status
 json_gen_id(json_gen gen, ID id)
 {
+  const char *base;
+
   if (id) {
     if (id < 100)
       return json_gen_format(gen, ":%c", id);
+    else if ((base = dump_setter_base(id)))
+      return json_gen_format(gen, ":%s=", base);
     else
       return json_gen_format(gen, ":%s", rb_id2name(id));
   } else
@@ -380,22 +820,22 @@ static json_gen_config fancy_conf = { .beautify = 1, .indentString = "  " };
 static json_gen_config basic_conf = { .beautify = 0, .indentString = "  " };
 
 static json_gen
-json_for_args(int argc, VALUE *argv)
+json_for_args(int argc, VALUE *argv, int flags)
 {
-  FILE *out = NULL;
+  struct memprof_output *out = NULL;
   VALUE str;
   rb_scan_args(argc, argv, "01", &str);
 
   if (RTEST(str)) {
-    out = fopen(StringValueCStr(str), "w");
+    char *filename = StringValueCStr(str);
+    out = output_open(filename, flags | compress_flags(filename_gz_p(filename)));
     if (!out)
       rb_raise(rb_eArgError, "unable to open output file");
+  } else {
+    out = output_for_stdio(stderr, OUTPUT_LINE_BUFFERED);
   }
 
-  if (!out)
-    out = stderr;
-
-  json_gen gen = json_gen_alloc2((json_print_t)&json_print, out == stderr ? &fancy_conf : &basic_conf, NULL, (void*)out);
+  json_gen gen = json_gen_alloc2((json_print_t)&json_print, out->owns_fd ? &basic_conf : &fancy_conf, NULL, (void*)out);
 
   return gen;
 }
@@ -403,19 +843,50 @@ json_for_args(int argc, VALUE *argv)
 static void
 json_free(json_gen gen)
 {
-  FILE *out = (FILE*)gen->ctx;
-  if (out != stderr)
-    fclose(out);
+  output_close((struct memprof_output *)gen->ctx);
   json_gen_free(gen);
 }
 
+/*
+ * Rolling traces: instead of tracing around a block, the tracers run until
+ * they're stopped, and a background thread dumps and resets them every
+ * interval seconds, appending one record per interval to the trace file.
+ *
+ * The background thread is a ruby thread, so dumps and resets only ever
+ * happen between ruby's own thread switches, never in the middle of a
+ * trampoline (or of bin_update_image) on the ruby thread. The price is that
+ * a record can be late while the process is stuck in a long C call.
+ */
+static struct {
+  VALUE thread;
+
+  struct memprof_output *out;
+  json_gen gen;
+  int binary;
+
+  unsigned int interval;
+  uint64_t start_ms;
+  uint64_t start_ns;
+
+  int running;
+  int stopping;
+} rolling_trace;
+
+static void
+rolling_trace_check()
+{
+  if (rolling_trace.running)
+    rb_raise(rb_eRuntimeError, "a rolling trace is running, call Memprof.trace_stop first");
+}
+
 static VALUE
 memprof_trace(int argc, VALUE *argv, VALUE self)
 {
   if (!rb_block_given_p())
     rb_raise(rb_eArgError, "block required");
+  rolling_trace_check();
 
-  json_gen gen = json_for_args(argc, argv);
+  json_gen gen = json_for_args(argc, argv, OUTPUT_LINE_BUFFERED);
 
   trace_set_output(gen);
   json_gen_map_open(gen);
@@ -467,7 +938,7 @@ memprof_trace_filename_set(int argc, VALUE *argv, VALUE self)
   if (!RTEST(*argv)) {
     tracing_json_filename = Qnil;
   } else {
-    tracing_json_gen = json_for_args(argc, argv);
+    tracing_json_gen = json_for_args(argc, argv, OUTPUT_LINE_BUFFERED);
     tracing_json_filename = *argv;
   }
 
@@ -480,11 +951,55 @@ memprof_trace_filename_get(VALUE self)
   return tracing_json_filename;
 }
 
+static VALUE
+memprof_malloc_frames_set(VALUE self, VALUE frames)
+{
+  if (memory_trace_set_frames(NUM2INT(frames)) != 0)
+    rb_raise(rb_eArgError, "malloc_frames must be between 1 and 8");
+
+  return frames;
+}
+
+static VALUE
+memprof_malloc_frames_get(VALUE self)
+{
+  return INT2NUM(memory_trace_get_frames());
+}
+
+static VALUE
+set_tracer_enabled(VALUE name, int enabled)
+{
+  const char *id = NULL;
+
+  if (SYMBOL_P(name))
+    id = rb_id2name(SYM2ID(name));
+  else
+    id = StringValueCStr(name);
+
+  if (trace_set_enabled(id, enabled) != 0)
+    rb_raise(rb_eArgError, "unknown tracer: %s", id);
+
+  return Qtrue;
+}
+
+static VALUE
+memprof_enable_tracer(VALUE self, VALUE name)
+{
+  return set_tracer_enabled(name, 1);
+}
+
+static VALUE
+memprof_disable_tracer(VALUE self, VALUE name)
+{
+  return set_tracer_enabled(name, 0);
+}
+
 static VALUE
 memprof_trace_request(VALUE self, VALUE env)
 {
   if (!rb_block_given_p())
     rb_raise(rb_eArgError, "block required");
+  rolling_trace_check();
 
   uint64_t start_time;
   uint64_t end_time;
@@ -494,7 +1009,7 @@ memprof_trace_request(VALUE self, VALUE env)
   if (tracing_json_gen)
     gen = tracing_json_gen;
   else
-    gen = json_for_args(0, NULL);
+    gen = json_for_args(0, NULL, OUTPUT_LINE_BUFFERED);
 
   json_gen_map_open(gen);
 
@@ -510,9 +1025,9 @@ memprof_trace_request(VALUE self, VALUE env)
   trace_invoke_all(TRACE_RESET);
   trace_invoke_all(TRACE_START);
 
-  start_time = timeofday_ms();
+  start_time = timeofday_ns();
   VALUE ret = rb_yield(Qnil);
-  end_time = timeofday_ms();
+  end_time = timeofday_ns();
 
   trace_invoke_all(TRACE_DUMP);
   trace_invoke_all(TRACE_STOP);
@@ -576,7 +1091,7 @@ memprof_trace_request(VALUE self, VALUE env)
   }
 
   json_gen_cstr(gen, "time");
-  json_gen_integer(gen, end_time-start_time);
+  json_gen_ms(gen, end_time-start_time);
 
   json_gen_map_close(gen);
   json_gen_reset(gen);
@@ -587,6 +1102,173 @@ memprof_trace_request(VALUE self, VALUE env)
   return ret;
 }
 
+/*
+ * rolling_trace_flush - write out a record for the interval so far and
+ * start the next one.
+ *
+ * Anything the tracers count between the dump and the reset is lost, just as
+ * with trace_stats_reset.
+ */
+static void
+rolling_trace_flush()
+{
+  json_gen gen = rolling_trace.gen;
+  uint64_t now = timeofday_ns();
+  char str_time[32];
+
+  json_gen_map_open(gen);
+
+  json_gen_cstr(gen, "start");
+  sprintf(str_time, "%" PRIu64, rolling_trace.start_ms);
+  json_gen_number(gen, str_time, strlen(str_time));
+
+  json_gen_cstr(gen, "tracers");
+  json_gen_map_open(gen);
+  trace_invoke_all(TRACE_DUMP);
+  trace_invoke_all(TRACE_RESET);
+  json_gen_map_close(gen);
+
+  json_gen_cstr(gen, "time");
+  json_gen_ms(gen, now - rolling_trace.start_ns);
+
+  json_gen_map_close(gen);
+  json_gen_reset(gen);
+
+  /* binary records have no newline to trigger a flush on */
+  output_flush(rolling_trace.out);
+
+  rolling_trace.start_ms = timeofday_ms();
+  rolling_trace.start_ns = now;
+}
+
+static VALUE
+rolling_trace_thread(void *arg)
+{
+  uint64_t deadline, now;
+  struct timeval left;
+
+  while (!rolling_trace.stopping) {
+    deadline = timeofday_ns() + (uint64_t)rolling_trace.interval * 1000000000ULL;
+
+    /* trace_stop wakes us up early, and so could anyone else */
+    while (!rolling_trace.stopping && (now = timeofday_ns()) < deadline) {
+      left.tv_sec = (deadline - now) / 1000000000ULL;
+      left.tv_usec = ((deadline - now) % 1000000000ULL) / 1000;
+      rb_thread_wait_for(left);
+    }
+
+    if (!rolling_trace.stopping)
+      rolling_trace_flush();
+  }
+
+  return Qnil;
+}
+
+static VALUE
+memprof_trace_start(int argc, VALUE *argv, VALUE self)
+{
+  VALUE str, opts, interval, format;
+  int binary = 0, flags = 0;
+  long secs = 60;
+
+  rolling_trace_check();
+  rb_scan_args(argc, argv, "02", &str, &opts);
+
+  /* the filename can be left out: trace_start(:interval => 10) */
+  if (argc == 1 && TYPE(str) == T_HASH) {
+    opts = str;
+    str = Qnil;
+  }
+
+  if (RTEST(opts)) {
+    if (TYPE(opts) != T_HASH)
+      rb_raise(rb_eArgError, "options must be a hash");
+
+    interval = rb_hash_aref(opts, ID2SYM(rb_intern("interval")));
+    if (RTEST(interval)) {
+      secs = NUM2LONG(interval);
+      if (secs < 1)
+        rb_raise(rb_eArgError, "interval must be at least 1 second");
+    }
+
+    format = rb_hash_aref(opts, ID2SYM(rb_intern("format")));
+    if (RTEST(format)) {
+      if (format == ID2SYM(rb_intern("binary")))
+        binary = 1;
+      else if (format != ID2SYM(rb_intern("json")))
+        rb_raise(rb_eArgError, "format must be :json or :binary");
+    }
+  }
+
+  /* json records are flushed line by line, binary ones after each interval */
+  if (!binary)
+    flags |= OUTPUT_LINE_BUFFERED;
+
+  if (RTEST(str)) {
+    char *filename = StringValueCStr(str);
+    rolling_trace.out = output_open(filename, flags | OUTPUT_APPEND | compress_flags(filename_gz_p(filename)));
+    if (!rolling_trace.out)
+      rb_raise(rb_eArgError, "unable to open output file");
+  } else {
+    rolling_trace.out = output_for_stdio(stderr, flags);
+  }
+
+  if (binary)
+    rolling_trace.gen = bindump_gen_alloc(rolling_trace.out);
+  else
+    rolling_trace.gen = json_gen_alloc2((json_print_t)&json_print, &basic_conf, NULL, (void*)rolling_trace.out);
+
+  rolling_trace.binary = binary;
+  rolling_trace.interval = secs;
+  rolling_trace.stopping = 0;
+  rolling_trace.start_ms = timeofday_ms();
+  rolling_trace.start_ns = timeofday_ns();
+
+  trace_set_output(rolling_trace.gen);
+  trace_invoke_all(TRACE_RESET);
+  trace_invoke_all(TRACE_START);
+
+  rolling_trace.thread = rb_thread_create(rolling_trace_thread, NULL);
+  rolling_trace.running = 1;
+  return Qtrue;
+}
+
+static VALUE
+memprof_trace_stop(VALUE self)
+{
+  int failed;
+
+  if (!rolling_trace.running)
+    return Qfalse;
+
+  rolling_trace.stopping = 1;
+  if (RTEST(rb_funcall(rolling_trace.thread, rb_intern("alive?"), 0))) {
+    rb_thread_wakeup(rolling_trace.thread);
+    rb_funcall(rolling_trace.thread, rb_intern("join"), 0);
+  }
+  rolling_trace.thread = Qnil;
+
+  /* one last record for whatever is left of the current interval */
+  rolling_trace_flush();
+  trace_invoke_all(TRACE_STOP);
+  trace_set_output(NULL);
+
+  if (rolling_trace.binary)
+    bindump_gen_free(rolling_trace.gen);
+  else
+    json_gen_free(rolling_trace.gen);
+  failed = output_close(rolling_trace.out) != 0;
+
+  rolling_trace.gen = NULL;
+  rolling_trace.out = NULL;
+  rolling_trace.running = 0;
+
+  if (failed)
+    rb_raise(rb_eRuntimeError, "unable to write trace");
+
+  return Qtrue;
+}
+
 #include "json.h"
 #include "env.h"
 #include "rubyio.h"
@@ -629,7 +1311,15 @@ each_ivar(st_data_t key, st_data_t record, st_data_t arg)
   json_gen gen = (json_gen)arg;
   ID id = (ID)key;
   VALUE val = (VALUE)record;
-  const char *name = rb_id2name(id);
+  const char *name = NULL, *base = NULL;
+
+  if ((base = dump_setter_base(id))) {
+    char *setter = alloca(strlen(base) + 2);
+    sprintf(setter, "%s=", base);
+    name = setter;
+  } else {
+    name = rb_id2name(id);
+  }
 
   json_gen_cstr(gen, name ? name : "(none)");
   json_gen_value(gen, val);
@@ -674,6 +1364,23 @@ nd_type_str(VALUE obj)
   }
 }
 
+/*
+ * classname may cache a freshly built path on the class, so threads walking
+ * the heap for dump_all never call it: every class is named up front on the
+ * ruby thread (see dump_classnames), and the names are looked up here.
+ */
+static VALUE
+dump_classname(VALUE klass)
+{
+  void *name;
+
+  if (!dump_threaded)
+    return rb_classname(klass);
+
+  name = obj_table_lookup(&dump_names, klass);
+  return name ? (VALUE)name : Qnil;
+}
+
 static inline void
 obj_dump_class(json_gen gen, VALUE obj)
 {
@@ -681,7 +1388,7 @@ obj_dump_class(json_gen gen, VALUE obj)
     json_gen_cstr(gen, "class");
     json_gen_value(gen, RBASIC(obj)->klass);
 
-    VALUE name = rb_classname(RBASIC(obj)->klass);
+    VALUE name = dump_classname(RBASIC(obj)->klass);
     if (RTEST(name)) {
       json_gen_cstr(gen, "class_name");
       json_gen_cstr(gen, RSTRING_PTR(name));
@@ -705,14 +1412,29 @@ obj_dump(VALUE obj, json_gen gen)
   json_gen_cstr(gen, "_id");
   json_gen_value(gen, obj);
 
-  struct obj_track *tracker = NULL;
-  if (st_lookup(objs, (st_data_t)obj, (st_data_t *)&tracker) && BUILTIN_TYPE(obj) != T_NODE) {
+  struct obj_track *tracker = obj_table_lookup(&objs, obj);
+  if (tracker && tracker->site != SITE_NONE && site_get(tracker->site)->stack != STACK_NONE &&
+      BUILTIN_TYPE(obj) != T_NODE) {
+    struct stack_frame *frame = stack_get(site_get(tracker->site)->stack);
     json_gen_cstr(gen, "file");
-    json_gen_cstr(gen, tracker->source);
+    json_gen_cstr(gen, frame->file);
     json_gen_cstr(gen, "line");
-    json_gen_integer(gen, tracker->line);
-    json_gen_cstr(gen, "time");
-    json_gen_integer(gen, (tracker->time[0].tv_sec * 1000000) + tracker->time[0].tv_usec);
+    json_gen_integer(gen, frame->line);
+
+    if (frame->parent != STACK_NONE) {
+      json_gen_cstr(gen, "backtrace");
+      json_gen_array_open(gen);
+      do {
+        json_gen_format(gen, "%s:%d", frame->file ? frame->file : "__null__", frame->line);
+        frame = frame->parent == STACK_NONE ? NULL : stack_get(frame->parent);
+      } while (frame);
+      json_gen_array_close(gen);
+    }
+
+    if (clock_source_get() != CLOCK_SOURCE_OFF) {
+      json_gen_cstr(gen, "time");
+      json_gen_integer(gen, tracking_start_us + clock_ticks_to_us(tracker->time));
+    }
   }
 
   json_gen_cstr(gen, "type");
@@ -1285,7 +2007,7 @@ obj_dump(VALUE obj, json_gen gen)
       obj_dump_class(gen, obj);
 
       json_gen_cstr(gen, "name");
-      VALUE name = rb_classname(obj);
+      VALUE name = dump_classname(obj);
       if (RTEST(name))
         json_gen_cstr(gen, RSTRING_PTR(name));
       else
@@ -1296,7 +2018,7 @@ obj_dump(VALUE obj, json_gen gen)
 
       if (RTEST(RCLASS(obj)->super)) {
         json_gen_cstr(gen, "super_name");
-        VALUE super_name = rb_classname(RCLASS(obj)->super);
+        VALUE super_name = dump_classname(RCLASS(obj)->super);
         if (RTEST(super_name))
           json_gen_cstr(gen, RSTRING_PTR(super_name));
         else
@@ -1591,12 +2313,11 @@ memprof_dump_finalizers(json_gen gen)
   }
 }
 
-static int
-objs_each_dump(st_data_t key, st_data_t record, st_data_t arg)
+static void
+objs_each_dump(unsigned long key, void *record, void *arg)
 {
   obj_dump((VALUE)key, (json_gen)arg);
   json_gen_reset((json_gen)arg);
-  return ST_CONTINUE;
 }
 
 static VALUE
@@ -1606,15 +2327,16 @@ memprof_dump(int argc, VALUE *argv, VALUE self)
   int old = track_objs;
 
   if (rb_block_given_p()) {
-    memprof_start(self);
+    memprof_start(0, NULL, self);
     ret = rb_yield(Qnil);
   } else if (!track_objs)
     rb_raise(rb_eRuntimeError, "object tracking disabled, call Memprof.start first");
 
   track_objs = 0;
+  objs_record_pending();
 
-  json_gen gen = json_for_args(argc, argv);
-  st_foreach(objs, objs_each_dump, (st_data_t)gen);
+  json_gen gen = json_for_args(argc, argv, 0);
+  obj_table_foreach(&objs, objs_each_dump, gen);
   json_free(gen);
 
   if (rb_block_given_p())
@@ -1624,6 +2346,218 @@ memprof_dump(int argc, VALUE *argv, VALUE self)
   return ret;
 }
 
+#define HEAPS_SLOT(heaps, i) ((heaps) + ((i) * memprof_config.sizeof_heaps_slot))
+#define HEAPS_SLOT_START(heaps, i) (*(char**)(HEAPS_SLOT(heaps, i) + memprof_config.offset_heaps_slot_slot))
+#define HEAPS_SLOT_LIMIT(heaps, i) (*(int*)(HEAPS_SLOT(heaps, i) + memprof_config.offset_heaps_slot_limit))
+
+static void
+dump_heaps(char *heaps, int first, int last, json_gen gen)
+{
+  char *p, *pend;
+  int i;
+
+  for (i=first; i < last; i++) {
+    p = HEAPS_SLOT_START(heaps, i);
+    pend = p + (memprof_config.sizeof_RVALUE * HEAPS_SLOT_LIMIT(heaps, i));
+
+    while (p < pend) {
+      if (RBASIC(p)->flags) {
+        obj_dump((VALUE)p, gen);
+        json_gen_reset(gen);
+      }
+
+      p += memprof_config.sizeof_RVALUE;
+    }
+  }
+}
+
+/*
+ * dump_classnames - name every class and module in the heap into dump_names,
+ * for dump_classname to use from worker threads.
+ *
+ * classname can allocate, which may add a heap, so the heaps are looked up
+ * again for each one.
+ *
+ * Returns 0 on success, or -1 if the table could not hold every name (in
+ * which case the heap should be walked by the ruby thread alone).
+ */
+static int
+dump_classnames()
+{
+  char *p, *pend, *heaps;
+  int i;
+
+  obj_table_clear(&dump_names);
+
+  for (i=0; i < *(int*)memprof_config.heaps_used; i++) {
+    heaps = *(char**)memprof_config.heaps;
+    p = HEAPS_SLOT_START(heaps, i);
+    pend = p + (memprof_config.sizeof_RVALUE * HEAPS_SLOT_LIMIT(heaps, i));
+
+    while (p < pend) {
+      if (RBASIC(p)->flags) {
+        switch (BUILTIN_TYPE(p)) {
+          case T_CLASS:
+          case T_MODULE:
+          case T_ICLASS:
+            if (obj_table_insert(&dump_names, (unsigned long)p, (void*)rb_classname((VALUE)p), NULL) != 0)
+              return -1;
+        }
+      }
+
+      p += memprof_config.sizeof_RVALUE;
+    }
+  }
+
+  return 0;
+}
+
+struct dump_chunk {
+  char *heaps;
+  int first;
+  int last;
+  int binary;
+  int output_flags;
+  char *filename;
+  pthread_t thread;
+  int started;
+  int failed;
+};
+
+static json_gen
+dump_gen_alloc(struct memprof_output *out, int binary)
+{
+  static json_gen_config conf = { .beautify = 0, .indentString = "  " };
+
+  if (binary)
+    return bindump_gen_alloc(out);
+  else
+    return json_gen_alloc2((json_print_t)&json_print, &conf, NULL, (void*)out);
+}
+
+static void
+dump_gen_free(json_gen gen)
+{
+  if (bindump_gen_p(gen)) {
+    bindump_gen_free(gen);
+  } else {
+    json_gen_clear(gen);
+    json_gen_free(gen);
+  }
+}
+
+static void *
+dump_chunk_thread(void *arg)
+{
+  struct dump_chunk *chunk = arg;
+  struct memprof_output *out = NULL;
+  json_gen gen;
+
+  out = output_open(chunk->filename, chunk->output_flags);
+  if (!out) {
+    chunk->failed = 1;
+    return NULL;
+  }
+
+  gen = dump_gen_alloc(out, chunk->binary);
+  dump_heaps(chunk->heaps, chunk->first, chunk->last, gen);
+  dump_gen_free(gen);
+
+  if (output_close(out) != 0)
+    chunk->failed = 1;
+
+  return NULL;
+}
+
+/*
+ * dump_heaps_threaded - split the heaps between num_threads workers.
+ *
+ * Given:
+ *  - out: the sink the dump is being written to.
+ *  - filename: the in progress filename, used as a prefix for per-chunk files.
+ *  - heaps/heaps_used: the ruby heaps to dump.
+ *  - binary: whether to write the binary format.
+ *  - output_flags: flags for the per-chunk sinks.
+ *
+ * Each worker writes a contiguous range of heaps (split so each worker sees
+ * roughly the same number of slots) to its own file, which are then appended
+ * to out in heap order. Binary chunks start with their own header, so the
+ * string tables of different chunks never refer to each other. Compressed
+ * chunks are compressed by their own workers, as separate gzip members.
+ *
+ * Returns 0 on success, or -1 if any chunk could not be written.
+ */
+static int
+dump_heaps_threaded(struct memprof_output *out, const char *filename, char *heaps, int heaps_used, int num_threads, int binary, int output_flags)
+{
+  struct dump_chunk *chunks = NULL;
+  size_t filename_len = strlen(filename);
+  unsigned long total_slots = 0, per_chunk = 0, slots = 0;
+  int i, n, ret = 0;
+
+  for (i=0; i < heaps_used; i++)
+    total_slots += HEAPS_SLOT_LIMIT(heaps, i);
+
+  if (num_threads > heaps_used)
+    num_threads = heaps_used;
+  if (num_threads < 1)
+    return 0;
+
+  chunks = calloc(num_threads, sizeof(*chunks));
+  if (!chunks)
+    return -1;
+
+  per_chunk = (total_slots + num_threads - 1) / num_threads;
+
+  for (i=0, n=0; n < num_threads; n++) {
+    chunks[n].heaps = heaps;
+    chunks[n].binary = binary;
+    chunks[n].output_flags = output_flags;
+    chunks[n].first = i;
+
+    /* the last chunk takes whatever is left over */
+    slots = 0;
+    while (i < heaps_used && (n == num_threads-1 || slots < per_chunk)) {
+      slots += HEAPS_SLOT_LIMIT(heaps, i);
+      i++;
+    }
+    chunks[n].last = i;
+
+    chunks[n].filename = malloc(filename_len + 16);
+    snprintf(chunks[n].filename, filename_len + 16, "%s.%d", filename, n);
+  }
+
+  dump_threaded = 1;
+
+  for (n=0; n < num_threads; n++) {
+    if (chunks[n].first == chunks[n].last)
+      continue;
+    if (pthread_create(&chunks[n].thread, NULL, dump_chunk_thread, &chunks[n]) == 0)
+      chunks[n].started = 1;
+    else
+      dump_chunk_thread(&chunks[n]);
+  }
+
+  for (n=0; n < num_threads; n++) {
+    if (chunks[n].started)
+      pthread_join(chunks[n].thread, NULL);
+  }
+
+  dump_threaded = 0;
+
+  for (n=0; n < num_threads; n++) {
+    if (chunks[n].first != chunks[n].last) {
+      if (chunks[n].failed || output_append_file(out, chunks[n].filename) != 0)
+        ret = -1;
+      unlink(chunks[n].filename);
+    }
+    free(chunks[n].filename);
+  }
+
+  free(chunks);
+  return ret;
+}
+
 static VALUE
 memprof_dump_all(int argc, VALUE *argv, VALUE self)
 {
@@ -1635,67 +2569,168 @@ memprof_dump_all(int argc, VALUE *argv, VALUE self)
       memprof_config.offset_heaps_slot_limit == SIZE_MAX)
     rb_raise(eUnsupported, "not enough config data to dump heap");
 
-  char *heaps = *(char**)memprof_config.heaps;
-  int heaps_used = *(int*)memprof_config.heaps_used;
+  char *heaps;
+  int heaps_used;
 
-  char *p, *pend;
-  int i, limit;
-  VALUE str;
+  VALUE str, opts, format, threads, compress;
   char *filename = NULL;
   char *in_progress_filename = NULL;
-  FILE *out = NULL;
+  struct memprof_output *out = NULL;
+  int binary = 0, num_threads = 1, failed = 0, gc_was_disabled;
+  int output_flags = 0, gzip = -1;
 
-  rb_scan_args(argc, argv, "01", &str);
+  rb_scan_args(argc, argv, "02", &str, &opts);
 
-  if (RTEST(str)) {
+  /* the filename can be left out: dump_all(:format => :binary) */
+  if (argc == 1 && TYPE(str) == T_HASH) {
+    opts = str;
+    str = Qnil;
+  }
+
+  if (RTEST(opts)) {
+    if (TYPE(opts) != T_HASH)
+      rb_raise(rb_eArgError, "options must be a hash");
+
+    format = rb_hash_aref(opts, ID2SYM(rb_intern("format")));
+    if (RTEST(format)) {
+      if (format == ID2SYM(rb_intern("binary")))
+        binary = 1;
+      else if (format != ID2SYM(rb_intern("json")))
+        rb_raise(rb_eArgError, "format must be :json or :binary");
+    }
+
+    threads = rb_hash_aref(opts, ID2SYM(rb_intern("threads")));
+    if (RTEST(threads)) {
+      num_threads = NUM2INT(threads);
+      if (num_threads < 1 || num_threads > 64)
+        rb_raise(rb_eArgError, "threads must be between 1 and 64");
+    }
+
+    compress = rb_hash_aref(opts, ID2SYM(rb_intern("compress")));
+    if (!NIL_P(compress))
+      gzip = RTEST(compress);
+  }
+
+  if (RTEST(str))
     filename = StringValueCStr(str);
+
+  /* compress when asked to, or by default when writing to a .gz file */
+  if (gzip == -1)
+    gzip = filename && filename_gz_p(filename);
+  output_flags = compress_flags(gzip);
+
+  if (filename) {
     size_t filename_len = strlen(filename);
     in_progress_filename = alloca(filename_len + 13);
     memcpy(in_progress_filename, filename, filename_len);
     memcpy(in_progress_filename + filename_len, ".IN_PROGRESS\0", 13);
 
-    out = fopen(in_progress_filename, "w");
+    /* dumps are written once and never read back by this process */
+    out = output_open(in_progress_filename, output_flags | OUTPUT_DONTNEED);
     if (!out)
       rb_raise(rb_eArgError, "unable to open output file");
+  } else {
+    out = output_for_stdio(stdout, output_flags);
+    /* chunks are stitched together through files, so stdout is always serial */
+    num_threads = 1;
   }
 
-  json_gen_config conf = { .beautify = 0, .indentString = "  " };
-  json_gen gen = json_gen_alloc2((json_print_t)&json_print, &conf, NULL, (void*)out);
+  json_gen gen = dump_gen_alloc(out, binary);
 
   track_objs = 0;
+  objs_record_pending();
+
+  /* nothing may allocate its way into a new heap (or free one) mid-walk */
+  gc_was_disabled = RTEST(rb_gc_disable());
 
   memprof_dump_finalizers(gen);
   memprof_dump_globals(gen);
   memprof_dump_stack(gen);
 
-  for (i=0; i < heaps_used; i++) {
-    p = *(char**)(heaps + (i * memprof_config.sizeof_heaps_slot) + memprof_config.offset_heaps_slot_slot);
-    limit = *(int*)(heaps + (i * memprof_config.sizeof_heaps_slot) + memprof_config.offset_heaps_slot_limit);
-    pend = p + (memprof_config.sizeof_RVALUE * limit);
+  if (num_threads > 1 && dump_classnames() != 0) {
+    dbg_printf("unable to name every class up front, dumping from one thread\n");
+    num_threads = 1;
+  }
 
-    while (p < pend) {
-      if (RBASIC(p)->flags) {
-        obj_dump((VALUE)p, gen);
-        json_gen_reset(gen);
-      }
+  if (num_threads > 1) {
+    heaps = *(char**)memprof_config.heaps;
+    heaps_used = *(int*)memprof_config.heaps_used;
 
-      p += memprof_config.sizeof_RVALUE;
-    }
+    dump_gen_free(gen);
+    if (dump_heaps_threaded(out, in_progress_filename, heaps, heaps_used, num_threads, binary, output_flags) != 0)
+      failed = 1;
+    obj_table_clear(&dump_names);
+    gen = dump_gen_alloc(out, binary);
+  } else {
+    heaps = *(char**)memprof_config.heaps;
+    heaps_used = *(int*)memprof_config.heaps_used;
+
+    dump_heaps(heaps, 0, heaps_used, gen);
   }
 
   memprof_dump_lsof(gen);
   memprof_dump_ps(gen);
 
-  json_gen_clear(gen);
-  json_gen_free(gen);
+  dump_gen_free(gen);
 
-  if (out) {
-    fclose(out);
-    rename(in_progress_filename, filename);
+  if (!gc_was_disabled)
+    rb_gc_enable();
+
+  if (output_close(out) != 0)
+    failed = 1;
+
+  if (filename) {
+    if (failed)
+      unlink(in_progress_filename);
+    else
+      rename(in_progress_filename, filename);
   }
 
   track_objs = 1;
 
+  if (failed)
+    rb_raise(rb_eRuntimeError, "unable to write heap dump");
+
+  return Qnil;
+}
+
+static VALUE
+memprof_convert_dump(int argc, VALUE *argv, VALUE self)
+{
+  VALUE src, dst;
+  FILE *in = NULL;
+  struct memprof_output *out = NULL;
+  int ret;
+
+  rb_scan_args(argc, argv, "11", &src, &dst);
+
+  in = output_open_read(StringValueCStr(src));
+  if (!in)
+    rb_raise(rb_eArgError, "unable to open input file");
+
+  if (RTEST(dst)) {
+    char *filename = StringValueCStr(dst);
+    out = output_open(filename, compress_flags(filename_gz_p(filename)));
+    if (!out) {
+      fclose(in);
+      rb_raise(rb_eArgError, "unable to open output file");
+    }
+  } else {
+    out = output_for_stdio(stdout, 0);
+  }
+
+  json_gen_config conf = { .beautify = 0, .indentString = "  " };
+  json_gen gen = json_gen_alloc2((json_print_t)&json_print, &conf, NULL, (void*)out);
+
+  ret = bindump_convert(in, gen);
+
+  json_gen_free(gen);
+  fclose(in);
+  output_close(out);
+
+  if (ret != 0)
+    rb_raise(rb_eArgError, "input is not a valid binary dump");
+
   return Qnil;
 }
 
@@ -1745,112 +2780,117 @@ init_memprof_config_extended() {
   memprof_config.heaps_used                 = bin_find_symbol("heaps_used", NULL, 0);
   memprof_config.finalizer_table            = bin_find_symbol("finalizer_table", NULL, 0);
 
+  /* the types only change when ruby is rebuilt, so DWARF is only read on a cache miss */
+  if (config_cache_load(&memprof_config) != 0) {
 #ifdef sizeof__RVALUE
-  memprof_config.sizeof_RVALUE              = sizeof__RVALUE;
+    memprof_config.sizeof_RVALUE              = sizeof__RVALUE;
 #else
-  memprof_config.sizeof_RVALUE              = bin_type_size("RVALUE");
+    memprof_config.sizeof_RVALUE              = bin_type_size("RVALUE");
 #endif
 #ifdef sizeof__heaps_slot
-  memprof_config.sizeof_heaps_slot          = sizeof__heaps_slot;
+    memprof_config.sizeof_heaps_slot          = sizeof__heaps_slot;
 #else
-  memprof_config.sizeof_heaps_slot          = bin_type_size("heaps_slot");
+    memprof_config.sizeof_heaps_slot          = bin_type_size("heaps_slot");
 #endif
 #ifdef offset__heaps_slot__limit
-  memprof_config.offset_heaps_slot_limit    = offset__heaps_slot__limit;
+    memprof_config.offset_heaps_slot_limit    = offset__heaps_slot__limit;
 #else
-  memprof_config.offset_heaps_slot_limit    = bin_type_member_offset("heaps_slot", "limit");
+    memprof_config.offset_heaps_slot_limit    = bin_type_member_offset("heaps_slot", "limit");
 #endif
 #ifdef offset__heaps_slot__slot
-  memprof_config.offset_heaps_slot_slot     = offset__heaps_slot__slot;
+    memprof_config.offset_heaps_slot_slot     = offset__heaps_slot__slot;
 #else
-  memprof_config.offset_heaps_slot_slot     = bin_type_member_offset("heaps_slot", "slot");
+    memprof_config.offset_heaps_slot_slot     = bin_type_member_offset("heaps_slot", "slot");
 #endif
 #ifdef offset__BLOCK__body
-  memprof_config.offset_BLOCK_body          = offset__BLOCK__body;
+    memprof_config.offset_BLOCK_body          = offset__BLOCK__body;
 #else
-  memprof_config.offset_BLOCK_body          = bin_type_member_offset("BLOCK", "body");
+    memprof_config.offset_BLOCK_body          = bin_type_member_offset("BLOCK", "body");
 #endif
 #ifdef offset__BLOCK__var
-  memprof_config.offset_BLOCK_var           = offset__BLOCK__var;
+    memprof_config.offset_BLOCK_var           = offset__BLOCK__var;
 #else
-  memprof_config.offset_BLOCK_var           = bin_type_member_offset("BLOCK", "var");
+    memprof_config.offset_BLOCK_var           = bin_type_member_offset("BLOCK", "var");
 #endif
 #ifdef offset__BLOCK__cref
-  memprof_config.offset_BLOCK_cref          = offset__BLOCK__cref;
+    memprof_config.offset_BLOCK_cref          = offset__BLOCK__cref;
 #else
-  memprof_config.offset_BLOCK_cref          = bin_type_member_offset("BLOCK", "cref");
+    memprof_config.offset_BLOCK_cref          = bin_type_member_offset("BLOCK", "cref");
 #endif
 #ifdef offset__BLOCK__prev
-  memprof_config.offset_BLOCK_prev          = offset__BLOCK__prev;
+    memprof_config.offset_BLOCK_prev          = offset__BLOCK__prev;
 #else
-  memprof_config.offset_BLOCK_prev          = bin_type_member_offset("BLOCK", "prev");
+    memprof_config.offset_BLOCK_prev          = bin_type_member_offset("BLOCK", "prev");
 #endif
 #ifdef offset__BLOCK__self
-  memprof_config.offset_BLOCK_self          = offset__BLOCK__self;
+    memprof_config.offset_BLOCK_self          = offset__BLOCK__self;
 #else
-  memprof_config.offset_BLOCK_self          = bin_type_member_offset("BLOCK", "self");
+    memprof_config.offset_BLOCK_self          = bin_type_member_offset("BLOCK", "self");
 #endif
 #ifdef offset__BLOCK__klass
-  memprof_config.offset_BLOCK_klass         = offset__BLOCK__klass;
+    memprof_config.offset_BLOCK_klass         = offset__BLOCK__klass;
 #else
-  memprof_config.offset_BLOCK_klass         = bin_type_member_offset("BLOCK", "klass");
+    memprof_config.offset_BLOCK_klass         = bin_type_member_offset("BLOCK", "klass");
 #endif
 #ifdef offset__BLOCK__orig_thread
-  memprof_config.offset_BLOCK_orig_thread   = offset__BLOCK__orig_thread;
+    memprof_config.offset_BLOCK_orig_thread   = offset__BLOCK__orig_thread;
 #else
-  memprof_config.offset_BLOCK_orig_thread   = bin_type_member_offset("BLOCK", "orig_thread");
+    memprof_config.offset_BLOCK_orig_thread   = bin_type_member_offset("BLOCK", "orig_thread");
 #endif
 #ifdef offset__BLOCK__wrapper
-  memprof_config.offset_BLOCK_wrapper       = offset__BLOCK__wrapper;
+    memprof_config.offset_BLOCK_wrapper       = offset__BLOCK__wrapper;
 #else
-  memprof_config.offset_BLOCK_wrapper       = bin_type_member_offset("BLOCK", "wrapper");
+    memprof_config.offset_BLOCK_wrapper       = bin_type_member_offset("BLOCK", "wrapper");
 #endif
 #ifdef offset__BLOCK__block_obj
-  memprof_config.offset_BLOCK_block_obj     = offset__BLOCK__block_obj;
+    memprof_config.offset_BLOCK_block_obj     = offset__BLOCK__block_obj;
 #else
-  memprof_config.offset_BLOCK_block_obj     = bin_type_member_offset("BLOCK", "block_obj");
+    memprof_config.offset_BLOCK_block_obj     = bin_type_member_offset("BLOCK", "block_obj");
 #endif
 #ifdef offset__BLOCK__scope
-  memprof_config.offset_BLOCK_scope         = offset__BLOCK__scope;
+    memprof_config.offset_BLOCK_scope         = offset__BLOCK__scope;
 #else
-  memprof_config.offset_BLOCK_scope         = bin_type_member_offset("BLOCK", "scope");
+    memprof_config.offset_BLOCK_scope         = bin_type_member_offset("BLOCK", "scope");
 #endif
 #ifdef offset__BLOCK__dyna_vars
-  memprof_config.offset_BLOCK_dyna_vars     = offset__BLOCK__dyna_vars;
+    memprof_config.offset_BLOCK_dyna_vars     = offset__BLOCK__dyna_vars;
 #else
-  memprof_config.offset_BLOCK_dyna_vars     = bin_type_member_offset("BLOCK", "dyna_vars");
+    memprof_config.offset_BLOCK_dyna_vars     = bin_type_member_offset("BLOCK", "dyna_vars");
 #endif
 #ifdef offset__METHOD__klass
-  memprof_config.offset_METHOD_klass        = offset__METHOD__klass;
+    memprof_config.offset_METHOD_klass        = offset__METHOD__klass;
 #else
-  memprof_config.offset_METHOD_klass        = bin_type_member_offset("METHOD", "klass");
+    memprof_config.offset_METHOD_klass        = bin_type_member_offset("METHOD", "klass");
 #endif
 #ifdef offset__METHOD__rklass
-  memprof_config.offset_METHOD_rklass       = offset__METHOD__rklass;
+    memprof_config.offset_METHOD_rklass       = offset__METHOD__rklass;
 #else
-  memprof_config.offset_METHOD_rklass       = bin_type_member_offset("METHOD", "rklass");
+    memprof_config.offset_METHOD_rklass       = bin_type_member_offset("METHOD", "rklass");
 #endif
 #ifdef offset__METHOD__recv
-  memprof_config.offset_METHOD_recv         = offset__METHOD__recv;
+    memprof_config.offset_METHOD_recv         = offset__METHOD__recv;
 #else
-  memprof_config.offset_METHOD_recv         = bin_type_member_offset("METHOD", "recv");
+    memprof_config.offset_METHOD_recv         = bin_type_member_offset("METHOD", "recv");
 #endif
 #ifdef offset__METHOD__id
-  memprof_config.offset_METHOD_id           = offset__METHOD__id;
+    memprof_config.offset_METHOD_id           = offset__METHOD__id;
 #else
-  memprof_config.offset_METHOD_id           = bin_type_member_offset("METHOD", "id");
+    memprof_config.offset_METHOD_id           = bin_type_member_offset("METHOD", "id");
 #endif
 #ifdef offset__METHOD__oid
-  memprof_config.offset_METHOD_oid          = offset__METHOD__oid;
+    memprof_config.offset_METHOD_oid          = offset__METHOD__oid;
 #else
-  memprof_config.offset_METHOD_oid          = bin_type_member_offset("METHOD", "oid");
+    memprof_config.offset_METHOD_oid          = bin_type_member_offset("METHOD", "oid");
 #endif
 #ifdef offset__METHOD__body
-  memprof_config.offset_METHOD_body         = offset__METHOD__body;
+    memprof_config.offset_METHOD_body         = offset__METHOD__body;
 #else
-  memprof_config.offset_METHOD_body         = bin_type_member_offset("METHOD", "body");
+    memprof_config.offset_METHOD_body         = bin_type_member_offset("METHOD", "body");
 #endif
 
+    config_cache_save(&memprof_config);
+  }
+
   int heap_errors_printed = 0;
 
   if (memprof_config.heaps == NULL)
@@ -1930,19 +2970,32 @@ Init_memprof()
 {
   VALUE memprof = rb_define_module("Memprof");
   eUnsupported = rb_define_class_under(memprof, "Unsupported", rb_eStandardError);
-  rb_define_singleton_method(memprof, "start", memprof_start, 0);
+  rb_define_singleton_method(memprof, "start", memprof_start, -1);
   rb_define_singleton_method(memprof, "stop", memprof_stop, 0);
   rb_define_singleton_method(memprof, "stats", memprof_stats, -1);
   rb_define_singleton_method(memprof, "stats!", memprof_stats_bang, -1);
+  rb_define_singleton_method(memprof, "site_counters", memprof_site_counters, 0);
+  rb_define_singleton_method(memprof, "overhead", memprof_overhead, 0);
   rb_define_singleton_method(memprof, "track", memprof_track, -1);
   rb_define_singleton_method(memprof, "dump", memprof_dump, -1);
   rb_define_singleton_method(memprof, "dump_all", memprof_dump_all, -1);
+  rb_define_singleton_method(memprof, "convert_dump", memprof_convert_dump, -1);
   rb_define_singleton_method(memprof, "trace", memprof_trace, -1);
   rb_define_singleton_method(memprof, "trace_request", memprof_trace_request, 1);
+  rb_define_singleton_method(memprof, "trace_start", memprof_trace_start, -1);
+  rb_define_singleton_method(memprof, "trace_stop", memprof_trace_stop, 0);
   rb_define_singleton_method(memprof, "trace_filename", memprof_trace_filename_get, 0);
   rb_define_singleton_method(memprof, "trace_filename=", memprof_trace_filename_set, -1);
-
-  objs = st_init_numtable();
+  rb_define_singleton_method(memprof, "malloc_frames", memprof_malloc_frames_get, 0);
+  rb_define_singleton_method(memprof, "malloc_frames=", memprof_malloc_frames_set, 1);
+  rb_define_singleton_method(memprof, "enable_tracer", memprof_enable_tracer, 1);
+  rb_define_singleton_method(memprof, "disable_tracer", memprof_disable_tracer, 1);
+
+  obj_table_init(&objs);
+  obj_table_init(&dump_names);
+  site_table_init();
+  stack_table_init();
+  slab_init(&tracker_slab, sizeof(struct obj_track));
   init_memprof_config_base();
   bin_init();
   init_memprof_config_extended();
@@ -1960,6 +3013,13 @@ Init_memprof()
   gc_hook = Data_Wrap_Struct(rb_cObject, sourcefile_marker, NULL, NULL);
   rb_global_variable(&gc_hook);
 
+  rolling_trace.thread = Qnil;
+  rb_global_variable(&rolling_trace.thread);
+
+  id_classpath = rb_intern("__classpath__");
+  id_tmp_classpath = rb_intern("__tmp_classpath__");
+  id_classid = rb_intern("__classid__");
+
   rb_classname = memprof_config.classname;
   rb_add_freelist = memprof_config.add_freelist;
   rb_bm_mark = memprof_config.bm_mark;
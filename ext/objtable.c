@@ -0,0 +1,171 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "objtable.h"
+#include "util.h"
+
+#define OBJ_TABLE_MIN_CAPA 1024
+
+static inline size_t
+obj_table_hash(struct obj_table *table, unsigned long key)
+{
+  /* heap slots are at least 8 byte aligned, so mix the low bits back in */
+  uint64_t h = (uint64_t)key;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return (size_t)h & (table->capa - 1);
+}
+
+static int
+obj_table_resize(struct obj_table *table, size_t capa)
+{
+  struct obj_table_entry *old = table->entries;
+  size_t old_capa = table->capa, i, idx;
+
+  struct obj_table_entry *entries = calloc(capa, sizeof(*entries));
+  if (!entries)
+    return -1;
+
+  table->entries = entries;
+  table->capa = capa;
+
+  for (i = 0; i < old_capa; i++) {
+    if (!old[i].key)
+      continue;
+
+    idx = obj_table_hash(table, old[i].key);
+    while (entries[idx].key)
+      idx = (idx + 1) & (capa - 1);
+    entries[idx] = old[i];
+  }
+
+  free(old);
+  return 0;
+}
+
+void
+obj_table_init(struct obj_table *table)
+{
+  table->entries = NULL;
+  table->capa = 0;
+  table->num_entries = 0;
+
+  if (obj_table_resize(table, OBJ_TABLE_MIN_CAPA) != 0)
+    assert(0 && "unable to allocate object table");
+}
+
+void *
+obj_table_lookup(struct obj_table *table, unsigned long key)
+{
+  size_t idx = obj_table_hash(table, key);
+
+  while (table->entries[idx].key) {
+    if (table->entries[idx].key == key)
+      return table->entries[idx].val;
+    idx = (idx + 1) & (table->capa - 1);
+  }
+
+  return NULL;
+}
+
+int
+obj_table_insert(struct obj_table *table, unsigned long key, void *val, void **old)
+{
+  size_t idx;
+
+  assert(key != 0);
+
+  if (old)
+    *old = NULL;
+
+  /* keep the load factor under 1/2 so probe sequences stay short */
+  if ((table->num_entries + 1) * 2 > table->capa) {
+    if (obj_table_resize(table, table->capa * 2) != 0) {
+      dbg_printf("unable to grow object table past %zd entries\n", table->capa);
+      return -1;
+    }
+  }
+
+  idx = obj_table_hash(table, key);
+  while (table->entries[idx].key) {
+    if (table->entries[idx].key == key) {
+      if (old)
+        *old = table->entries[idx].val;
+      table->entries[idx].val = val;
+      return 0;
+    }
+    idx = (idx + 1) & (table->capa - 1);
+  }
+
+  table->entries[idx].key = key;
+  table->entries[idx].val = val;
+  table->num_entries++;
+  return 0;
+}
+
+void *
+obj_table_delete(struct obj_table *table, unsigned long key)
+{
+  size_t mask = table->capa - 1;
+  size_t idx = obj_table_hash(table, key), next, home;
+  void *val = NULL;
+
+  while (table->entries[idx].key != key) {
+    if (!table->entries[idx].key)
+      return NULL;
+    idx = (idx + 1) & mask;
+  }
+
+  val = table->entries[idx].val;
+  table->num_entries--;
+
+  /* shift later entries of the cluster back, so no tombstones are needed */
+  next = idx;
+  while (1) {
+    next = (next + 1) & mask;
+    if (!table->entries[next].key)
+      break;
+
+    home = obj_table_hash(table, table->entries[next].key);
+    if (((next - home) & mask) >= ((next - idx) & mask)) {
+      table->entries[idx] = table->entries[next];
+      idx = next;
+    }
+  }
+
+  table->entries[idx].key = 0;
+  table->entries[idx].val = NULL;
+  return val;
+}
+
+void
+obj_table_foreach(struct obj_table *table, void (*fn)(unsigned long key, void *val, void *arg), void *arg)
+{
+  size_t i;
+
+  for (i = 0; i < table->capa; i++) {
+    if (table->entries[i].key)
+      fn(table->entries[i].key, table->entries[i].val, arg);
+  }
+}
+
+void
+obj_table_clear(struct obj_table *table)
+{
+  if (table->capa > OBJ_TABLE_MIN_CAPA) {
+    free(table->entries);
+    obj_table_init(table);
+  } else {
+    memset(table->entries, 0, table->capa * sizeof(*table->entries));
+    table->num_entries = 0;
+  }
+}
+
+size_t
+obj_table_footprint(struct obj_table *table)
+{
+  return table->capa * sizeof(*table->entries);
+}
@@ -0,0 +1,81 @@
+#if !defined(__objtable_h__)
+#define __objtable_h__
+
+#include <stddef.h>
+
+/*
+ * An open-addressing (linear probing) table mapping ruby objects to their
+ * trackers.
+ *
+ * Keys are VALUEs of heap objects, so 0 (Qfalse) is never a valid key and
+ * is used to mark empty buckets. Buckets are allocated with plain calloc,
+ * which means inserting can never trigger a ruby GC run (unlike st_insert,
+ * which goes through ruby_xmalloc).
+ */
+struct obj_table_entry {
+  unsigned long key;
+  void *val;
+};
+
+struct obj_table {
+  struct obj_table_entry *entries;
+  size_t capa;
+  size_t num_entries;
+};
+
+/*
+ * obj_table_init - initialize an empty table.
+ */
+void
+obj_table_init(struct obj_table *table);
+
+/*
+ * obj_table_lookup - find the value stored for key, or NULL.
+ */
+void *
+obj_table_lookup(struct obj_table *table, unsigned long key);
+
+/*
+ * obj_table_insert - store val for key, replacing any previous value.
+ *
+ * Given:
+ *  - table: the table to insert into.
+ *  - key:   the object.
+ *  - val:   the value to store.
+ *  - old:   if not NULL, set to the value val displaced, or NULL if key
+ *           was not in the table.
+ *
+ * Returns 0 on success, or -1 if the table needed to grow and the
+ * allocation failed (in which case the table is unchanged).
+ */
+int
+obj_table_insert(struct obj_table *table, unsigned long key, void *val, void **old);
+
+/*
+ * obj_table_delete - remove key from the table.
+ *
+ * Returns the value that was stored for key, or NULL if it was not found.
+ */
+void *
+obj_table_delete(struct obj_table *table, unsigned long key);
+
+/*
+ * obj_table_foreach - call fn for each entry in the table.
+ *
+ * The table must not be modified while iterating.
+ */
+void
+obj_table_foreach(struct obj_table *table, void (*fn)(unsigned long key, void *val, void *arg), void *arg);
+
+/*
+ * obj_table_clear - remove all entries and shrink the table.
+ */
+void
+obj_table_clear(struct obj_table *table);
+
+/*
+ * obj_table_footprint - number of bytes used by the table's buckets.
+ */
+size_t
+obj_table_footprint(struct obj_table *table);
+#endif
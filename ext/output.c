@@ -0,0 +1,535 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#if defined(HAVE_ZLIB)
+#include <zlib.h>
+#endif
+
+#include "output.h"
+#include "util.h"
+
+/* dumps are written out in 1MB blocks */
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+/* traces are small and flushed all the time, so keep their buffer small */
+#define OUTPUT_LINE_BUFFER_SIZE (64 * 1024)
+/* how much written data to let pile up before starting writeback */
+#define OUTPUT_DONTNEED_WINDOW (8 * OUTPUT_BUFFER_SIZE)
+
+#if defined(HAVE_ZLIB)
+/*
+ * Compression happens on its own thread: when the buffer fills up it is
+ * handed over to the compressor, and the writer carries on filling a second
+ * buffer in the meantime.
+ *
+ * While a buffer is pending, the compressor owns the fd and everything
+ * about it in memprof_output (error, written, ...). It publishes its error
+ * under the lock when it is done with each buffer, and the writer picks
+ * that up whenever it takes the lock itself.
+ */
+struct output_gzip {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+
+  z_stream strm;
+  unsigned char *zbuf;
+  size_t zcapa;
+
+  /* buffer handed over to the compressor, NULL when it is idle */
+  char *pending;
+  size_t pending_len;
+  int pending_flush;
+
+  char *spare;
+  int done;
+
+  /* out->error as of the last buffer compressed, and the writer's copy */
+  int error;
+  int seen_error;
+};
+#endif
+
+static void *
+output_map(size_t size)
+{
+  /* mmap'd directly so buffers are page aligned and never hit malloc */
+  void *ptr = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_ANON|MAP_PRIVATE, -1, 0);
+  if (ptr == MAP_FAILED) {
+    dbg_printf("unable to map an output buffer of %zd bytes\n", size);
+    return NULL;
+  }
+  return ptr;
+}
+
+/*
+ * Written pages can only be dropped once they are clean, so writeback is
+ * started on the latest window and the window before it is waited on and
+ * then dropped. Without sync_file_range we can only advise, which drops
+ * whatever happens to have been written back already.
+ */
+static void
+output_drop_cache(struct memprof_output *out)
+{
+  if (out->written - out->synced < OUTPUT_DONTNEED_WINDOW)
+    return;
+
+#if defined(SYNC_FILE_RANGE_WRITE)
+  sync_file_range(out->fd, out->synced, out->written - out->synced, SYNC_FILE_RANGE_WRITE);
+
+  if (out->dropped < out->synced) {
+    sync_file_range(out->fd, out->dropped, out->synced - out->dropped,
+                    SYNC_FILE_RANGE_WAIT_BEFORE|SYNC_FILE_RANGE_WRITE|SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(out->fd, out->dropped, out->synced - out->dropped, POSIX_FADV_DONTNEED);
+    out->dropped = out->synced;
+  }
+#elif defined(POSIX_FADV_DONTNEED)
+  posix_fadvise(out->fd, out->dropped, out->written - out->dropped, POSIX_FADV_DONTNEED);
+  out->dropped = out->written;
+#endif
+
+  out->synced = out->written;
+}
+
+static int
+output_write_fully(struct memprof_output *out, const char *ptr, size_t len)
+{
+  ssize_t ret;
+
+  if (out->error)
+    return -1;
+
+  while (len > 0) {
+    ret = write(out->fd, ptr, len);
+    if (ret == -1) {
+      if (errno == EINTR)
+        continue;
+      out->error = errno;
+      return -1;
+    }
+
+    ptr += ret;
+    len -= ret;
+    out->written += ret;
+  }
+
+  if (out->flags & OUTPUT_DONTNEED)
+    output_drop_cache(out);
+
+  return 0;
+}
+
+#if defined(HAVE_ZLIB)
+static void
+gzip_deflate(struct memprof_output *out, char *ptr, size_t len, int flush)
+{
+  struct output_gzip *gz = out->gz;
+  int ret;
+
+  gz->strm.next_in = (unsigned char *)ptr;
+  gz->strm.avail_in = len;
+
+  do {
+    gz->strm.next_out = gz->zbuf;
+    gz->strm.avail_out = gz->zcapa;
+
+    ret = deflate(&gz->strm, flush);
+    if (ret == Z_STREAM_ERROR) {
+      out->error = EIO;
+      return;
+    }
+
+    output_write_fully(out, (char *)gz->zbuf, gz->zcapa - gz->strm.avail_out);
+  } while (gz->strm.avail_out == 0 || (flush == Z_FINISH && ret != Z_STREAM_END));
+
+  /* each Z_FINISH ends a gzip member, and anything after starts a new one */
+  if (flush == Z_FINISH)
+    deflateReset(&gz->strm);
+}
+
+static void *
+gzip_thread(void *arg)
+{
+  struct memprof_output *out = arg;
+  struct output_gzip *gz = out->gz;
+
+  pthread_mutex_lock(&gz->lock);
+  while (1) {
+    while (!gz->pending && !gz->done)
+      pthread_cond_wait(&gz->cond, &gz->lock);
+
+    if (!gz->pending)
+      break;
+
+    pthread_mutex_unlock(&gz->lock);
+    gzip_deflate(out, gz->pending, gz->pending_len, gz->pending_flush);
+    pthread_mutex_lock(&gz->lock);
+
+    gz->error = out->error;
+    gz->pending = NULL;
+    pthread_cond_broadcast(&gz->cond);
+  }
+  pthread_mutex_unlock(&gz->lock);
+
+  return NULL;
+}
+
+static void
+gzip_wait(struct output_gzip *gz)
+{
+  pthread_mutex_lock(&gz->lock);
+  while (gz->pending)
+    pthread_cond_wait(&gz->cond, &gz->lock);
+  gz->seen_error = gz->error;
+  pthread_mutex_unlock(&gz->lock);
+}
+
+/*
+ * hand the current buffer to the compressor (once it has finished with the
+ * previous one) and switch over to the spare buffer
+ */
+static void
+gzip_submit(struct memprof_output *out, int flush)
+{
+  struct output_gzip *gz = out->gz;
+  char *buf = out->buf;
+
+  pthread_mutex_lock(&gz->lock);
+  while (gz->pending)
+    pthread_cond_wait(&gz->cond, &gz->lock);
+  gz->seen_error = gz->error;
+
+  gz->pending = buf;
+  gz->pending_len = out->len;
+  gz->pending_flush = flush;
+  pthread_cond_broadcast(&gz->cond);
+  pthread_mutex_unlock(&gz->lock);
+
+  out->buf = gz->spare;
+  gz->spare = buf;
+  out->len = 0;
+}
+
+static void
+gzip_free(struct memprof_output *out)
+{
+  struct output_gzip *gz = out->gz;
+
+  deflateEnd(&gz->strm);
+  pthread_mutex_destroy(&gz->lock);
+  pthread_cond_destroy(&gz->cond);
+  if (gz->spare)
+    munmap(gz->spare, out->capa);
+  if (gz->zbuf)
+    munmap(gz->zbuf, gz->zcapa);
+  free(gz);
+  out->gz = NULL;
+}
+
+static int
+gzip_init(struct memprof_output *out)
+{
+  struct output_gzip *gz = calloc(1, sizeof(*gz));
+  if (!gz)
+    return -1;
+
+  out->gz = gz;
+  pthread_mutex_init(&gz->lock, NULL);
+  pthread_cond_init(&gz->cond, NULL);
+
+  /*
+   * the fastest level still gets most of the 10-20x heap dumps compress
+   * by, and keeps the compressor from falling behind the heap walk.
+   * windowBits + 16 asks for a gzip header instead of a raw zlib stream.
+   */
+  if (deflateInit2(&gz->strm, Z_BEST_SPEED, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    free(gz);
+    out->gz = NULL;
+    return -1;
+  }
+
+  gz->zcapa = out->capa;
+  gz->zbuf = output_map(gz->zcapa);
+  gz->spare = output_map(out->capa);
+
+  if (!gz->zbuf || !gz->spare ||
+      pthread_create(&gz->thread, NULL, gzip_thread, out) != 0) {
+    gzip_free(out);
+    return -1;
+  }
+
+  return 0;
+}
+
+static int
+gzip_close(struct memprof_output *out)
+{
+  struct output_gzip *gz = out->gz;
+
+  gzip_submit(out, Z_FINISH);
+
+  pthread_mutex_lock(&gz->lock);
+  gz->done = 1;
+  pthread_cond_broadcast(&gz->cond);
+  pthread_mutex_unlock(&gz->lock);
+
+  pthread_join(gz->thread, NULL);
+  gzip_free(out);
+
+  return out->error ? -1 : 0;
+}
+#endif
+
+/*
+ * has anything gone wrong so far? compressed sinks only find out about the
+ * compressor's errors when they hand it a buffer
+ */
+static inline int
+output_failed(struct memprof_output *out)
+{
+#if defined(HAVE_ZLIB)
+  if (out->gz)
+    return out->gz->seen_error != 0;
+#endif
+  return out->error != 0;
+}
+
+int
+output_compression_supported()
+{
+#if defined(HAVE_ZLIB)
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+struct memprof_output *
+output_fdopen(int fd, int flags)
+{
+  struct memprof_output *out = NULL;
+
+#if !defined(HAVE_ZLIB)
+  if (flags & OUTPUT_GZIP)
+    return NULL;
+#endif
+
+  out = calloc(1, sizeof(*out));
+  if (!out)
+    return NULL;
+
+  out->fd = fd;
+  out->flags = flags;
+  out->capa = (flags & OUTPUT_LINE_BUFFERED) ? OUTPUT_LINE_BUFFER_SIZE : OUTPUT_BUFFER_SIZE;
+
+  out->buf = output_map(out->capa);
+  if (!out->buf) {
+    free(out);
+    return NULL;
+  }
+
+#if defined(HAVE_ZLIB)
+  if ((flags & OUTPUT_GZIP) && gzip_init(out) != 0) {
+    munmap(out->buf, out->capa);
+    free(out);
+    return NULL;
+  }
+#endif
+
+  return out;
+}
+
+struct memprof_output *
+output_open(const char *filename, int flags)
+{
+  struct memprof_output *out = NULL;
+  int fd = open(filename, O_WRONLY|O_CREAT|((flags & OUTPUT_APPEND) ? O_APPEND : O_TRUNC), 0644);
+
+  if (fd == -1)
+    return NULL;
+
+  out = output_fdopen(fd, flags);
+  if (!out) {
+    close(fd);
+    return NULL;
+  }
+
+  out->owns_fd = 1;
+  return out;
+}
+
+int
+output_flush(struct memprof_output *out)
+{
+  int ret = 0;
+
+#if defined(HAVE_ZLIB)
+  if (out->gz) {
+    /* a sync flush lets whoever is tailing a compressed trace see every line */
+    if (out->len > 0)
+      gzip_submit(out, (out->flags & OUTPUT_LINE_BUFFERED) ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+    return output_failed(out) ? -1 : 0;
+  }
+#endif
+
+  if (out->len > 0)
+    ret = output_write_fully(out, out->buf, out->len);
+
+  out->len = 0;
+  return out->error ? -1 : ret;
+}
+
+int
+output_write(struct memprof_output *out, const void *ptr, size_t len)
+{
+  size_t n;
+  int newline = (out->flags & OUTPUT_LINE_BUFFERED) && memchr(ptr, '\n', len) != NULL;
+
+  if (len >= out->capa && !out->gz) {
+    if (output_flush(out) != 0)
+      return -1;
+    return output_write_fully(out, ptr, len);
+  }
+
+  while (len > 0) {
+    if (out->len == out->capa && output_flush(out) != 0)
+      return -1;
+
+    n = out->capa - out->len;
+    if (n > len)
+      n = len;
+
+    memcpy(out->buf + out->len, ptr, n);
+    out->len += n;
+    ptr = (const char *)ptr + n;
+    len -= n;
+  }
+
+  if (newline)
+    return output_flush(out);
+
+  return output_failed(out) ? -1 : 0;
+}
+
+int
+output_append_file(struct memprof_output *out, const char *filename)
+{
+  ssize_t len;
+  int fd = -1;
+
+#if defined(HAVE_ZLIB)
+  /* finish the current gzip member, so the file's own members follow it */
+  if (out->gz) {
+    gzip_submit(out, Z_FINISH);
+    gzip_wait(out->gz);
+  }
+#endif
+
+  if (output_flush(out) != 0)
+    return -1;
+
+  fd = open(filename, O_RDONLY);
+  if (fd == -1)
+    return -1;
+
+  /* the (now empty) buffer doubles as the read buffer */
+  while ((len = read(fd, out->buf, out->capa)) != 0) {
+    if (len == -1 && errno == EINTR)
+      continue;
+    if (len == -1 || output_write_fully(out, out->buf, len) != 0) {
+      close(fd);
+      return -1;
+    }
+  }
+
+  close(fd);
+  return 0;
+}
+
+#if defined(HAVE_ZLIB)
+/* gzread reads plain files as is, so every file can go through it */
+#if defined(__APPLE__) || defined(__FreeBSD__)
+static int
+gzip_cookie_read(void *cookie, char *buf, int len)
+{
+  return gzread((gzFile)cookie, buf, len);
+}
+
+static int
+gzip_cookie_close(void *cookie)
+{
+  return gzclose((gzFile)cookie) == Z_OK ? 0 : EOF;
+}
+#else
+static ssize_t
+gzip_cookie_read(void *cookie, char *buf, size_t len)
+{
+  return gzread((gzFile)cookie, buf, len > INT_MAX ? INT_MAX : (unsigned)len);
+}
+
+static int
+gzip_cookie_close(void *cookie)
+{
+  return gzclose((gzFile)cookie) == Z_OK ? 0 : EOF;
+}
+#endif
+#endif
+
+FILE *
+output_open_read(const char *filename)
+{
+#if defined(HAVE_ZLIB)
+  gzFile gz = gzopen(filename, "rb");
+  FILE *in = NULL;
+
+  if (!gz)
+    return NULL;
+
+#if defined(__APPLE__) || defined(__FreeBSD__)
+  in = funopen(gz, gzip_cookie_read, NULL, NULL, gzip_cookie_close);
+#else
+  {
+    cookie_io_functions_t funcs = { .read = gzip_cookie_read, .close = gzip_cookie_close };
+    in = fopencookie(gz, "r", funcs);
+  }
+#endif
+
+  if (!in)
+    gzclose(gz);
+  return in;
+#else
+  return fopen(filename, "r");
+#endif
+}
+
+int
+output_close(struct memprof_output *out)
+{
+  int ret = 0;
+
+#if defined(HAVE_ZLIB)
+  if (out->gz)
+    ret = gzip_close(out);
+  else
+#endif
+  ret = output_flush(out);
+
+  if (out->owns_fd && close(out->fd) != 0)
+    ret = -1;
+
+  munmap(out->buf, out->capa);
+  free(out);
+  return ret;
+}
@@ -0,0 +1,131 @@
+#if !defined(__output_h__)
+#define __output_h__
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+
+/*
+ * A buffered output sink for json and binary dumps.
+ *
+ * Output is collected in a large mmap'd buffer and handed to write(2) in
+ * big blocks, instead of going through stdio (which flushes every time yajl
+ * starts a new line when the file is line buffered, and writes in small
+ * BUFSIZ sized pieces otherwise).
+ *
+ * Output can optionally be gzip compressed on the fly, by a separate thread
+ * so whoever is producing the output doesn't have to wait for zlib.
+ */
+
+/* flush after every write containing a newline, for traces people tail -f */
+#define OUTPUT_LINE_BUFFERED 0x1
+/* ask the kernel to drop written pages from the page cache as we go */
+#define OUTPUT_DONTNEED      0x2
+/* gzip compress the output (only available when built against zlib) */
+#define OUTPUT_GZIP          0x4
+/* open files for appending instead of truncating them */
+#define OUTPUT_APPEND        0x8
+
+struct output_gzip;
+
+struct memprof_output {
+  int fd;
+  int flags;
+  int owns_fd;
+  int error;
+
+  char *buf;
+  size_t len;
+  size_t capa;
+
+  /* bytes handed to the kernel, started writing back, and dropped */
+  off_t written;
+  off_t synced;
+  off_t dropped;
+
+  struct output_gzip *gz;
+};
+
+/*
+ * output_compression_supported - was memprof built with zlib?
+ */
+int
+output_compression_supported();
+
+/*
+ * output_open - create (or truncate, or append to) filename and return a
+ * sink for it.
+ *
+ * Returns NULL if the file could not be opened, or if OUTPUT_GZIP was
+ * requested but compression is not available.
+ */
+struct memprof_output *
+output_open(const char *filename, int flags);
+
+/*
+ * output_fdopen - return a sink writing to an already open fd.
+ *
+ * The fd is not closed by output_close.
+ */
+struct memprof_output *
+output_fdopen(int fd, int flags);
+
+/*
+ * output_write - append len bytes to the sink.
+ *
+ * Writes of at least a full buffer bypass the buffer entirely.
+ *
+ * Returns 0 on success, or -1 if this (or any earlier) write failed.
+ */
+int
+output_write(struct memprof_output *out, const void *ptr, size_t len);
+
+/*
+ * output_flush - hand everything buffered so far to the kernel.
+ */
+int
+output_flush(struct memprof_output *out);
+
+/*
+ * output_append_file - copy the contents of filename to the sink as is.
+ *
+ * The file is expected to have been written by a sink with the same flags,
+ * i.e. when compressing, it should already contain gzip data. Concatenated
+ * gzip members are themselves a valid gzip file.
+ */
+int
+output_append_file(struct memprof_output *out, const char *filename);
+
+/*
+ * output_close - flush and free the sink.
+ *
+ * Returns 0 if everything was written successfully, -1 otherwise.
+ */
+int
+output_close(struct memprof_output *out);
+
+/*
+ * output_open_read - open a file written by a sink, for reading it back.
+ *
+ * Files written with OUTPUT_GZIP are decompressed on the fly when memprof
+ * was built with zlib; anything else is read as is.
+ *
+ * Returns a stdio stream, or NULL if the file could not be opened.
+ */
+FILE *
+output_open_read(const char *filename);
+
+static inline int
+output_putc(struct memprof_output *out, int c)
+{
+  char ch = (char)c;
+
+  if (out->len < out->capa && !(out->flags & OUTPUT_LINE_BUFFERED)) {
+    out->buf[out->len++] = ch;
+    return 0;
+  }
+
+  return output_write(out, &ch, 1);
+}
+#endif
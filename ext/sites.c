@@ -0,0 +1,220 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sites.h"
+#include "util.h"
+
+#define SITE_TABLE_MIN_CAPA 256
+
+static struct site *sites = NULL;
+static size_t num_sites = 0;
+static size_t sites_capa = 0;
+
+/* open-addressing index of site ids (stored as id + 1, 0 is empty) */
+static uint32_t *site_index = NULL;
+static size_t site_index_capa = 0;
+
+/* interned class names, open-addressed by string hash */
+static char **names = NULL;
+static size_t num_names = 0;
+static size_t names_capa = 0;
+static size_t names_bytes = 0;
+
+static inline size_t
+name_hash(const char *name)
+{
+  uint32_t h = 2166136261U;
+
+  while (*name) {
+    h ^= (unsigned char)*name++;
+    h *= 16777619U;
+  }
+  return h;
+}
+
+static int
+names_resize(size_t capa)
+{
+  char **new_names = calloc(capa, sizeof(*new_names));
+  size_t i, idx;
+
+  if (!new_names)
+    return -1;
+
+  for (i = 0; i < names_capa; i++) {
+    if (!names[i])
+      continue;
+    idx = name_hash(names[i]) & (capa - 1);
+    while (new_names[idx])
+      idx = (idx + 1) & (capa - 1);
+    new_names[idx] = names[i];
+  }
+
+  free(names);
+  names = new_names;
+  names_capa = capa;
+  return 0;
+}
+
+const char *
+site_name_intern(const char *name)
+{
+  size_t idx;
+  char *copy = NULL;
+
+  /* keep the table at most half full, or just short of full if it can't grow */
+  if ((num_names + 1) * 2 > names_capa &&
+      names_resize(names_capa ? names_capa * 2 : SITE_TABLE_MIN_CAPA) != 0 &&
+      num_names + 1 >= names_capa)
+    return NULL;
+
+  idx = name_hash(name) & (names_capa - 1);
+  while (names[idx]) {
+    if (strcmp(names[idx], name) == 0)
+      return names[idx];
+    idx = (idx + 1) & (names_capa - 1);
+  }
+
+  if (!(copy = strdup(name)))
+    return NULL;
+
+  names[idx] = copy;
+  num_names++;
+  names_bytes += strlen(copy) + 1;
+  return copy;
+}
+
+static inline size_t
+site_hash(uint32_t stack, const char *klass_name, int type)
+{
+  uint64_t h = (uint64_t)(uintptr_t)klass_name * 0x9e3779b97f4a7c15ULL;
+  h ^= ((uint64_t)stack << 8 | (uint64_t)type) * 0xc2b2ae3d27d4eb4fULL;
+  h ^= h >> 29;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 32;
+  return (size_t)h & (site_index_capa - 1);
+}
+
+static inline int
+site_equal(struct site *site, uint32_t stack, const char *klass_name, int type)
+{
+  return site->stack == stack && site->klass_name == klass_name && site->type == type;
+}
+
+static int
+site_index_resize(size_t capa)
+{
+  uint32_t *new_index = calloc(capa, sizeof(*new_index));
+  size_t i, idx;
+
+  if (!new_index)
+    return -1;
+
+  free(site_index);
+  site_index = new_index;
+  site_index_capa = capa;
+
+  for (i = 0; i < num_sites; i++) {
+    idx = site_hash(sites[i].stack, sites[i].klass_name, sites[i].type);
+    while (site_index[idx])
+      idx = (idx + 1) & (site_index_capa - 1);
+    site_index[idx] = i + 1;
+  }
+
+  return 0;
+}
+
+void
+site_table_init()
+{
+  if (site_index_resize(SITE_TABLE_MIN_CAPA) != 0)
+    assert(0 && "unable to allocate site table");
+}
+
+uint32_t
+site_intern(uint32_t stack, const char *klass_name, int type)
+{
+  size_t idx = site_hash(stack, klass_name, type);
+  struct site *site = NULL;
+
+  while (site_index[idx]) {
+    if (site_equal(&sites[site_index[idx] - 1], stack, klass_name, type))
+      return site_index[idx] - 1;
+    idx = (idx + 1) & (site_index_capa - 1);
+  }
+
+  if (num_sites == SITE_NONE - 1)
+    return SITE_NONE;
+
+  if (num_sites == sites_capa) {
+    size_t capa = sites_capa ? sites_capa * 2 : SITE_TABLE_MIN_CAPA;
+    struct site *new_sites = realloc(sites, capa * sizeof(*sites));
+    if (!new_sites)
+      return SITE_NONE;
+    sites = new_sites;
+    sites_capa = capa;
+  }
+
+  site = &sites[num_sites];
+  memset(site, 0, sizeof(*site));
+  site->stack = stack;
+  site->klass_name = klass_name;
+  site->type = type;
+
+  site_index[idx] = ++num_sites;
+
+  /* keep the index at most half full */
+  if (num_sites * 2 > site_index_capa && site_index_resize(site_index_capa * 2) != 0)
+    dbg_printf("unable to grow the site index past %zd entries\n", site_index_capa);
+
+  return num_sites - 1;
+}
+
+struct site *
+site_get(uint32_t id)
+{
+  assert(id < num_sites);
+  return &sites[id];
+}
+
+size_t
+site_count()
+{
+  return num_sites;
+}
+
+void
+site_table_clear()
+{
+  size_t i;
+
+  free(sites);
+  sites = NULL;
+  num_sites = 0;
+  sites_capa = 0;
+
+  if (site_index_capa > SITE_TABLE_MIN_CAPA) {
+    free(site_index);
+    site_index = NULL;
+    site_table_init();
+  } else {
+    memset(site_index, 0, site_index_capa * sizeof(*site_index));
+  }
+
+  for (i = 0; i < names_capa; i++)
+    free(names[i]);
+  free(names);
+  names = NULL;
+  num_names = 0;
+  names_capa = 0;
+  names_bytes = 0;
+}
+
+size_t
+site_table_footprint()
+{
+  return sites_capa * sizeof(*sites) + site_index_capa * sizeof(*site_index) +
+    names_capa * sizeof(*names) + names_bytes;
+}
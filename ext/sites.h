@@ -0,0 +1,90 @@
+#if !defined(__sites_h__)
+#define __sites_h__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <ruby.h>
+
+/*
+ * Allocation sites.
+ *
+ * A site is a unique (stack, class) tuple, where the stack is a backtrace id
+ * from the stack trie (just a single file:line frame unless more frames were
+ * asked for) and the class is identified by name, so sites never keep a
+ * class alive or outlive it. Sites are interned once and
+ * referred to by a small integer id, so object trackers don't have to carry
+ * their own copy of the location and Memprof.stats can aggregate by id.
+ */
+struct site {
+  uint32_t stack;
+
+  /* name of the real class of the objects allocated here (interned with
+   * site_name_intern), or NULL for internal types */
+  const char *klass_name;
+  int type;
+
+  /* maintained by the newobj/freelist trampolines */
+  unsigned long allocated;
+  unsigned long freed;
+  unsigned long live;
+};
+
+#define SITE_NONE UINT32_MAX
+
+/*
+ * site_table_init - initialize the site table.
+ */
+void
+site_table_init();
+
+/*
+ * site_name_intern - find or copy a class name.
+ *
+ * Names returned for equal strings are the same pointer, and stay valid
+ * until site_table_clear.
+ *
+ * Returns NULL if the name could not be copied.
+ */
+const char *
+site_name_intern(const char *name);
+
+/*
+ * site_intern - find or create the site for a (stack, class) tuple.
+ *
+ * Given:
+ *  - stack:      id of the innermost frame in the stack trie.
+ *  - klass_name: interned name of the object's real class, or NULL.
+ *  - type:       builtin type of the object, used when klass_name is NULL.
+ *
+ * Returns the site's id, or SITE_NONE if the table could not grow.
+ */
+uint32_t
+site_intern(uint32_t stack, const char *klass_name, int type);
+
+/*
+ * site_get - look up a site by id.
+ */
+struct site *
+site_get(uint32_t id);
+
+/*
+ * site_count - number of sites interned so far.
+ *
+ * Site ids are allocated densely, from 0 to site_count() - 1.
+ */
+size_t
+site_count();
+
+/*
+ * site_table_clear - forget all sites, and free every interned name.
+ */
+void
+site_table_clear();
+
+/*
+ * site_table_footprint - number of bytes used by the site table.
+ */
+size_t
+site_table_footprint();
+#endif
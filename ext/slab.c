@@ -0,0 +1,123 @@
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include "slab.h"
+#include "util.h"
+
+#define SLAB_PAGES 16
+
+struct slab {
+  struct slab *next;
+  size_t used;
+};
+
+static size_t
+slab_header_size()
+{
+  /* keep records 16 byte aligned */
+  return (sizeof(struct slab) + 15) & ~(size_t)15;
+}
+
+void
+slab_init(struct slab_allocator *allocator, size_t obj_size)
+{
+  size_t pagesize = getpagesize();
+
+  assert(allocator != NULL);
+  assert(obj_size > 0);
+
+  memset(allocator, 0, sizeof(*allocator));
+
+  if (obj_size < sizeof(void *))
+    obj_size = sizeof(void *);
+  allocator->obj_size = (obj_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+  allocator->slab_size = pagesize * SLAB_PAGES;
+  while (allocator->slab_size < slab_header_size() + allocator->obj_size)
+    allocator->slab_size += pagesize;
+
+  allocator->objs_per_slab = (allocator->slab_size - slab_header_size()) / allocator->obj_size;
+}
+
+static struct slab *
+slab_grow(struct slab_allocator *allocator)
+{
+  struct slab *slab = mmap(NULL, allocator->slab_size, PROT_READ|PROT_WRITE,
+                           MAP_ANON|MAP_PRIVATE, -1, 0);
+  if (slab == MAP_FAILED) {
+    dbg_printf("unable to map a new slab of %zd bytes\n", allocator->slab_size);
+    return NULL;
+  }
+
+  slab->next = allocator->slabs;
+  slab->used = 0;
+  allocator->slabs = slab;
+  allocator->num_slabs++;
+  return slab;
+}
+
+void *
+slab_alloc(struct slab_allocator *allocator)
+{
+  struct slab *slab = NULL;
+  void *obj = NULL;
+
+  /* reuse freed records first */
+  if (allocator->free_list) {
+    obj = allocator->free_list;
+    allocator->free_list = *(void **)obj;
+    allocator->in_use++;
+    return obj;
+  }
+
+  /* then bump allocate out of the newest slab */
+  slab = allocator->slabs;
+  if (!slab || slab->used == allocator->objs_per_slab) {
+    slab = slab_grow(allocator);
+    if (!slab)
+      return NULL;
+  }
+
+  obj = (char *)slab + slab_header_size() + (slab->used * allocator->obj_size);
+  slab->used++;
+  allocator->in_use++;
+  return obj;
+}
+
+void
+slab_free(struct slab_allocator *allocator, void *obj)
+{
+  assert(obj != NULL);
+  assert(allocator->in_use > 0);
+
+  *(void **)obj = allocator->free_list;
+  allocator->free_list = obj;
+  allocator->in_use--;
+}
+
+void
+slab_release(struct slab_allocator *allocator)
+{
+  struct slab *slab = allocator->slabs, *next = NULL;
+
+  while (slab) {
+    next = slab->next;
+    munmap(slab, allocator->slab_size);
+    slab = next;
+  }
+
+  allocator->slabs = NULL;
+  allocator->free_list = NULL;
+  allocator->num_slabs = 0;
+  allocator->in_use = 0;
+}
+
+size_t
+slab_footprint(struct slab_allocator *allocator)
+{
+  return allocator->num_slabs * allocator->slab_size;
+}
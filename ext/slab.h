@@ -0,0 +1,69 @@
+#if !defined(__slab_h__)
+#define __slab_h__
+
+#include <stddef.h>
+
+/*
+ * A slab allocator for small fixed-size records.
+ *
+ * Records are carved out of page-sized (or larger) chunks which are mmap'd
+ * directly, so they never go through malloc (or any malloc trampolines) and
+ * can be handed back to the OS in one go.
+ */
+struct slab;
+
+struct slab_allocator {
+  size_t obj_size;
+  size_t objs_per_slab;
+  size_t slab_size;
+
+  struct slab *slabs;
+  void *free_list;
+
+  size_t num_slabs;
+  size_t in_use;
+};
+
+/*
+ * slab_init - initialize a slab allocator.
+ *
+ * Given:
+ *  - allocator: the allocator to initialize.
+ *  - obj_size:  size of each record handed out by slab_alloc.
+ *
+ * Chunks are 16 pages (SLAB_PAGES in slab.c), or as many pages as it takes
+ * to hold a single record if that is more, so the number of records per
+ * chunk depends on obj_size: 40 byte records on 4K pages come to about 1600
+ * per chunk. allocator->objs_per_slab holds the exact figure.
+ */
+void
+slab_init(struct slab_allocator *allocator, size_t obj_size);
+
+/*
+ * slab_alloc - allocate a single record.
+ *
+ * Returns NULL if a new chunk was needed but could not be mapped.
+ */
+void *
+slab_alloc(struct slab_allocator *allocator);
+
+/*
+ * slab_free - return a single record to the allocator's free list.
+ */
+void
+slab_free(struct slab_allocator *allocator, void *obj);
+
+/*
+ * slab_release - release every chunk back to the OS.
+ *
+ * All records handed out by this allocator become invalid.
+ */
+void
+slab_release(struct slab_allocator *allocator);
+
+/*
+ * slab_footprint - number of bytes currently mapped by this allocator.
+ */
+size_t
+slab_footprint(struct slab_allocator *allocator);
+#endif
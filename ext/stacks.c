@@ -0,0 +1,133 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stacks.h"
+#include "util.h"
+
+#define STACK_TABLE_MIN_CAPA 256
+
+static struct stack_frame *frames = NULL;
+static size_t num_frames = 0;
+static size_t frames_capa = 0;
+
+/* open-addressing index of frame ids (stored as id + 1, 0 is empty) */
+static uint32_t *stack_index = NULL;
+static size_t stack_index_capa = 0;
+
+static inline size_t
+stack_hash(uint32_t parent, char *file, int line)
+{
+  uint64_t h = (uint64_t)(uintptr_t)file;
+  h ^= ((uint64_t)parent << 32 | (uint32_t)line) * 0x9e3779b97f4a7c15ULL;
+  h ^= h >> 29;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 32;
+  return (size_t)h & (stack_index_capa - 1);
+}
+
+static int
+stack_index_resize(size_t capa)
+{
+  uint32_t *new_index = calloc(capa, sizeof(*new_index));
+  size_t i, idx;
+
+  if (!new_index)
+    return -1;
+
+  free(stack_index);
+  stack_index = new_index;
+  stack_index_capa = capa;
+
+  for (i = 0; i < num_frames; i++) {
+    idx = stack_hash(frames[i].parent, frames[i].file, frames[i].line);
+    while (stack_index[idx])
+      idx = (idx + 1) & (stack_index_capa - 1);
+    stack_index[idx] = i + 1;
+  }
+
+  return 0;
+}
+
+void
+stack_table_init()
+{
+  if (stack_index_resize(STACK_TABLE_MIN_CAPA) != 0)
+    assert(0 && "unable to allocate stack table");
+}
+
+uint32_t
+stack_intern(uint32_t parent, char *file, int line)
+{
+  size_t idx = stack_hash(parent, file, line);
+  struct stack_frame *frame = NULL;
+
+  while (stack_index[idx]) {
+    frame = &frames[stack_index[idx] - 1];
+    if (frame->parent == parent && frame->file == file && frame->line == line)
+      return stack_index[idx] - 1;
+    idx = (idx + 1) & (stack_index_capa - 1);
+  }
+
+  if (num_frames == STACK_NONE - 1)
+    return STACK_NONE;
+
+  if (num_frames == frames_capa) {
+    size_t capa = frames_capa ? frames_capa * 2 : STACK_TABLE_MIN_CAPA;
+    struct stack_frame *new_frames = realloc(frames, capa * sizeof(*frames));
+    if (!new_frames)
+      return STACK_NONE;
+    frames = new_frames;
+    frames_capa = capa;
+  }
+
+  frame = &frames[num_frames];
+  frame->file = file;
+  frame->line = line;
+  frame->parent = parent;
+
+  stack_index[idx] = ++num_frames;
+
+  /* keep the index at most half full */
+  if (num_frames * 2 > stack_index_capa && stack_index_resize(stack_index_capa * 2) != 0)
+    dbg_printf("unable to grow the stack index past %zd entries\n", stack_index_capa);
+
+  return num_frames - 1;
+}
+
+struct stack_frame *
+stack_get(uint32_t id)
+{
+  assert(id < num_frames);
+  return &frames[id];
+}
+
+size_t
+stack_count()
+{
+  return num_frames;
+}
+
+void
+stack_table_clear()
+{
+  free(frames);
+  frames = NULL;
+  num_frames = 0;
+  frames_capa = 0;
+
+  if (stack_index_capa > STACK_TABLE_MIN_CAPA) {
+    free(stack_index);
+    stack_index = NULL;
+    stack_table_init();
+  } else {
+    memset(stack_index, 0, stack_index_capa * sizeof(*stack_index));
+  }
+}
+
+size_t
+stack_table_footprint()
+{
+  return frames_capa * sizeof(*frames) + stack_index_capa * sizeof(*stack_index);
+}
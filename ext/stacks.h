@@ -0,0 +1,66 @@
+#if !defined(__stacks_h__)
+#define __stacks_h__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Ruby backtraces, stored as a prefix trie.
+ *
+ * Each node is one frame (a file:line pair) plus the id of its caller's
+ * node, so stacks that share their outermost frames share storage, and a
+ * whole backtrace is identified by the id of its innermost frame.
+ */
+struct stack_frame {
+  char *file;
+  int line;
+  uint32_t parent;
+};
+
+#define STACK_NONE UINT32_MAX
+#define STACK_MAX_FRAMES 32
+
+/*
+ * stack_table_init - initialize the stack trie.
+ */
+void
+stack_table_init();
+
+/*
+ * stack_intern - find or create the node for a frame.
+ *
+ * Given:
+ *  - parent: id of the calling frame's node, or STACK_NONE for the
+ *            outermost frame.
+ *  - file:   source file name (as stored in ruby's NODEs), may be NULL.
+ *  - line:   line number.
+ *
+ * Returns the node's id, or STACK_NONE if the table could not grow.
+ */
+uint32_t
+stack_intern(uint32_t parent, char *file, int line);
+
+/*
+ * stack_get - look up a frame by id.
+ */
+struct stack_frame *
+stack_get(uint32_t id);
+
+/*
+ * stack_count - number of frames interned so far.
+ */
+size_t
+stack_count();
+
+/*
+ * stack_table_clear - forget all stacks.
+ */
+void
+stack_table_clear();
+
+/*
+ * stack_table_footprint - number of bytes used by the stack trie.
+ */
+size_t
+stack_table_footprint();
+#endif
@@ -1,10 +1,16 @@
 #include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
 
 #include "json.h"
 #include "tracer.h"
+#include "tramp.h"
 #include "util.h"
 
 static json_gen tracing_json_gen = NULL;
@@ -58,7 +64,12 @@ do_trace_invoke(struct tracer *trace, trace_fn fn)
 {
   switch (fn) {
     case TRACE_START:
+      /* tag everything the tracer hooks, so it can be switched as a whole */
+      tramp_set_owner(trace->id);
       trace->start();
+      tramp_set_owner(NULL);
+      if (trace->disabled)
+        tramp_set_enabled(trace->id, 0);
       break;
     case TRACE_STOP:
       trace->stop();
@@ -67,6 +78,8 @@ do_trace_invoke(struct tracer *trace, trace_fn fn)
       trace->reset();
       break;
     case TRACE_DUMP:
+      if (trace->disabled)
+        break;
       json_gen_cstr(tracing_json_gen, trace->id);
       json_gen_map_open(tracing_json_gen);
       trace->dump(tracing_json_gen);
@@ -104,6 +117,22 @@ trace_invoke(const char *id, trace_fn fn)
   return 0;
 }
 
+int
+trace_set_enabled(const char *id, int enabled)
+{
+  struct tracer_list *tmp = tracer_list;
+  while (tmp) {
+    if (strcmp(id, tmp->tracer->id) == 0) {
+      tmp->tracer->disabled = !enabled;
+      /* fails harmlessly if the tracer hasn't hooked anything yet */
+      tramp_set_enabled(id, enabled);
+      return 0;
+    }
+    tmp = tmp->next;
+  }
+  return -1;
+}
+
 void
 trace_set_output(json_gen gen)
 {
@@ -115,3 +144,211 @@ trace_get_output()
 {
   return tracing_json_gen;
 }
+
+/*
+ * the header is padded out to a cache line, so the counters that follow it
+ * never share a line with the registry pointers
+ */
+#define STATS_HEADER_SIZE 64
+
+struct trace_stats_block {
+  struct trace_stats_block *next;
+  size_t map_size;
+  int owned;
+};
+
+static inline void *
+stats_block_data(struct trace_stats_block *block)
+{
+  return (char *)block + STATS_HEADER_SIZE;
+}
+
+static inline struct trace_stats_block *
+stats_data_block(void *data)
+{
+  return (struct trace_stats_block *)((char *)data - STATS_HEADER_SIZE);
+}
+
+static void
+stats_block_release(void *data)
+{
+  /* the thread is gone, but its counts stay on the registry */
+  __sync_lock_release(&stats_data_block(data)->owned);
+}
+
+static struct trace_stats_block *
+stats_block_map(struct trace_stats *stats)
+{
+  size_t pagesize = getpagesize();
+  size_t map_size = (STATS_HEADER_SIZE + stats->size + pagesize - 1) & ~(pagesize - 1);
+  struct trace_stats_block *block = NULL;
+
+  block = mmap(NULL, map_size, PROT_READ|PROT_WRITE, MAP_ANON|MAP_PRIVATE, -1, 0);
+  if (block == MAP_FAILED) {
+    dbg_printf("unable to map a stats block of %zd bytes\n", map_size);
+    return NULL;
+  }
+
+  block->map_size = map_size;
+  block->next = stats->blocks;
+  stats->blocks = block;
+  return block;
+}
+
+void
+trace_stats_init(struct trace_stats *stats, size_t size)
+{
+  struct trace_stats_block *block = NULL;
+  int ret;
+
+  assert(size % sizeof(uint64_t) == 0);
+  assert(STATS_HEADER_SIZE >= sizeof(struct trace_stats_block));
+
+  memset(stats, 0, sizeof(*stats));
+  stats->size = size;
+
+  ret = pthread_key_create(&stats->key, stats_block_release);
+  assert(ret == 0);
+  pthread_mutex_init(&stats->lock, NULL);
+
+  /* the first block is kept as a fallback, shared by threads we can't map a block for */
+  block = stats_block_map(stats);
+  assert(block != NULL);
+  block->owned = 1;
+}
+
+void *
+trace_stats_alloc(struct trace_stats *stats)
+{
+  struct trace_stats_block *block = NULL, *shared = NULL;
+
+  pthread_mutex_lock(&stats->lock);
+
+  for (block = stats->blocks; block; block = block->next) {
+    if (!block->next)
+      shared = block;
+    else if (__sync_bool_compare_and_swap(&block->owned, 0, 1))
+      break;
+  }
+
+  if (!block) {
+    block = stats_block_map(stats);
+    if (block)
+      block->owned = 1;
+    else
+      block = shared;
+  }
+
+  pthread_mutex_unlock(&stats->lock);
+
+  if (block != shared)
+    pthread_setspecific(stats->key, stats_block_data(block));
+
+  return stats_block_data(block);
+}
+
+void
+trace_stats_reset(struct trace_stats *stats)
+{
+  struct trace_stats_block *block = NULL;
+
+  pthread_mutex_lock(&stats->lock);
+  for (block = stats->blocks; block; block = block->next)
+    memset(stats_block_data(block), 0, stats->size);
+  pthread_mutex_unlock(&stats->lock);
+}
+
+void
+trace_stats_add_hist(struct trace_stats *stats, size_t offset)
+{
+  assert(stats->num_max_words < TRACE_STATS_MAX_HISTS);
+  assert(offset % sizeof(uint64_t) == 0);
+  assert(offset + sizeof(struct trace_hist) <= stats->size);
+
+  stats->max_words[stats->num_max_words++] =
+    (offset + offsetof(struct trace_hist, max)) / sizeof(uint64_t);
+}
+
+void
+trace_stats_merge(struct trace_stats *stats, void *dst)
+{
+  struct trace_stats_block *block = NULL;
+  uint64_t *sum = dst, *src = NULL, maxes[TRACE_STATS_MAX_HISTS];
+  size_t i, words = stats->size / sizeof(uint64_t);
+
+  memset(dst, 0, stats->size);
+  memset(maxes, 0, sizeof(maxes));
+
+  pthread_mutex_lock(&stats->lock);
+  for (block = stats->blocks; block; block = block->next) {
+    src = stats_block_data(block);
+    for (i = 0; i < words; i++)
+      sum[i] += src[i];
+    for (i = 0; i < stats->num_max_words; i++)
+      if (src[stats->max_words[i]] > maxes[i])
+        maxes[i] = src[stats->max_words[i]];
+  }
+  pthread_mutex_unlock(&stats->lock);
+
+  /* histogram maxes were summed along with everything else */
+  for (i = 0; i < stats->num_max_words; i++)
+    sum[stats->max_words[i]] = maxes[i];
+}
+
+static uint64_t
+hist_bucket_max(unsigned int bucket)
+{
+  unsigned int group = bucket >> TRACE_HIST_SUB_BITS;
+  uint64_t sub = bucket & (TRACE_HIST_SUB - 1);
+
+  if (group == 0)
+    return sub;
+
+  return ((TRACE_HIST_SUB + sub + 1) << (group - 1)) - 1;
+}
+
+uint64_t
+trace_hist_percentile(struct trace_hist *hist, double pct)
+{
+  uint64_t total = 0, seen = 0, target;
+  double rank;
+  unsigned int i;
+
+  for (i = 0; i < TRACE_HIST_BUCKETS; i++)
+    total += hist->counts[i];
+
+  if (total == 0)
+    return 0;
+
+  /* the smallest number of values that covers pct% of them */
+  rank = total * pct / 100;
+  target = (uint64_t)rank;
+  if (target < rank || target < 1)
+    target++;
+
+  for (i = 0; i < TRACE_HIST_BUCKETS; i++) {
+    seen += hist->counts[i];
+    if (seen >= target)
+      return hist_bucket_max(i);
+  }
+
+  return hist_bucket_max(TRACE_HIST_BUCKETS - 1);
+}
+
+void
+trace_hist_dump(json_gen gen, struct trace_hist *hist)
+{
+  uint64_t p50 = trace_hist_percentile(hist, 50);
+  uint64_t p90 = trace_hist_percentile(hist, 90);
+  uint64_t p99 = trace_hist_percentile(hist, 99);
+
+  /* bucket bounds can overshoot the largest value actually seen */
+  json_gen_cstr(gen, "p50");
+  json_gen_ms(gen, p50 < hist->max ? p50 : hist->max);
+  json_gen_cstr(gen, "p90");
+  json_gen_ms(gen, p90 < hist->max ? p90 : hist->max);
+  json_gen_cstr(gen, "p99");
+  json_gen_ms(gen, p99 < hist->max ? p99 : hist->max);
+  json_gen_cstr(gen, "max");
+  json_gen_ms(gen, hist->max);
+}
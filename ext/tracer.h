@@ -1,6 +1,10 @@
 #if !defined(__TRACER__H_)
 #define __TRACER__H_
 
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
 #include "json.h"
 
 struct tracer {
@@ -9,6 +13,9 @@ struct tracer {
   void (*stop)();
   void (*reset)();
   void (*dump)(json_gen);
+
+  /* switched off by trace_set_enabled: hooks stay in, but aren't taken */
+  int disabled;
 };
 
 typedef enum {
@@ -30,12 +37,160 @@ trace_invoke_all(trace_fn fn);
 int
 trace_invoke(const char *id, trace_fn fn);
 
+/*
+ * trace_set_enabled - switch a tracer on or off without unhooking it.
+ *
+ * A disabled tracer's trampolines jump straight to the functions they
+ * replaced, and it is left out of trace dumps. This holds across traces
+ * until it is enabled again.
+ *
+ * Returns 0 on success, or -1 if there is no tracer called id.
+ */
+int
+trace_set_enabled(const char *id, int enabled);
+
 void
 trace_set_output(json_gen gen);
 
 json_gen
 trace_get_output();
 
+/*
+ * Per-thread statistics.
+ *
+ * Trampolines can be hit from any native thread (libmysqlclient, C
+ * extensions, ...), so instead of bumping a single global struct each thread
+ * gets its own zeroed block of stats, on its own page, found through a
+ * pthread key. Every block ever handed out is kept on a registry so they can
+ * be summed up (or reset) together. Blocks of threads which have exited are
+ * handed to the next new thread, counts and all.
+ *
+ * Stat structs must be made up of uint64_t counters only, since merging
+ * simply adds blocks together word by word. The exception is the max of
+ * each histogram registered with trace_stats_add_hist, which is merged by
+ * taking the largest.
+ */
+#define TRACE_STATS_MAX_HISTS 8
+
+struct trace_stats_block;
+
+struct trace_stats {
+  size_t size;
+  pthread_key_t key;
+  pthread_mutex_t lock;
+  struct trace_stats_block *blocks;
+
+  /* word offsets of each histogram's max */
+  size_t max_words[TRACE_STATS_MAX_HISTS];
+  unsigned int num_max_words;
+};
+
+/*
+ * trace_stats_init - set up per-thread blocks of size bytes each.
+ */
+void
+trace_stats_init(struct trace_stats *stats, size_t size);
+
+void *
+trace_stats_alloc(struct trace_stats *stats);
+
+/*
+ * trace_stats_get - the calling thread's stats block.
+ *
+ * Never returns NULL: if a new block cannot be mapped, the thread shares a
+ * block with other threads instead.
+ */
+static inline void *
+trace_stats_get(struct trace_stats *stats)
+{
+  void *block = pthread_getspecific(stats->key);
+  if (block)
+    return block;
+  return trace_stats_alloc(stats);
+}
+
+/*
+ * trace_stats_reset - zero every thread's block.
+ *
+ * Threads still running trampolines may race with this and have an
+ * increment land just before or after the reset.
+ */
+void
+trace_stats_reset(struct trace_stats *stats);
+
+/*
+ * trace_stats_add_hist - note that there is a struct trace_hist at offset
+ * bytes into each block, so its max is merged properly.
+ */
+void
+trace_stats_add_hist(struct trace_stats *stats, size_t offset);
+
+/*
+ * trace_stats_merge - sum every thread's block into dst.
+ */
+void
+trace_stats_merge(struct trace_stats *stats, void *dst);
+
+/*
+ * Latency histograms.
+ *
+ * A log-linear (HDR style) histogram of ns durations: values below 16 get a
+ * bucket each, and every power of two above that is split into 16 equal
+ * buckets, so any recorded value is off by at most 1/16th. Values of 2^40ns
+ * (about 18 minutes) and up all land in the last bucket.
+ *
+ * Histograms are plain arrays of counters (plus the max), so they can live
+ * inside per-thread stats blocks and be merged along with them, as long as
+ * they are registered with trace_stats_add_hist.
+ */
+#define TRACE_HIST_SUB_BITS 4
+#define TRACE_HIST_SUB      (1 << TRACE_HIST_SUB_BITS)
+#define TRACE_HIST_MAX_BITS 40
+#define TRACE_HIST_BUCKETS  ((TRACE_HIST_MAX_BITS - TRACE_HIST_SUB_BITS + 1) * TRACE_HIST_SUB)
+
+struct trace_hist {
+  /* the largest value recorded, exactly */
+  uint64_t max;
+  uint64_t counts[TRACE_HIST_BUCKETS];
+};
+
+static inline void
+trace_hist_record(struct trace_hist *hist, uint64_t value)
+{
+  unsigned int msb, bucket;
+
+  if (value < TRACE_HIST_SUB) {
+    bucket = value;
+  } else if (value >= (1ULL << TRACE_HIST_MAX_BITS)) {
+    bucket = TRACE_HIST_BUCKETS - 1;
+  } else {
+    msb = 63 - __builtin_clzll(value);
+    bucket = ((msb - TRACE_HIST_SUB_BITS + 1) << TRACE_HIST_SUB_BITS) +
+             ((value >> (msb - TRACE_HIST_SUB_BITS)) & (TRACE_HIST_SUB - 1));
+  }
+
+  hist->counts[bucket]++;
+  if (value > hist->max)
+    hist->max = value;
+}
+
+/*
+ * trace_hist_percentile - the value below which pct% of recorded values fall.
+ *
+ * Returns the highest value that maps to the same bucket, or 0 if nothing
+ * was recorded.
+ */
+uint64_t
+trace_hist_percentile(struct trace_hist *hist, double pct);
+
+/*
+ * trace_hist_dump - add p50, p90, p99 and max keys (in ms) to the open map.
+ *
+ * Percentiles are capped at the max, which is exact.
+ */
+void
+trace_hist_dump(json_gen gen, struct trace_hist *hist);
+
 /* for now, these will live here */
 extern void install_malloc_tracer();
 extern void install_gc_tracer();
@@ -45,4 +200,8 @@ extern void install_postgres_tracer();
 extern void install_objects_tracer();
 extern void install_memcache_tracer();
 extern void install_resources_tracer();
+
+/* number of return addresses the memory tracer records per malloc caller */
+extern int memory_trace_set_frames(int frames);
+extern int memory_trace_get_frames();
 #endif
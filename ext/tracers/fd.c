@@ -1,6 +1,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <poll.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -16,50 +17,59 @@
 #include "tramp.h"
 #include "util.h"
 
+/* times are in ns, and printed as ms */
 struct memprof_fd_stats {
-  size_t read_calls;
-  uint32_t read_time;
-  size_t read_requested_bytes;
-  size_t read_actual_bytes;
-
-  size_t write_calls;
-  uint32_t write_time;
-  size_t write_requested_bytes;
-  size_t write_actual_bytes;
-
-  size_t recv_calls;
-  uint32_t recv_time;
-  ssize_t recv_actual_bytes;
-
-  size_t connect_calls;
-  uint32_t connect_time;
-
-  size_t select_calls;
-  uint32_t select_time;
-
-  size_t poll_calls;
-  uint32_t poll_time;
+  uint64_t read_calls;
+  uint64_t read_time;
+  struct trace_hist read_hist;
+  uint64_t read_requested_bytes;
+  uint64_t read_actual_bytes;
+
+  uint64_t write_calls;
+  uint64_t write_time;
+  struct trace_hist write_hist;
+  uint64_t write_requested_bytes;
+  uint64_t write_actual_bytes;
+
+  uint64_t recv_calls;
+  uint64_t recv_time;
+  struct trace_hist recv_hist;
+  uint64_t recv_actual_bytes;
+
+  uint64_t connect_calls;
+  uint64_t connect_time;
+  struct trace_hist connect_hist;
+
+  uint64_t select_calls;
+  uint64_t select_time;
+  struct trace_hist select_hist;
+
+  uint64_t poll_calls;
+  uint64_t poll_time;
+  struct trace_hist poll_hist;
 };
 
 static struct tracer tracer;
-static struct memprof_fd_stats stats;
+static struct trace_stats stats;
 
 static ssize_t
 read_tramp(int fildes, void *buf, size_t nbyte) {
-  uint64_t millis = 0;
+  struct memprof_fd_stats *s = trace_stats_get(&stats);
+  uint64_t ns = 0;
   int err;
   ssize_t ret;
 
-  millis = timeofday_ms();
+  ns = timeofday_ns();
   ret = read(fildes, buf, nbyte);
   err = errno;
-  millis = timeofday_ms() - millis;
+  ns = timeofday_ns() - ns;
 
-  stats.read_time += millis;
-  stats.read_calls++;
-  stats.read_requested_bytes += nbyte;
+  s->read_time += ns;
+  trace_hist_record(&s->read_hist, ns);
+  s->read_calls++;
+  s->read_requested_bytes += nbyte;
   if (ret > 0)
-    stats.read_actual_bytes += ret;
+    s->read_actual_bytes += ret;
 
   errno = err;
   return ret;
@@ -67,20 +77,22 @@ read_tramp(int fildes, void *buf, size_t nbyte) {
 
 static ssize_t
 write_tramp(int fildes, const void *buf, size_t nbyte) {
-  uint64_t millis = 0;
+  struct memprof_fd_stats *s = trace_stats_get(&stats);
+  uint64_t ns = 0;
   int err;
   ssize_t ret;
 
-  millis = timeofday_ms();
+  ns = timeofday_ns();
   ret = write(fildes, buf, nbyte);
   err = errno;
-  millis = timeofday_ms() - millis;
+  ns = timeofday_ns() - ns;
 
-  stats.write_time += millis;
-  stats.write_calls++;
-  stats.write_requested_bytes += nbyte;
+  s->write_time += ns;
+  trace_hist_record(&s->write_hist, ns);
+  s->write_calls++;
+  s->write_requested_bytes += nbyte;
   if (ret > 0)
-    stats.write_actual_bytes += ret;
+    s->write_actual_bytes += ret;
 
   errno = err;
   return ret;
@@ -88,19 +100,21 @@ write_tramp(int fildes, const void *buf, size_t nbyte) {
 
 static ssize_t
 recv_tramp(int socket, void *buffer, size_t length, int flags) {
-  uint64_t millis = 0;
+  struct memprof_fd_stats *s = trace_stats_get(&stats);
+  uint64_t ns = 0;
   int err;
   ssize_t ret;
 
-  millis = timeofday_ms();
+  ns = timeofday_ns();
   ret = recv(socket, buffer, length, flags);
   err = errno;
-  millis = timeofday_ms() - millis;
+  ns = timeofday_ns() - ns;
 
-  stats.recv_time += millis;
-  stats.recv_calls++;
+  s->recv_time += ns;
+  trace_hist_record(&s->recv_hist, ns);
+  s->recv_calls++;
   if (ret > 0)
-    stats.recv_actual_bytes += ret;
+    s->recv_actual_bytes += ret;
 
   errno = err;
   return ret;
@@ -108,16 +122,18 @@ recv_tramp(int socket, void *buffer, size_t length, int flags) {
 
 static int
 connect_tramp(int socket, const struct sockaddr *address, socklen_t address_len) {
-  uint64_t millis = 0;
+  struct memprof_fd_stats *s = trace_stats_get(&stats);
+  uint64_t ns = 0;
   int err, ret;
 
-  millis = timeofday_ms();
+  ns = timeofday_ns();
   ret = connect(socket, address, address_len);
   err = errno;
-  millis = timeofday_ms() - millis;
+  ns = timeofday_ns() - ns;
 
-  stats.connect_time += millis;
-  stats.connect_calls++;
+  s->connect_time += ns;
+  trace_hist_record(&s->connect_hist, ns);
+  s->connect_calls++;
 
   errno = err;
   return ret;
@@ -126,16 +142,18 @@ connect_tramp(int socket, const struct sockaddr *address, socklen_t address_len)
 static int
 select_tramp(int nfds, fd_set *readfds, fd_set *writefds, fd_set *errorfds, struct timeval *timeout)
 {
-  uint64_t millis = 0;
+  struct memprof_fd_stats *s = trace_stats_get(&stats);
+  uint64_t ns = 0;
   int ret, err;
 
-  millis = timeofday_ms();
+  ns = timeofday_ns();
   ret = select(nfds, readfds, writefds, errorfds, timeout);
   err = errno;
-  millis = timeofday_ms() - millis;
+  ns = timeofday_ns() - ns;
 
-  stats.select_time += millis;
-  stats.select_calls++;
+  s->select_time += ns;
+  trace_hist_record(&s->select_hist, ns);
+  s->select_calls++;
 
   errno = err;
   return ret;
@@ -144,16 +162,18 @@ select_tramp(int nfds, fd_set *readfds, fd_set *writefds, fd_set *errorfds, stru
 static int
 poll_tramp(struct pollfd fds[], nfds_t nfds, int timeout)
 {
-  uint64_t millis = 0;
+  struct memprof_fd_stats *s = trace_stats_get(&stats);
+  uint64_t ns = 0;
   int ret, err;
 
-  millis = timeofday_ms();
+  ns = timeofday_ns();
   ret = poll(fds, nfds, timeout);
   err = errno;
-  millis = timeofday_ms() - millis;
+  ns = timeofday_ns() - ns;
 
-  stats.poll_time += millis;
-  stats.poll_calls++;
+  s->poll_time += ns;
+  trace_hist_record(&s->poll_hist, ns);
+  s->poll_calls++;
 
   errno = err;
   return ret;
@@ -161,13 +181,6 @@ poll_tramp(struct pollfd fds[], nfds_t nfds, int timeout)
 
 static void
 fd_trace_start() {
-  static int inserted = 0;
-
-  if (!inserted)
-    inserted = 1;
-  else
-    return;
-
   insert_tramp("read", read_tramp);
   insert_tramp("write", write_tramp);
   insert_tramp("poll", poll_tramp);
@@ -183,82 +196,102 @@ fd_trace_start() {
 
 static void
 fd_trace_stop() {
+  remove_tramp("read", read_tramp);
+  remove_tramp("write", write_tramp);
+  remove_tramp("poll", poll_tramp);
+
+  #ifdef HAVE_MACH
+  remove_tramp("select$DARWIN_EXTSN", select_tramp);
+  #else
+  remove_tramp("select", select_tramp);
+  remove_tramp("connect", connect_tramp);
+  remove_tramp("recv", recv_tramp);
+  #endif
 }
 
 static void
 fd_trace_reset() {
-  memset(&stats, 0, sizeof(stats));
+  trace_stats_reset(&stats);
 }
 
 static void
 fd_trace_dump(json_gen gen) {
-  if (stats.read_calls > 0) {
+  struct memprof_fd_stats totals;
+  trace_stats_merge(&stats, &totals);
+
+  if (totals.read_calls > 0) {
     json_gen_cstr(gen, "read");
     json_gen_map_open(gen);
     json_gen_cstr(gen, "calls");
-    json_gen_integer(gen, stats.read_calls);
+    json_gen_integer(gen, totals.read_calls);
     json_gen_cstr(gen, "time");
-    json_gen_integer(gen, stats.read_time);
+    json_gen_ms(gen, totals.read_time);
+    trace_hist_dump(gen, &totals.read_hist);
     json_gen_cstr(gen, "requested");
-    json_gen_integer(gen, stats.read_requested_bytes);
+    json_gen_integer(gen, totals.read_requested_bytes);
     json_gen_cstr(gen, "actual");
-    json_gen_integer(gen, stats.read_actual_bytes);
+    json_gen_integer(gen, totals.read_actual_bytes);
     json_gen_map_close(gen);
   }
 
-  if (stats.write_calls > 0) {
+  if (totals.write_calls > 0) {
     json_gen_cstr(gen, "write");
     json_gen_map_open(gen);
     json_gen_cstr(gen, "calls");
-    json_gen_integer(gen, stats.write_calls);
+    json_gen_integer(gen, totals.write_calls);
     json_gen_cstr(gen, "time");
-    json_gen_integer(gen, stats.write_time);
+    json_gen_ms(gen, totals.write_time);
+    trace_hist_dump(gen, &totals.write_hist);
     json_gen_cstr(gen, "requested");
-    json_gen_integer(gen, stats.write_requested_bytes);
+    json_gen_integer(gen, totals.write_requested_bytes);
     json_gen_cstr(gen, "actual");
-    json_gen_integer(gen, stats.write_actual_bytes);
+    json_gen_integer(gen, totals.write_actual_bytes);
     json_gen_map_close(gen);
   }
 
-  if (stats.recv_calls > 0) {
+  if (totals.recv_calls > 0) {
     json_gen_cstr(gen, "recv");
     json_gen_map_open(gen);
     json_gen_cstr(gen, "calls");
-    json_gen_integer(gen, stats.recv_calls);
+    json_gen_integer(gen, totals.recv_calls);
     json_gen_cstr(gen, "time");
-    json_gen_integer(gen, stats.recv_time);
+    json_gen_ms(gen, totals.recv_time);
+    trace_hist_dump(gen, &totals.recv_hist);
     json_gen_cstr(gen, "actual");
-    json_gen_integer(gen, stats.recv_actual_bytes);
+    json_gen_integer(gen, totals.recv_actual_bytes);
     json_gen_map_close(gen);
   }
 
-  if (stats.connect_calls > 0) {
+  if (totals.connect_calls > 0) {
     json_gen_cstr(gen, "connect");
     json_gen_map_open(gen);
     json_gen_cstr(gen, "calls");
-    json_gen_integer(gen, stats.connect_calls);
+    json_gen_integer(gen, totals.connect_calls);
     json_gen_cstr(gen, "time");
-    json_gen_integer(gen, stats.connect_time);
+    json_gen_ms(gen, totals.connect_time);
+    trace_hist_dump(gen, &totals.connect_hist);
     json_gen_map_close(gen);
   }
 
-  if (stats.select_calls > 0) {
+  if (totals.select_calls > 0) {
     json_gen_cstr(gen, "select");
     json_gen_map_open(gen);
     json_gen_cstr(gen, "calls");
-    json_gen_integer(gen, stats.select_calls);
+    json_gen_integer(gen, totals.select_calls);
     json_gen_cstr(gen, "time");
-    json_gen_integer(gen, stats.select_time);
+    json_gen_ms(gen, totals.select_time);
+    trace_hist_dump(gen, &totals.select_hist);
     json_gen_map_close(gen);
   }
 
-  if (stats.poll_calls > 0) {
+  if (totals.poll_calls > 0) {
     json_gen_cstr(gen, "poll");
     json_gen_map_open(gen);
     json_gen_cstr(gen, "calls");
-    json_gen_integer(gen, stats.poll_calls);
+    json_gen_integer(gen, totals.poll_calls);
     json_gen_cstr(gen, "time");
-    json_gen_integer(gen, stats.poll_time);
+    json_gen_ms(gen, totals.poll_time);
+    trace_hist_dump(gen, &totals.poll_hist);
     json_gen_map_close(gen);
   }
 }
@@ -271,5 +304,12 @@ void install_fd_tracer()
   tracer.dump = fd_trace_dump;
   tracer.id = "fd";
 
+  trace_stats_init(&stats, sizeof(struct memprof_fd_stats));
+  trace_stats_add_hist(&stats, offsetof(struct memprof_fd_stats, read_hist));
+  trace_stats_add_hist(&stats, offsetof(struct memprof_fd_stats, write_hist));
+  trace_stats_add_hist(&stats, offsetof(struct memprof_fd_stats, recv_hist));
+  trace_stats_add_hist(&stats, offsetof(struct memprof_fd_stats, connect_hist));
+  trace_stats_add_hist(&stats, offsetof(struct memprof_fd_stats, select_hist));
+  trace_stats_add_hist(&stats, offsetof(struct memprof_fd_stats, poll_hist));
   trace_insert(&tracer);
 }
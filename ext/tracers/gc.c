@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,74 +13,78 @@
 #include "tramp.h"
 #include "util.h"
 
+/* times are in ns, and printed as ms */
 struct memprof_gc_stats {
-  size_t gc_calls;
-  uint32_t gc_time;
-  uint32_t gc_utime;
-  uint32_t gc_stime;
+  uint64_t gc_calls;
+  uint64_t gc_time;
+  struct trace_hist gc_hist;
+  uint64_t gc_utime;
+  uint64_t gc_stime;
 };
 
 static struct tracer tracer;
-static struct memprof_gc_stats stats;
+static struct trace_stats stats;
 static void (*orig_garbage_collect)();
 
 static void
 gc_tramp()
 {
-  uint64_t millis = 0;
+  struct memprof_gc_stats *s = trace_stats_get(&stats);
+  uint64_t ns = 0;
   struct rusage usage_start, usage_end;
 
-  millis = timeofday_ms();
+  ns = timeofday_ns();
   getrusage(RUSAGE_SELF, &usage_start);
   orig_garbage_collect();
   getrusage(RUSAGE_SELF, &usage_end);
-  millis = timeofday_ms() - millis;
+  ns = timeofday_ns() - ns;
 
-  stats.gc_time += millis;
-  stats.gc_calls++;
+  s->gc_time += ns;
+  trace_hist_record(&s->gc_hist, ns);
+  s->gc_calls++;
 
-  stats.gc_utime += TVAL_TO_INT64(usage_end.ru_utime) - TVAL_TO_INT64(usage_start.ru_utime);
-  stats.gc_stime += TVAL_TO_INT64(usage_end.ru_stime) - TVAL_TO_INT64(usage_start.ru_stime);
+  s->gc_utime += TVAL_TO_NS(usage_end.ru_utime) - TVAL_TO_NS(usage_start.ru_utime);
+  s->gc_stime += TVAL_TO_NS(usage_end.ru_stime) - TVAL_TO_NS(usage_start.ru_stime);
 }
 
 static void
 gc_trace_start() {
-  static int inserted = 0;
-
-  if (!inserted)
-    inserted = 1;
-  else
-    return;
-
-  orig_garbage_collect = bin_find_symbol("garbage_collect", NULL, 0);
-  assert(orig_garbage_collect != NULL);
-  dbg_printf("orig_garbage_collect: %p\n", orig_garbage_collect);
+  if (!orig_garbage_collect) {
+    orig_garbage_collect = bin_find_symbol("garbage_collect", NULL, 0);
+    assert(orig_garbage_collect != NULL);
+    dbg_printf("orig_garbage_collect: %p\n", orig_garbage_collect);
+  }
 
   insert_tramp("garbage_collect", gc_tramp);
 }
 
 static void
 gc_trace_stop() {
+  remove_tramp("garbage_collect", gc_tramp);
 }
 
 static void
 gc_trace_reset() {
-  memset(&stats, 0, sizeof(stats));
+  trace_stats_reset(&stats);
 }
 
 static void
 gc_trace_dump(json_gen gen) {
+  struct memprof_gc_stats totals;
+  trace_stats_merge(&stats, &totals);
+
   json_gen_cstr(gen, "calls");
-  json_gen_integer(gen, stats.gc_calls);
+  json_gen_integer(gen, totals.gc_calls);
 
   json_gen_cstr(gen, "time");
-  json_gen_integer(gen, stats.gc_time);
+  json_gen_ms(gen, totals.gc_time);
+  trace_hist_dump(gen, &totals.gc_hist);
 
   json_gen_cstr(gen, "utime");
-  json_gen_integer(gen, stats.gc_utime);
+  json_gen_ms(gen, totals.gc_utime);
 
   json_gen_cstr(gen, "stime");
-  json_gen_integer(gen, stats.gc_stime);
+  json_gen_ms(gen, totals.gc_stime);
 }
 
 void install_gc_tracer()
@@ -90,5 +95,7 @@ void install_gc_tracer()
   tracer.dump = gc_trace_dump;
   tracer.id = "gc";
 
+  trace_stats_init(&stats, sizeof(struct memprof_gc_stats));
+  trace_stats_add_hist(&stats, offsetof(struct memprof_gc_stats, gc_hist));
   trace_insert(&tracer);
 }
@@ -1,5 +1,6 @@
 #include <assert.h>
 #include <errno.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,16 +13,21 @@
 #include "tramp.h"
 #include "util.h"
 
+/* times are in ns, and printed as ms */
 struct memprof_memcache_stats {
-  size_t get_calls;
-  size_t get_responses[45];
-
-  size_t set_calls;
-  size_t set_responses[45];
+  uint64_t get_calls;
+  uint64_t get_time;
+  struct trace_hist get_hist;
+  uint64_t get_responses[45];
+
+  uint64_t set_calls;
+  uint64_t set_time;
+  struct trace_hist set_hist;
+  uint64_t set_responses[45];
 };
 
 static struct tracer tracer;
-static struct memprof_memcache_stats stats;
+static struct trace_stats stats;
 static const char* (*_memcached_lib_version)(void);
 static char* (*_memcached_get)(void *ptr, const char *key, size_t key_length, size_t *value_length, uint32_t *flags, void *error);
 static int (*_memcached_set)(void *ptr, const char *key, size_t key_length, const char *value, size_t value_length, time_t expiration, uint32_t flags);
@@ -29,19 +35,29 @@ static int (*_memcached_set)(void *ptr, const char *key, size_t key_length, cons
 static char*
 memcached_get_tramp(void *ptr, const char *key, size_t key_length, size_t *value_length, uint32_t *flags, void *error)
 {
+  struct memprof_memcache_stats *s = trace_stats_get(&stats);
+  uint64_t ns = timeofday_ns();
   char* ret = _memcached_get(ptr, key, key_length, value_length, flags, error);
-  stats.get_calls++;
+  ns = timeofday_ns() - ns;
+  s->get_calls++;
+  s->get_time += ns;
+  trace_hist_record(&s->get_hist, ns);
   int err = *(int*)error;
-  stats.get_responses[err > 42 ? 44 : err]++;
+  s->get_responses[err > 42 ? 44 : err]++;
   return ret;
 }
 
 static int
 memcached_set_tramp(void *ptr, const char *key, size_t key_length, const char *value, size_t value_length, time_t expiration, uint32_t flags)
 {
+  struct memprof_memcache_stats *s = trace_stats_get(&stats);
+  uint64_t ns = timeofday_ns();
   int ret = _memcached_set(ptr, key, key_length, value, value_length, expiration, flags);
-  stats.set_calls++;
-  stats.set_responses[ret > 42 ? 44 : ret]++;
+  ns = timeofday_ns() - ns;
+  s->set_calls++;
+  s->set_time += ns;
+  trace_hist_record(&s->set_hist, ns);
+  s->set_responses[ret > 42 ? 44 : ret]++;
   return ret;
 }
 
@@ -49,35 +65,40 @@ static void
 memcache_trace_start() {
   static int inserted = 0;
 
-  if (!inserted)
+  if (!inserted) {
     inserted = 1;
-  else
-    return;
-
-  _memcached_lib_version = bin_find_symbol("memcached_lib_version", NULL, 1);
-  if (_memcached_lib_version) {
-    const char *version = _memcached_lib_version();
-    if (strcmp(version, "0.32") == 0) {
-      _memcached_get = bin_find_symbol("memcached_get", NULL, 1);
-      insert_tramp("memcached_get", memcached_get_tramp);
-
-      _memcached_set = bin_find_symbol("memcached_set", NULL, 1);
-      insert_tramp("memcached_set", memcached_set_tramp);
+
+    _memcached_lib_version = bin_find_symbol("memcached_lib_version", NULL, 1);
+    if (_memcached_lib_version) {
+      const char *version = _memcached_lib_version();
+      if (strcmp(version, "0.32") == 0) {
+        _memcached_get = bin_find_symbol("memcached_get", NULL, 1);
+        _memcached_set = bin_find_symbol("memcached_set", NULL, 1);
+      }
     }
   }
+
+  if (_memcached_get)
+    insert_tramp("memcached_get", memcached_get_tramp);
+  if (_memcached_set)
+    insert_tramp("memcached_set", memcached_set_tramp);
 }
 
 static void
 memcache_trace_stop() {
+  if (_memcached_get)
+    remove_tramp("memcached_get", memcached_get_tramp);
+  if (_memcached_set)
+    remove_tramp("memcached_set", memcached_set_tramp);
 }
 
 static void
 memcache_trace_reset() {
-  memset(&stats, 0, sizeof(stats));
+  trace_stats_reset(&stats);
 }
 
 static void
-memcache_trace_dump_results(json_gen gen, size_t responses[])
+memcache_trace_dump_results(json_gen gen, uint64_t responses[])
 {
   int i;
   json_gen_cstr(gen, "responses");
@@ -105,21 +126,30 @@ memcache_trace_dump_results(json_gen gen, size_t responses[])
 
 static void
 memcache_trace_dump(json_gen gen) {
-  if (stats.get_calls > 0) {
+  struct memprof_memcache_stats totals;
+  trace_stats_merge(&stats, &totals);
+
+  if (totals.get_calls > 0) {
     json_gen_cstr(gen, "get");
     json_gen_map_open(gen);
     json_gen_cstr(gen, "calls");
-    json_gen_integer(gen, stats.get_calls);
-    memcache_trace_dump_results(gen, stats.get_responses);
+    json_gen_integer(gen, totals.get_calls);
+    json_gen_cstr(gen, "time");
+    json_gen_ms(gen, totals.get_time);
+    trace_hist_dump(gen, &totals.get_hist);
+    memcache_trace_dump_results(gen, totals.get_responses);
     json_gen_map_close(gen);
   }
 
-  if (stats.set_calls > 0) {
+  if (totals.set_calls > 0) {
     json_gen_cstr(gen, "set");
     json_gen_map_open(gen);
     json_gen_cstr(gen, "calls");
-    json_gen_integer(gen, stats.set_calls);
-    memcache_trace_dump_results(gen, stats.set_responses);
+    json_gen_integer(gen, totals.set_calls);
+    json_gen_cstr(gen, "time");
+    json_gen_ms(gen, totals.set_time);
+    trace_hist_dump(gen, &totals.set_hist);
+    memcache_trace_dump_results(gen, totals.set_responses);
     json_gen_map_close(gen);
   }
 }
@@ -132,5 +162,8 @@ void install_memcache_tracer()
   tracer.dump = memcache_trace_dump;
   tracer.id = "memcache";
 
+  trace_stats_init(&stats, sizeof(struct memprof_memcache_stats));
+  trace_stats_add_hist(&stats, offsetof(struct memprof_memcache_stats, get_hist));
+  trace_stats_add_hist(&stats, offsetof(struct memprof_memcache_stats, set_hist));
   trace_insert(&tracer);
 }
@@ -2,6 +2,7 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 
 #include "arch.h"
@@ -11,40 +12,166 @@
 #include "tramp.h"
 #include "util.h"
 
+/*
+ * Requests are bucketed by the power of two they round up to: 8 bytes and
+ * under, 16, 32, ... up to 1GB, and everything bigger in the last class.
+ */
+#define MEMORY_SIZE_CLASSES 29
+
+/* callers are tracked in a fixed size table, which must be a power of two */
+#define MEMORY_CALLERS 4096
+#define MEMORY_CALLERS_PROBE 64
+#define MEMORY_TOP_CALLERS 10
+/* the most return addresses a caller can be made up of */
+#define MEMORY_CALLER_FRAMES 8
+
 struct memprof_memory_stats {
-  size_t malloc_bytes_requested;
-  size_t calloc_bytes_requested;
-  size_t realloc_bytes_requested;
-
-  size_t malloc_bytes_actual;
-  size_t calloc_bytes_actual;
-  size_t realloc_bytes_actual;
-  size_t free_bytes_actual;
-
-  size_t malloc_calls;
-  size_t calloc_calls;
-  size_t realloc_calls;
-  size_t free_calls;
+  uint64_t malloc_bytes_requested;
+  uint64_t calloc_bytes_requested;
+  uint64_t realloc_bytes_requested;
+
+  uint64_t malloc_bytes_actual;
+  uint64_t calloc_bytes_actual;
+  uint64_t realloc_bytes_actual;
+  uint64_t free_bytes_actual;
+
+  uint64_t malloc_calls;
+  uint64_t calloc_calls;
+  uint64_t realloc_calls;
+  uint64_t free_calls;
+
+  /* malloc, calloc and realloc requests by size class */
+  uint64_t size_calls[MEMORY_SIZE_CLASSES];
+  uint64_t size_bytes[MEMORY_SIZE_CLASSES];
+};
+
+/*
+ * Bytes allocated minus bytes freed since the trace started, and its
+ * high-water mark. These are shared by all threads (a free often happens on
+ * a different thread than its malloc), so they're updated atomically.
+ */
+static long live_bytes;
+static long live_bytes_max;
+
+/*
+ * Allocations by caller, where a caller is the return address of the
+ * malloc/calloc/realloc call, plus the return addresses of the next
+ * caller_frames - 1 frames up the stack.
+ *
+ * Callers are claimed with a compare and swap on a hash of their return
+ * addresses, and their counters bumped atomically, so no lock is ever taken.
+ * Once the table (or the stretch of it a caller hashes into) is full,
+ * allocations from new callers are only counted in callers_dropped.
+ *
+ * Return addresses are only turned into names when the trace is dumped.
+ */
+struct memory_caller {
+  uint64_t hash;
+  void *pcs[MEMORY_CALLER_FRAMES];
+  uint64_t calls;
+  uint64_t bytes;
 };
 
+static struct memory_caller callers[MEMORY_CALLERS];
+static uint64_t callers_dropped;
+static int caller_frames = 1;
+
 static struct tracer tracer;
-static struct memprof_memory_stats stats;
+static struct trace_stats stats;
 static size_t (*malloc_usable_size)(void *ptr);
 
+static inline unsigned int
+size_class(size_t size)
+{
+  unsigned int cls;
+
+  if (size <= 8)
+    return 0;
+
+  cls = (64 - __builtin_clzll((unsigned long long)size - 1)) - 3;
+  return cls < MEMORY_SIZE_CLASSES ? cls : MEMORY_SIZE_CLASSES - 1;
+}
+
+static inline void
+record_size(struct memprof_memory_stats *s, size_t size)
+{
+  unsigned int cls = size_class(size);
+
+  s->size_calls[cls]++;
+  s->size_bytes[cls] += size;
+}
+
+static inline void
+record_live(long bytes)
+{
+  long live = __sync_add_and_fetch(&live_bytes, bytes), max;
+
+  while (live > (max = live_bytes_max) &&
+         !__sync_bool_compare_and_swap(&live_bytes_max, max, live))
+    ;
+}
+
+static inline uint64_t
+hash_pcs(void **pcs, int num)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  int i;
+
+  for (i = 0; i < num; i++)
+    hash = (hash ^ (uintptr_t)pcs[i]) * 1099511628211ULL;
+
+  /* 0 marks an empty slot */
+  return hash ? hash : 1;
+}
+
+static void
+record_caller(void *frame, size_t bytes)
+{
+  void *pcs[MEMORY_CALLER_FRAMES];
+  int num = tramp_backtrace(frame, pcs, caller_frames);
+  uint64_t hash = hash_pcs(pcs, num), cur;
+  size_t i = hash & (MEMORY_CALLERS - 1);
+  int probes = 0;
+
+  for (; probes < MEMORY_CALLERS_PROBE; probes++, i = (i + 1) & (MEMORY_CALLERS - 1)) {
+    cur = callers[i].hash;
+    if (cur == 0) {
+      cur = __sync_val_compare_and_swap(&callers[i].hash, 0, hash);
+      if (cur == 0)
+        memcpy(callers[i].pcs, pcs, num * sizeof(void *));
+    }
+
+    if (cur == 0 || cur == hash) {
+      __sync_fetch_and_add(&callers[i].calls, 1);
+      __sync_fetch_and_add(&callers[i].bytes, bytes);
+      return;
+    }
+  }
+
+  __sync_fetch_and_add(&callers_dropped, 1);
+}
+
 static void *
 malloc_tramp(size_t size)
 {
+  struct memprof_memory_stats *s = trace_stats_get(&stats);
   void *ret = NULL;
+  size_t usable;
   int err;
 
   ret = malloc(size);
   err = errno;
 
-  stats.malloc_bytes_requested += size;
-  stats.malloc_calls++;
+  s->malloc_bytes_requested += size;
+  s->malloc_calls++;
+  record_size(s, size);
 
-  if (ret)
-    stats.malloc_bytes_actual += malloc_usable_size(ret);
+  if (ret) {
+    usable = malloc_usable_size(ret);
+    s->malloc_bytes_actual += usable;
+    record_live(usable);
+    record_caller(__builtin_frame_address(0), size);
+  }
 
   errno = err;
   return ret;
@@ -53,17 +180,24 @@ malloc_tramp(size_t size)
 static void *
 calloc_tramp(size_t nmemb, size_t size)
 {
+  struct memprof_memory_stats *s = trace_stats_get(&stats);
   void *ret = NULL;
+  size_t usable;
   int err;
 
   ret = calloc(nmemb, size);
   err = errno;
 
-  stats.calloc_bytes_requested += (nmemb * size);
-  stats.calloc_calls++;
+  s->calloc_bytes_requested += (nmemb * size);
+  s->calloc_calls++;
+  record_size(s, nmemb * size);
 
-  if (ret)
-    stats.calloc_bytes_actual += malloc_usable_size(ret);
+  if (ret) {
+    usable = malloc_usable_size(ret);
+    s->calloc_bytes_actual += usable;
+    record_live(usable);
+    record_caller(__builtin_frame_address(0), nmemb * size);
+  }
 
   errno = err;
   return ret;
@@ -72,17 +206,30 @@ calloc_tramp(size_t nmemb, size_t size)
 static void *
 realloc_tramp(void *ptr, size_t size)
 {
+  struct memprof_memory_stats *s = trace_stats_get(&stats);
   void *ret = NULL;
+  size_t usable, old = 0;
   int err;
 
+  if (ptr)
+    old = malloc_usable_size(ptr);
+
   ret = realloc(ptr, size);
   err = errno;
 
-  stats.realloc_bytes_requested += size;
-  stats.realloc_calls++;
-
-  if (ret)
-    stats.realloc_bytes_actual += malloc_usable_size(ret);
+  s->realloc_bytes_requested += size;
+  s->realloc_calls++;
+  record_size(s, size);
+
+  if (ret) {
+    usable = malloc_usable_size(ret);
+    s->realloc_bytes_actual += usable;
+    record_live((long)usable - (long)old);
+    record_caller(__builtin_frame_address(0), size);
+  } else if (size == 0) {
+    /* realloc(ptr, 0) frees ptr */
+    record_live(-(long)old);
+  }
 
   errno = err;
   return ret;
@@ -91,10 +238,16 @@ realloc_tramp(void *ptr, size_t size)
 static void
 free_tramp(void *ptr)
 {
-  if (ptr)
-    stats.free_bytes_actual += malloc_usable_size(ptr);
+  struct memprof_memory_stats *s = trace_stats_get(&stats);
+  size_t usable;
+
+  if (ptr) {
+    usable = malloc_usable_size(ptr);
+    s->free_bytes_actual += usable;
+    record_live(-(long)usable);
+  }
 
-  stats.free_calls++;
+  s->free_calls++;
 
   free(ptr);
 }
@@ -102,13 +255,6 @@ free_tramp(void *ptr)
 static void
 malloc_trace_start()
 {
-  static int inserted = 0;
-
-  if (!inserted)
-    inserted = 1;
-  else
-    return;
-
   if (!malloc_usable_size) {
     malloc_usable_size = bin_find_symbol("MallocExtension_GetAllocatedSize", NULL, 1);
     if (!malloc_usable_size) {
@@ -132,62 +278,220 @@ malloc_trace_start()
 static void
 malloc_trace_stop()
 {
+  remove_tramp("malloc", malloc_tramp);
+  remove_tramp("realloc", realloc_tramp);
+  remove_tramp("calloc", calloc_tramp);
+  remove_tramp("free", free_tramp);
 }
 
 static void
 malloc_trace_reset()
 {
-  memset(&stats, 0, sizeof(stats));
+  trace_stats_reset(&stats);
+
+  /* like trace_stats_reset, this races with threads still allocating */
+  memset(callers, 0, sizeof(callers));
+  callers_dropped = 0;
+  live_bytes = 0;
+  live_bytes_max = 0;
+}
+
+static void
+dump_size_classes(json_gen gen, struct memprof_memory_stats *totals)
+{
+  char label[32];
+  int i;
+
+  json_gen_cstr(gen, "sizes");
+  json_gen_map_open(gen);
+  for (i = 0; i < MEMORY_SIZE_CLASSES; i++) {
+    if (totals->size_calls[i] == 0)
+      continue;
+
+    if (i == MEMORY_SIZE_CLASSES - 1)
+      snprintf(label, sizeof(label), ">%lu", 1UL << (i + 2));
+    else
+      snprintf(label, sizeof(label), "<=%lu", 1UL << (i + 3));
+
+    json_gen_cstr(gen, label);
+    json_gen_map_open(gen);
+    json_gen_cstr(gen, "calls");
+    json_gen_integer(gen, totals->size_calls[i]);
+    json_gen_cstr(gen, "bytes");
+    json_gen_integer(gen, totals->size_bytes[i]);
+    json_gen_map_close(gen);
+  }
+  json_gen_map_close(gen);
+}
+
+static void
+dump_frame(json_gen gen, void *pc, char *name, char *object)
+{
+  json_gen_cstr(gen, "address");
+  json_gen_pointer(gen, pc);
+  json_gen_cstr(gen, "name");
+  if (name)
+    json_gen_cstr(gen, name);
+  else
+    json_gen_null(gen);
+  json_gen_cstr(gen, "object");
+  if (object)
+    json_gen_cstr(gen, object);
+  else
+    json_gen_null(gen);
+}
+
+static void
+dump_callers(json_gen gen)
+{
+  struct memory_caller *top[MEMORY_TOP_CALLERS];
+  void *pcs[MEMORY_TOP_CALLERS * MEMORY_CALLER_FRAMES];
+  char *names[MEMORY_TOP_CALLERS * MEMORY_CALLER_FRAMES];
+  char *objects[MEMORY_TOP_CALLERS * MEMORY_CALLER_FRAMES];
+  int i, j, k, num = 0;
+
+  /* pick out the callers responsible for the most bytes */
+  for (i = 0; i < MEMORY_CALLERS; i++) {
+    if (!callers[i].hash || !callers[i].pcs[0])
+      continue;
+
+    for (j = num; j > 0 && top[j-1]->bytes < callers[i].bytes; j--)
+      if (j < MEMORY_TOP_CALLERS)
+        top[j] = top[j-1];
+
+    if (j < MEMORY_TOP_CALLERS) {
+      top[j] = &callers[i];
+      if (num < MEMORY_TOP_CALLERS)
+        num++;
+    }
+  }
+
+  /* name everything in one go, so each library is only read once */
+  for (i = 0; i < num; i++)
+    memcpy(&pcs[i * MEMORY_CALLER_FRAMES], top[i]->pcs, sizeof(top[i]->pcs));
+  bin_find_symbol_names(pcs, names, objects, num * MEMORY_CALLER_FRAMES);
+
+  json_gen_cstr(gen, "callers");
+  json_gen_array_open(gen);
+  for (i = 0; i < num; i++) {
+    k = i * MEMORY_CALLER_FRAMES;
+
+    json_gen_map_open(gen);
+    dump_frame(gen, pcs[k], names[k], objects[k]);
+    json_gen_cstr(gen, "calls");
+    json_gen_integer(gen, top[i]->calls);
+    json_gen_cstr(gen, "bytes");
+    json_gen_integer(gen, top[i]->bytes);
+
+    if (pcs[k + 1]) {
+      json_gen_cstr(gen, "backtrace");
+      json_gen_array_open(gen);
+      for (j = 1; j < MEMORY_CALLER_FRAMES && pcs[k + j]; j++) {
+        json_gen_map_open(gen);
+        dump_frame(gen, pcs[k + j], names[k + j], objects[k + j]);
+        json_gen_map_close(gen);
+      }
+      json_gen_array_close(gen);
+    }
+
+    json_gen_map_close(gen);
+  }
+  json_gen_array_close(gen);
+
+  for (i = 0; i < num * MEMORY_CALLER_FRAMES; i++) {
+    free(names[i]);
+    free(objects[i]);
+  }
+
+  if (callers_dropped > 0) {
+    json_gen_cstr(gen, "callers_dropped");
+    json_gen_integer(gen, callers_dropped);
+  }
 }
 
 static void
 malloc_trace_dump(json_gen gen)
 {
-  if (stats.malloc_calls > 0) {
+  struct memprof_memory_stats totals;
+  trace_stats_merge(&stats, &totals);
+
+  if (totals.malloc_calls > 0) {
     json_gen_cstr(gen, "malloc");
     json_gen_map_open(gen);
     json_gen_cstr(gen, "calls");
-    json_gen_integer(gen, stats.malloc_calls);
+    json_gen_integer(gen, totals.malloc_calls);
     json_gen_cstr(gen, "requested");
-    json_gen_integer(gen, stats.malloc_bytes_requested);
+    json_gen_integer(gen, totals.malloc_bytes_requested);
     json_gen_cstr(gen, "actual");
-    json_gen_integer(gen, stats.malloc_bytes_actual);
+    json_gen_integer(gen, totals.malloc_bytes_actual);
     json_gen_map_close(gen);
   }
 
-  if (stats.realloc_calls > 0) {
+  if (totals.realloc_calls > 0) {
     json_gen_cstr(gen, "realloc");
     json_gen_map_open(gen);
     json_gen_cstr(gen, "calls");
-    json_gen_integer(gen, stats.realloc_calls);
+    json_gen_integer(gen, totals.realloc_calls);
     json_gen_cstr(gen, "requested");
-    json_gen_integer(gen, stats.realloc_bytes_requested);
+    json_gen_integer(gen, totals.realloc_bytes_requested);
     json_gen_cstr(gen, "actual");
-    json_gen_integer(gen, stats.realloc_bytes_actual);
+    json_gen_integer(gen, totals.realloc_bytes_actual);
     json_gen_map_close(gen);
   }
 
-  if (stats.calloc_calls > 0) {
+  if (totals.calloc_calls > 0) {
     json_gen_cstr(gen, "calloc");
     json_gen_map_open(gen);
     json_gen_cstr(gen, "calls");
-    json_gen_integer(gen, stats.calloc_calls);
+    json_gen_integer(gen, totals.calloc_calls);
     json_gen_cstr(gen, "requested");
-    json_gen_integer(gen, stats.calloc_bytes_requested);
+    json_gen_integer(gen, totals.calloc_bytes_requested);
     json_gen_cstr(gen, "actual");
-    json_gen_integer(gen, stats.calloc_bytes_actual);
+    json_gen_integer(gen, totals.calloc_bytes_actual);
     json_gen_map_close(gen);
   }
 
-  if (stats.free_calls > 0) {
+  if (totals.free_calls > 0) {
     json_gen_cstr(gen, "free");
     json_gen_map_open(gen);
     json_gen_cstr(gen, "calls");
-    json_gen_integer(gen, stats.free_calls);
+    json_gen_integer(gen, totals.free_calls);
     json_gen_cstr(gen, "actual");
-    json_gen_integer(gen, stats.free_bytes_actual);
+    json_gen_integer(gen, totals.free_bytes_actual);
     json_gen_map_close(gen);
   }
+
+  if (totals.malloc_calls + totals.calloc_calls + totals.realloc_calls > 0) {
+    dump_size_classes(gen, &totals);
+    dump_callers(gen);
+  }
+
+  json_gen_cstr(gen, "live");
+  json_gen_integer(gen, live_bytes);
+  json_gen_cstr(gen, "live_max");
+  json_gen_integer(gen, live_bytes_max);
+}
+
+/*
+ * memory_trace_set_frames - how many return addresses make up a caller.
+ *
+ * Anything over 1 walks frame pointers, and only callers built with frame
+ * pointers get more than one return address.
+ */
+int
+memory_trace_set_frames(int frames)
+{
+  if (frames < 1 || frames > MEMORY_CALLER_FRAMES)
+    return -1;
+
+  caller_frames = frames;
+  return 0;
+}
+
+int
+memory_trace_get_frames()
+{
+  return caller_frames;
 }
 
 void install_malloc_tracer()
@@ -198,5 +502,6 @@ void install_malloc_tracer()
   tracer.dump = malloc_trace_dump;
   tracer.id = "memory";
 
+  trace_stats_init(&stats, sizeof(struct memprof_memory_stats));
   trace_insert(&tracer);
 }
@@ -1,5 +1,6 @@
 #include <assert.h>
 #include <errno.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,50 +14,55 @@
 #include "tramp.h"
 #include "util.h"
 
+/* times are in ns, and printed as ms */
 struct memprof_mysql_stats {
-  size_t query_calls;
-  uint32_t query_time;
+  uint64_t query_calls;
+  uint64_t query_time;
+  struct trace_hist query_hist;
 
-  size_t query_calls_by_type[sql_UNKNOWN+1];
-  uint32_t query_time_by_type[sql_UNKNOWN+1];
+  uint64_t query_calls_by_type[sql_UNKNOWN+1];
+  uint64_t query_time_by_type[sql_UNKNOWN+1];
 };
 
 static struct tracer tracer;
-static struct memprof_mysql_stats stats;
+static struct trace_stats stats;
 
 static int (*orig_real_query)(void *mysql, const char *stmt_str, unsigned long length);
 static int (*orig_send_query)(void *mysql, const char *stmt_str, unsigned long length);
 
 static int
 real_query_tramp(void *mysql, const char *stmt_str, unsigned long length) {
+  struct memprof_mysql_stats *s = trace_stats_get(&stats);
   enum memprof_sql_type type;
-  uint64_t millis = 0;
+  uint64_t ns = 0;
   int ret;
 
-  millis = timeofday_ms();
+  ns = timeofday_ns();
   ret = orig_real_query(mysql, stmt_str, length);
-  millis = timeofday_ms() - millis;
+  ns = timeofday_ns() - ns;
 
-  stats.query_time += millis;
-  stats.query_calls++;
+  s->query_time += ns;
+  trace_hist_record(&s->query_hist, ns);
+  s->query_calls++;
 
   type = memprof_sql_query_type(stmt_str, length);
-  stats.query_time_by_type[type] += millis;
-  stats.query_calls_by_type[type]++;
+  s->query_time_by_type[type] += ns;
+  s->query_calls_by_type[type]++;
 
   return ret;
 }
 
 static int
 send_query_tramp(void *mysql, const char *stmt_str, unsigned long length) {
+  struct memprof_mysql_stats *s = trace_stats_get(&stats);
   enum memprof_sql_type type;
   int ret;
 
   ret = orig_send_query(mysql, stmt_str, length);
-  stats.query_calls++;
+  s->query_calls++;
 
   type = memprof_sql_query_type(stmt_str, length);
-  stats.query_calls_by_type[type]++;
+  s->query_calls_by_type[type]++;
 
   return ret;
 }
@@ -65,39 +71,45 @@ static void
 mysql_trace_start() {
   static int inserted = 0;
 
-  if (!inserted)
+  if (!inserted) {
     inserted = 1;
-  else
-    return;
+    orig_real_query = bin_find_symbol("mysql_real_query", NULL, 1);
+    orig_send_query = bin_find_symbol("mysql_send_query", NULL, 1);
+  }
 
-  orig_real_query = bin_find_symbol("mysql_real_query", NULL, 1);
   if (orig_real_query)
     insert_tramp("mysql_real_query", real_query_tramp);
-
-  orig_send_query = bin_find_symbol("mysql_send_query", NULL, 1);
   if (orig_send_query)
     insert_tramp("mysql_send_query", send_query_tramp);
 }
 
 static void
 mysql_trace_stop() {
+  if (orig_real_query)
+    remove_tramp("mysql_real_query", real_query_tramp);
+  if (orig_send_query)
+    remove_tramp("mysql_send_query", send_query_tramp);
 }
 
 static void
 mysql_trace_reset() {
-  memset(&stats, 0, sizeof(stats));
+  trace_stats_reset(&stats);
 }
 
 static void
 mysql_trace_dump(json_gen gen) {
   enum memprof_sql_type i;
+  struct memprof_mysql_stats totals;
+
+  trace_stats_merge(&stats, &totals);
 
-  if (stats.query_calls > 0) {
+  if (totals.query_calls > 0) {
     json_gen_cstr(gen, "queries");
-    json_gen_integer(gen, stats.query_calls);
+    json_gen_integer(gen, totals.query_calls);
 
     json_gen_cstr(gen, "time");
-    json_gen_integer(gen, stats.query_time);
+    json_gen_ms(gen, totals.query_time);
+    trace_hist_dump(gen, &totals.query_hist);
 
     json_gen_cstr(gen, "types");
     json_gen_map_open(gen);
@@ -106,10 +118,10 @@ mysql_trace_dump(json_gen gen) {
       json_gen_map_open(gen);
 
       json_gen_cstr(gen, "queries");
-      json_gen_integer(gen, stats.query_calls_by_type[i]);
+      json_gen_integer(gen, totals.query_calls_by_type[i]);
 
       json_gen_cstr(gen, "time");
-      json_gen_integer(gen, stats.query_time_by_type[i]);
+      json_gen_ms(gen, totals.query_time_by_type[i]);
 
       json_gen_map_close(gen);
     }
@@ -125,5 +137,7 @@ void install_mysql_tracer()
   tracer.dump = mysql_trace_dump;
   tracer.id = "mysql";
 
+  trace_stats_init(&stats, sizeof(struct memprof_mysql_stats));
+  trace_stats_add_hist(&stats, offsetof(struct memprof_mysql_stats, query_hist));
   trace_insert(&tracer);
 }
@@ -12,12 +12,12 @@
 #include "ruby.h"
 
 struct memprof_objects_stats {
-  size_t newobj_calls;
-  size_t types[T_MASK+1];
+  uint64_t newobj_calls;
+  uint64_t types[T_MASK+1];
 };
 
 static struct tracer tracer;
-static struct memprof_objects_stats stats;
+static struct trace_stats stats;
 static VALUE (*orig_rb_newobj)();
 
 static VALUE last_obj = 0;
@@ -26,43 +26,41 @@ static VALUE gc_hook = 0;
 static void
 record_last_obj()
 {
+  struct memprof_objects_stats *s = trace_stats_get(&stats);
   if (last_obj) {
-    stats.types[BUILTIN_TYPE(last_obj)]++;
+    s->types[BUILTIN_TYPE(last_obj)]++;
     last_obj = 0;
   }
 }
 
 static VALUE
 objects_tramp() {
+  struct memprof_objects_stats *s = trace_stats_get(&stats);
   record_last_obj();
-  stats.newobj_calls++;
+  s->newobj_calls++;
   last_obj = orig_rb_newobj();
   return last_obj;
 }
 
 static void
 objects_trace_start() {
-  static int inserted = 0;
-
-  if (!inserted)
-    inserted = 1;
-  else
-    return;
-
-  orig_rb_newobj = bin_find_symbol("rb_newobj", NULL, 0);
-  assert(orig_rb_newobj != NULL);
-  dbg_printf("orig_rb_newobj: %p\n", orig_rb_newobj);
+  if (!orig_rb_newobj) {
+    orig_rb_newobj = bin_find_symbol("rb_newobj", NULL, 0);
+    assert(orig_rb_newobj != NULL);
+    dbg_printf("orig_rb_newobj: %p\n", orig_rb_newobj);
+  }
 
   insert_tramp("rb_newobj", objects_tramp);
 }
 
 static void
 objects_trace_stop() {
+  remove_tramp("rb_newobj", objects_tramp);
 }
 
 static void
 objects_trace_reset() {
-  memset(&stats, 0, sizeof(stats));
+  trace_stats_reset(&stats);
   last_obj = 0;
 }
 
@@ -127,17 +125,20 @@ type_string(int type) {
 static void
 objects_trace_dump(json_gen gen) {
   int i;
+  struct memprof_objects_stats totals;
+
   record_last_obj();
+  trace_stats_merge(&stats, &totals);
 
   json_gen_cstr(gen, "created");
-  json_gen_integer(gen, stats.newobj_calls);
+  json_gen_integer(gen, totals.newobj_calls);
 
   json_gen_cstr(gen, "types");
   json_gen_map_open(gen);
   for (i=0; i<T_MASK+1; i++) {
-    if (stats.types[i] > 0) {
+    if (totals.types[i] > 0) {
       json_gen_cstr(gen, type_string(i));
-      json_gen_integer(gen, stats.types[i]);
+      json_gen_integer(gen, totals.types[i]);
     }
   }
   json_gen_map_close(gen);
@@ -156,5 +157,6 @@ void install_objects_tracer()
   tracer.dump = objects_trace_dump;
   tracer.id = "objects";
 
+  trace_stats_init(&stats, sizeof(struct memprof_objects_stats));
   trace_insert(&tracer);
 }
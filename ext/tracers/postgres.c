@@ -1,5 +1,6 @@
 #include <assert.h>
 #include <errno.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,25 +14,38 @@
 #include "tramp.h"
 #include "util.h"
 
+/* times are in ns, and printed as ms */
 struct memprof_postgres_stats {
-  size_t query_calls;
-  size_t query_calls_by_type[sql_UNKNOWN+1];
+  uint64_t query_calls;
+  uint64_t query_time;
+  struct trace_hist query_hist;
+
+  uint64_t query_calls_by_type[sql_UNKNOWN+1];
+  uint64_t query_time_by_type[sql_UNKNOWN+1];
 };
 
 static struct tracer tracer;
-static struct memprof_postgres_stats stats;
+static struct trace_stats stats;
 static void * (*orig_PQexec)(void *postgres, const char *stmt);
 
 static void *
 PQexec_tramp(void *postgres, const char *stmt) {
+  struct memprof_postgres_stats *s = trace_stats_get(&stats);
   enum memprof_sql_type type;
+  uint64_t ns = 0;
   void *ret;
 
+  ns = timeofday_ns();
   ret = orig_PQexec(postgres, stmt);
-  stats.query_calls++;
+  ns = timeofday_ns() - ns;
+
+  s->query_time += ns;
+  s->query_calls++;
+  trace_hist_record(&s->query_hist, ns);
 
   type = memprof_sql_query_type(stmt, strlen(stmt));
-  stats.query_calls_by_type[type]++;
+  s->query_time_by_type[type] += ns;
+  s->query_calls_by_type[type]++;
 
   return ret;
 }
@@ -40,32 +54,40 @@ static void
 postgres_trace_start() {
   static int inserted = 0;
 
-  if (!inserted)
+  if (!inserted) {
     inserted = 1;
-  else
-    return;
+    orig_PQexec = bin_find_symbol("PQexec", NULL, 1);
+  }
 
-  orig_PQexec = bin_find_symbol("PQexec", NULL, 1);
   if (orig_PQexec)
     insert_tramp("PQexec", PQexec_tramp);
 }
 
 static void
 postgres_trace_stop() {
+  if (orig_PQexec)
+    remove_tramp("PQexec", PQexec_tramp);
 }
 
 static void
 postgres_trace_reset() {
-  memset(&stats, 0, sizeof(stats));
+  trace_stats_reset(&stats);
 }
 
 static void
 postgres_trace_dump(json_gen gen) {
   enum memprof_sql_type i;
+  struct memprof_postgres_stats totals;
+
+  trace_stats_merge(&stats, &totals);
 
-  if (stats.query_calls > 0) {
+  if (totals.query_calls > 0) {
     json_gen_cstr(gen, "queries");
-    json_gen_integer(gen, stats.query_calls);
+    json_gen_integer(gen, totals.query_calls);
+
+    json_gen_cstr(gen, "time");
+    json_gen_ms(gen, totals.query_time);
+    trace_hist_dump(gen, &totals.query_hist);
 
     json_gen_cstr(gen, "types");
     json_gen_map_open(gen);
@@ -73,7 +95,9 @@ postgres_trace_dump(json_gen gen) {
       json_gen_cstr(gen, memprof_sql_type_str(i));
       json_gen_map_open(gen);
       json_gen_cstr(gen, "queries");
-      json_gen_integer(gen, stats.query_calls_by_type[i]);
+      json_gen_integer(gen, totals.query_calls_by_type[i]);
+      json_gen_cstr(gen, "time");
+      json_gen_ms(gen, totals.query_time_by_type[i]);
       json_gen_map_close(gen);
     }
     json_gen_map_close(gen);
@@ -88,5 +112,7 @@ void install_postgres_tracer()
   tracer.dump = postgres_trace_dump;
   tracer.id = "postgres";
 
+  trace_stats_init(&stats, sizeof(struct memprof_postgres_stats));
+  trace_stats_add_hist(&stats, offsetof(struct memprof_postgres_stats, query_hist));
   trace_insert(&tracer);
 }
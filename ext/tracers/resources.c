@@ -15,41 +15,48 @@ struct memprof_resources_stats {
   long inblock;
   long oublock;
 
+  /* in ns */
   int64_t utime;
   int64_t stime;
 };
 
 static struct tracer tracer;
-static struct memprof_resources_stats stats;
+/* usage as of when the trace was started or last reset */
+static struct memprof_resources_stats baseline;
 
 static void
-resources_trace_start() {
+resources_usage(struct memprof_resources_stats *res) {
   struct rusage usage;
   getrusage(RUSAGE_SELF, &usage);
 
-  stats.nsignals = -usage.ru_nsignals;
+  res->nsignals = usage.ru_nsignals;
+
+  res->inblock = usage.ru_inblock;
+  res->oublock = usage.ru_oublock;
 
-  stats.inblock = -usage.ru_inblock;
-  stats.oublock = -usage.ru_oublock;
+  res->stime = TVAL_TO_NS(usage.ru_stime);
+  res->utime = TVAL_TO_NS(usage.ru_utime);
+}
 
-  stats.stime = -TVAL_TO_INT64(usage.ru_stime);
-  stats.utime = -TVAL_TO_INT64(usage.ru_utime);
+static void
+resources_trace_start() {
+  resources_usage(&baseline);
 }
 
 static void
 resources_trace_dump(json_gen gen) {
-  { // calculate diff before dump, since stop is called after dump
-    struct rusage usage;
-    getrusage(RUSAGE_SELF, &usage);
+  struct memprof_resources_stats stats;
+
+  // calculate diff before dump, since stop is called after dump
+  resources_usage(&stats);
 
-    stats.nsignals += usage.ru_nsignals;
+  stats.nsignals -= baseline.nsignals;
 
-    stats.inblock += usage.ru_inblock;
-    stats.oublock += usage.ru_oublock;
+  stats.inblock -= baseline.inblock;
+  stats.oublock -= baseline.oublock;
 
-    stats.stime += TVAL_TO_INT64(usage.ru_stime);
-    stats.utime += TVAL_TO_INT64(usage.ru_utime);
-  }
+  stats.stime -= baseline.stime;
+  stats.utime -= baseline.utime;
 
   json_gen_cstr(gen, "signals");
   json_gen_integer(gen, stats.nsignals);
@@ -61,10 +68,10 @@ resources_trace_dump(json_gen gen) {
   json_gen_integer(gen, stats.oublock);
 
   json_gen_cstr(gen, "stime");
-  json_gen_integer(gen, stats.stime);
+  json_gen_ms(gen, stats.stime);
 
   json_gen_cstr(gen, "utime");
-  json_gen_integer(gen, stats.utime);
+  json_gen_ms(gen, stats.utime);
 }
 
 static void
@@ -73,6 +80,7 @@ resources_trace_stop() {
 
 static void
 resources_trace_reset() {
+  resources_usage(&baseline);
 }
 
 void install_resources_tracer()
@@ -11,59 +11,184 @@
 
 #include "arch.h"
 #include "bin_api.h"
+#include "slab.h"
+#include "tramp.h"
 #include "util.h"
 
 #define FREELIST_INLINES 3
 
+/* frame pointers further than this up the stack are assumed to be bogus */
+#define BACKTRACE_MAX_STACK (256 * 1024)
+
 /*
- * trampoline specific stuff
+ * Stage 2 trampolines live in pages mapped within reach of the Ruby code.
+ * Each table starts out with a single page and maps another one whenever it
+ * fills up. Pages are never unmapped, since code may still be running in
+ * them.
  */
-static struct tramp_st2_entry *tramp_table;
-static size_t tramp_size;
+#define TRAMP_TABLE_MAX_PAGES 64
+
+struct tramp_table {
+  const char *name;
+  const void *entry;
+  size_t entry_size;
+  size_t per_page;
+
+  void *pages[TRAMP_TABLE_MAX_PAGES];
+  size_t num_pages;
+  /* entries handed out from the newest page, and from all pages */
+  size_t used;
+  size_t in_use;
+};
+
+static struct tramp_table tramp_table;
+static struct tramp_table inline_tramp_table;
 
 /*
- * inline trampoline specific stuff
+ * Inserted trampolines, and every patch made to insert them.
+ *
+ * Each patch keeps the bytes it overwrote and the bytes it wrote, so it can
+ * be undone when the trampoline is removed, and redone when it is inserted
+ * again.
  */
-static size_t inline_tramp_size;
-static struct inline_tramp_st2_entry *inline_tramp_table;
+#define TRAMP_PATCH_MAX 16
+
+struct tramp_patch {
+  struct tramp_patch *next;
+  unsigned char *addr;
+  size_t len;
+
+  /* set once the library addr was in is unloaded; addr may be reused since */
+  int unloaded;
+  unsigned char orig[TRAMP_PATCH_MAX];
+  unsigned char patched[TRAMP_PATCH_MAX];
+};
+
+struct tramp_hook {
+  struct tramp_hook *next;
+  const char *trampee;
+  void *tramp;
+  int installed;
+  struct tramp_patch *patches;
+
+  /* the tracer (or NULL) that inserted this, for tramp_set_enabled */
+  const char *owner;
+  int enabled;
+
+  /* the stage 2 entry patched call sites go through, and where it goes when disabled */
+  struct tramp_st2_entry *entry;
+  void *orig;
+};
+
+static struct tramp_hook *hooks;
+static struct slab_allocator hook_slab;
+static struct slab_allocator patch_slab;
+
+/* the hook being inserted, which copy_instructions journals patches for */
+static struct tramp_hook *journal;
+
+/* who is inserting trampolines right now */
+static const char *owner;
 
 extern struct memprof_config memprof_config;
 
+static int
+tramp_table_grow(struct tramp_table *table)
+{
+  void *page = NULL;
+  size_t i;
+
+  if (table->num_pages == TRAMP_TABLE_MAX_PAGES)
+    return -1;
+
+  page = bin_allocate_page();
+  if (page == NULL || page == MAP_FAILED)
+    return -1;
+
+  for (i = 0; i < table->per_page; i++)
+    memcpy((char *)page + i * table->entry_size, table->entry, table->entry_size);
+
+  /* in_tramp_table may be looking at the pages from another thread */
+  table->pages[table->num_pages] = page;
+  __sync_synchronize();
+  table->num_pages++;
+  table->used = 0;
+
+  dbg_printf("mapped page %zd of the %s table at %p\n", table->num_pages, table->name, page);
+  return 0;
+}
+
+static void
+tramp_table_init(struct tramp_table *table, const char *name, const void *entry, size_t entry_size)
+{
+  memset(table, 0, sizeof(*table));
+  table->name = name;
+  table->entry = entry;
+  table->entry_size = entry_size;
+  table->per_page = memprof_config.pagesize / entry_size;
+
+  if (tramp_table_grow(table) != 0)
+    errx(EX_SOFTWARE, "Failed to allocate memory for %s trampolines.", name);
+}
+
+/*
+ * tramp_table_next - the next free entry, mapping another page if needed.
+ *
+ * The entry stays free until tramp_table_commit is called, so it can be
+ * handed out again if inserting the trampoline fails.
+ */
+static void *
+tramp_table_next(struct tramp_table *table)
+{
+  if (table->used == table->per_page && tramp_table_grow(table) != 0)
+    errx(EX_SOFTWARE, "Failed to allocate memory for %s trampolines, %zd are in use.",
+         table->name, table->in_use);
+
+  return (char *)table->pages[table->num_pages - 1] + table->used * table->entry_size;
+}
+
+static void
+tramp_table_commit(struct tramp_table *table)
+{
+  assert(table->used < table->per_page);
+  table->used++;
+  table->in_use++;
+}
+
 void
 create_tramp_table()
 {
-  size_t i;
-  void *region, *ent, *inline_ent;
+  void *ent, *inline_ent;
   size_t tramp_sz = 0, inline_tramp_sz = 0;
 
   ent = arch_get_st2_tramp(&tramp_sz);
   inline_ent = arch_get_inline_st2_tramp(&inline_tramp_sz);
   assert(ent && inline_ent);
 
-  region = bin_allocate_page();
-  if (region == MAP_FAILED)
-    errx(EX_SOFTWARE, "Failed to allocate memory for stage 1 trampolines.");
-
-  tramp_table = region;
-  inline_tramp_table = region + memprof_config.pagesize / 2;
+  slab_init(&hook_slab, sizeof(struct tramp_hook));
+  slab_init(&patch_slab, sizeof(struct tramp_patch));
 
-  for (i = 0; i < (memprof_config.pagesize / 2) / tramp_sz; i++) {
-    memcpy(tramp_table + i, ent, tramp_sz);
-  }
+  tramp_table_init(&tramp_table, "stage 2", ent, tramp_sz);
+  tramp_table_init(&inline_tramp_table, "inline stage 2", inline_ent, inline_tramp_sz);
+}
 
-  for (i = 0; i < (memprof_config.pagesize / 2) / inline_tramp_sz; i++) {
-    memcpy(inline_tramp_table + i, inline_ent, inline_tramp_sz);
-  }
+void
+tramp_usage(size_t *entries, size_t *pages, size_t *bytes)
+{
+  *entries = tramp_table.in_use + inline_tramp_table.in_use;
+  *pages = tramp_table.num_pages + inline_tramp_table.num_pages;
+  *bytes = *pages * memprof_config.pagesize;
 }
 
 static void
-hook_freelist(int entry, void *tramp)
+hook_freelist(void *tramp)
 {
-  size_t sizes[FREELIST_INLINES];
+  size_t sizes[FREELIST_INLINES], len = 0;
   void *freelist_inliners[FREELIST_INLINES];
+  const char *names[FREELIST_INLINES] = { "gc_sweep", "finalize_list", "rb_gc_force_recycle" };
   void *freelist = NULL;
-  unsigned char *byte = NULL;
-  int i = 0, tramps_completed = 0;
+  unsigned char *byte = NULL, *end = NULL;
+  int i = 0, found = 0, tramps_completed = 0, walked = 0;
 
   assert(memprof_config.gc_sweep != NULL);
   assert(memprof_config.finalize_list != NULL);
@@ -82,62 +207,349 @@ hook_freelist(int entry, void *tramp)
 
   freelist = memprof_config.freelist;
 
-  /* start the search for places to insert the inline tramp */
-  byte = freelist_inliners[i];
-
-  while (i < FREELIST_INLINES) {
-    if (arch_insert_inline_st2_tramp(byte, freelist, tramp,
-        &inline_tramp_table[entry]) == 0) {
-      /* insert occurred, so increment internal counters for the tramp table */
-      entry++;
-      inline_tramp_size++;
-
-      /*
-       * add_freelist() only gets inlined *ONCE* into any of the 3 functions
-       * that we're scanning, so move on to the next 'inliner' after we
-       * tramp the first instruction we find.  REE's gc_sweep has 2 calls,
-       * but this gets optimized into a single inlining and a jmp to it.
-       * older patchlevels of 1.8.7 don't have an add_freelist(), but the
-       * instruction should be the same.
-       */
-      tramps_completed++;
-      i++;
-      byte = freelist_inliners[i];
-      continue;
+  /*
+   * Walk each function an instruction at a time, so only whole instructions
+   * are considered, and tramp every one of them that updates freelist.
+   * add_freelist() usually gets inlined once into each of these, but
+   * optimized builds can inline (or unroll) it more than once, and older
+   * patchlevels of 1.8.7 don't have an add_freelist() at all, but the
+   * instruction should be the same.
+   */
+  for (i = 0; i < FREELIST_INLINES; i++) {
+    byte = freelist_inliners[i];
+    end = byte + sizes[i];
+    found = 0;
+
+    for (; byte < end; byte += len) {
+      if ((len = arch_insn_length(byte, end - byte)) == 0)
+        break;
+
+      if (arch_insert_inline_st2_tramp(byte, freelist, tramp,
+          tramp_table_next(&inline_tramp_table)) == 0) {
+        /* insert occurred, so the entry is now taken */
+        tramp_table_commit(&inline_tramp_table);
+        found++;
+      }
     }
 
-    /* if we've looked at all the bytes in this function... */
-    if ((size_t)((void *)byte - freelist_inliners[i]) >= sizes[i]) {
-      /* move on to the next function */
-      i++;
-      byte = freelist_inliners[i];
+    dbg_printf("inserted %d add_freelist tramps into %s\n", found, names[i]);
+
+    /* past an instruction we can't decode, we can't tell where the next one starts */
+    if (byte < end) {
+      fprintf(stderr, "memprof: couldn't decode %s past offset %zd (of %zd), "
+                      "objects freed after that point in it won't be tracked\n",
+                      names[i], (size_t)(byte - (unsigned char *)freelist_inliners[i]), sizes[i]);
+    } else {
+      walked++;
+      if (found == 0)
+        fprintf(stderr, "memprof: couldn't find where %s adds to the freelist, "
+                        "objects freed there won't be tracked\n", names[i]);
     }
-    byte++;
+
+    tramps_completed += found;
   }
 
-  if (tramps_completed != 3)
+  dbg_printf("walked %d of %d freelist functions all the way through\n", walked, FREELIST_INLINES);
+
+  if (tramps_completed == 0)
     errx(EX_SOFTWARE, "Inline add_freelist tramp insertion failed! "
-         "Only inserted %d tramps.", tramps_completed);
+         "No freelist updates found.");
+}
+
+void
+tramp_journal_patch(void *dest, const void *src, size_t count)
+{
+  struct tramp_patch *patch = NULL;
+
+  if (!journal)
+    return;
+
+  if (count > TRAMP_PATCH_MAX)
+    errx(EX_SOFTWARE, "Patch of %zd bytes is too big to journal.", count);
+
+  patch = slab_alloc(&patch_slab);
+  if (!patch)
+    errx(EX_SOFTWARE, "Failed to allocate memory for the patch journal.");
+
+  patch->addr = dest;
+  patch->len = count;
+  patch->unloaded = 0;
+  memcpy(patch->orig, dest, count);
+  memcpy(patch->patched, src, count);
+
+  patch->next = journal->patches;
+  journal->patches = patch;
+}
+
+static struct tramp_hook *
+find_hook(const char *trampee, void *tramp)
+{
+  struct tramp_hook *hook = hooks;
+
+  for (; hook; hook = hook->next)
+    if (hook->tramp == tramp && strcmp(hook->trampee, trampee) == 0)
+      return hook;
+
+  return NULL;
+}
+
+/*
+ * If another trampoline was inserted over one of ours, find the patch it
+ * made on top of ours (the one which found our bytes there).
+ */
+static struct tramp_patch *
+find_patch_over(struct tramp_patch *under)
+{
+  struct tramp_hook *hook = hooks;
+  struct tramp_patch *patch = NULL;
+
+  for (; hook; hook = hook->next) {
+    if (!hook->installed)
+      continue;
+
+    for (patch = hook->patches; patch; patch = patch->next)
+      if (patch != under && !patch->unloaded &&
+          patch->addr == under->addr && patch->len == under->len &&
+          memcmp(patch->orig, under->patched, under->len) == 0)
+        return patch;
+  }
+
+  return NULL;
+}
+
+/*
+ * hook_switch - point a hook at its handler, or straight at the original
+ * function.
+ *
+ * Patched call sites all go through the hook's stage 2 entry, so only its
+ * (aligned) address field needs to change. Patched GOT entries call the
+ * handler directly, so each of those is switched too. Both are single
+ * pointer stores, so threads calling through them see either target.
+ */
+static void
+hook_switch(struct tramp_hook *hook, int enabled)
+{
+  struct tramp_patch *patch = hook->patches;
+  void **slot = NULL, *from = NULL, *to = NULL;
+
+  if (hook->entry) {
+    slot = (void **)((char *)hook->entry + offsetof(struct tramp_st2_entry, addr));
+    assert(((uintptr_t)slot & (sizeof(void *) - 1)) == 0);
+    __sync_lock_test_and_set(slot, enabled ? hook->tramp : hook->orig);
+  }
+
+  for (; hook->installed && patch; patch = patch->next) {
+    if (patch->unloaded || patch->len != sizeof(void *) ||
+        memcmp(patch->patched, &hook->tramp, sizeof(void *)) != 0)
+      continue;
+
+    slot = (void **)patch->addr;
+    memcpy(&from, enabled ? patch->orig : patch->patched, sizeof(void *));
+    memcpy(&to, enabled ? patch->patched : patch->orig, sizeof(void *));
+
+    /* leave it alone if another trampoline has been inserted over it */
+    __sync_bool_compare_and_swap(slot, from, to);
+  }
+}
+
+static void
+hook_redo(struct tramp_hook *hook)
+{
+  struct tramp_patch *patch = hook->patches;
+
+  /* whatever is there now (maybe another trampoline) is what we restore later */
+  for (; patch; patch = patch->next) {
+    if (patch->unloaded)
+      continue;
+    memcpy(patch->orig, patch->addr, patch->len);
+    copy_instructions(patch->addr, patch->patched, patch->len);
+  }
+
+  hook->installed = 1;
+
+  if (!hook->enabled)
+    hook_switch(hook, 0);
+}
+
+static void
+hook_undo(struct tramp_hook *hook)
+{
+  struct tramp_patch *patch = hook->patches, *over = NULL;
+
+  for (; patch; patch = patch->next) {
+    if (patch->unloaded)
+      continue;
+
+    if (memcmp(patch->addr, patch->patched, patch->len) == 0) {
+      copy_instructions(patch->addr, patch->orig, patch->len);
+    } else if ((over = find_patch_over(patch)) != NULL) {
+      /* leave the newer trampoline in place, but bypass ours once it goes */
+      memcpy(over->orig, patch->orig, patch->len);
+    }
+  }
+
+  hook->installed = 0;
 }
 
 void
 insert_tramp(const char *trampee, void *tramp)
 {
-  void *trampee_addr = bin_find_symbol(trampee, NULL, 1);
-  int inline_ent = inline_tramp_size;
+  struct tramp_hook *hook = find_hook(trampee, tramp);
+  void *trampee_addr = NULL;
+  struct tramp_st2_entry *entry = NULL;
+
+  if (hook) {
+    if (!hook->installed) {
+      bin_check_unloaded();
+      hook_redo(hook);
+    }
+    return;
+  }
+
+  hook = slab_alloc(&hook_slab);
+  if (!hook)
+    errx(EX_SOFTWARE, "Failed to allocate memory for tramp %s", trampee);
+
+  hook->trampee = trampee;
+  hook->tramp = tramp;
+  hook->patches = NULL;
+  hook->owner = owner;
+  hook->enabled = 1;
+  hook->entry = NULL;
+  hook->orig = NULL;
+  journal = hook;
+
+  trampee_addr = bin_find_symbol(trampee, NULL, 1);
 
   if (trampee_addr == NULL) {
     if (strcmp("add_freelist", trampee) == 0) {
       /* XXX super hack */
-      inline_tramp_size++;
-      hook_freelist(inline_ent, tramp /* freelist_tramp() */);
+      hook_freelist(tramp /* freelist_tramp() */);
     } else {
       errx(EX_SOFTWARE, "Failed to locate required symbol %s", trampee);
     }
   } else {
-    tramp_table[tramp_size].addr = tramp;
-    if (bin_update_image(trampee, &tramp_table[tramp_size], NULL) != 0)
+    entry = tramp_table_next(&tramp_table);
+    entry->addr = tramp;
+    if (bin_update_image(trampee, entry, NULL) != 0)
       errx(EX_SOFTWARE, "Failed to insert tramp for %s", trampee);
-    tramp_size++;
+    tramp_table_commit(&tramp_table);
+    hook->entry = entry;
+    hook->orig = trampee_addr;
   }
+
+  journal = NULL;
+  hook->installed = 1;
+  hook->next = hooks;
+  hooks = hook;
+}
+
+int
+remove_tramp(const char *trampee, void *tramp)
+{
+  struct tramp_hook *hook = find_hook(trampee, tramp);
+
+  if (!hook || !hook->installed)
+    return -1;
+
+  bin_check_unloaded();
+  hook_undo(hook);
+  return 0;
+}
+
+void
+tramp_forget_range(void *start, void *end)
+{
+  struct tramp_hook *hook = hooks;
+  struct tramp_patch *patch = NULL;
+
+  for (; hook; hook = hook->next) {
+    for (patch = hook->patches; patch; patch = patch->next) {
+      if ((void *)patch->addr >= start && (void *)patch->addr < end) {
+        dbg_printf("forgetting patch at %p in an unloaded library\n", patch->addr);
+        patch->unloaded = 1;
+      }
+    }
+  }
+}
+
+void
+tramp_set_owner(const char *name)
+{
+  owner = name;
+}
+
+int
+tramp_set_enabled(const char *name, int enabled)
+{
+  struct tramp_hook *hook = hooks;
+  int found = 0;
+
+  bin_check_unloaded();
+
+  for (; hook; hook = hook->next) {
+    if (!hook->owner || strcmp(hook->owner, name) != 0)
+      continue;
+
+    found = 1;
+    if (!hook->entry || hook->enabled == !!enabled)
+      continue;
+
+    hook->enabled = !!enabled;
+    hook_switch(hook, hook->enabled);
+  }
+
+  return found ? 0 : -1;
+}
+
+static int
+in_tramp_table(void *addr)
+{
+  size_t i, num_pages = tramp_table.num_pages;
+
+  for (i = 0; i < num_pages; i++) {
+    if ((char *)addr >= (char *)tramp_table.pages[i] &&
+        (char *)addr < (char *)tramp_table.pages[i] + memprof_config.pagesize)
+      return 1;
+  }
+
+  return 0;
+}
+
+int
+tramp_backtrace(void *frame, void **pcs, int max)
+{
+  void **fp = NULL, **next = NULL;
+  int num = 0;
+
+  if (max < 1)
+    return 0;
+
+  /* the handler's frame is its caller's frame pointer and its return address */
+  if (in_tramp_table(((void **)frame)[1])) {
+    pcs[num++] = arch_tramp_caller(frame);
+    fp = arch_tramp_caller_frame(frame);
+  } else {
+    pcs[num++] = ((void **)frame)[1];
+    fp = ((void **)frame)[0];
+  }
+
+  while (num < max) {
+    if ((void *)fp <= frame ||
+        (char *)fp - (char *)frame > BACKTRACE_MAX_STACK ||
+        ((uintptr_t)fp & (sizeof(void *) - 1)))
+      break;
+
+    /* a frame is the caller's frame pointer followed by our return address */
+    if (!fp[1])
+      break;
+    pcs[num++] = fp[1];
+
+    next = fp[0];
+    if (next <= fp)
+      break;
+    fp = next;
+  }
+
+  return num;
 }
@@ -1,12 +1,24 @@
 #if !defined(TRAMP__)
 #define TRAMP__
 
+#include <stddef.h>
+
 /*
  * create_tramp_table - create the trampoline tables.
+ *
+ * Each table starts out with a single page, and grows a page at a time as
+ * trampolines are inserted.
  */
 void
 create_tramp_table();
 
+/*
+ * tramp_usage - trampoline table entries in use, and the pages (and bytes)
+ * mapped to hold them.
+ */
+void
+tramp_usage(size_t *entries, size_t *pages, size_t *bytes);
+
 /*
  * insert_tramp - insert a trampoline.
  *
@@ -20,4 +32,85 @@ create_tramp_table();
  */
 void
 insert_tramp(const char *trampee, void *tramp);
+
+/*
+ * remove_tramp - remove a trampoline inserted with insert_tramp.
+ *
+ * Given:
+ *  - trampee: function the trampoline was inserted in.
+ *  - tramp:   the handler it was inserted with.
+ *
+ * Every GOT entry and call site that insert_tramp patched is put back the
+ * way it was, so calls go straight to trampee again. Calls already inside
+ * tramp are unaffected and return normally.
+ *
+ * Inserting the same trampoline again afterwards just replays the patches
+ * made the first time, without searching the binary and libraries again.
+ *
+ * Returns 0 on success, or -1 if the trampoline was not inserted.
+ */
+int
+remove_tramp(const char *trampee, void *tramp);
+
+/*
+ * tramp_set_owner - name whoever calls insert_tramp from now on (NULL for
+ * nobody), so their trampolines can be switched on and off together.
+ */
+void
+tramp_set_owner(const char *name);
+
+/*
+ * tramp_set_enabled - switch all of name's trampolines on or off.
+ *
+ * A trampoline which is switched off stays inserted, but calls go straight
+ * to the original function: patched GOT entries point back at it, and the
+ * stage 2 trampoline patched call sites go through jumps to it instead of
+ * to the handler. Switching is atomic, and cheap enough to do at any time.
+ *
+ * The add_freelist trampoline can't be switched off.
+ *
+ * Returns 0 on success, or -1 if name never inserted any trampolines.
+ */
+int
+tramp_set_enabled(const char *name, int enabled);
+
+/*
+ * tramp_journal_patch - record count bytes at dest, which are about to be
+ * overwritten with src, against the trampoline currently being inserted.
+ *
+ * Called by copy_instructions; does nothing outside of insert_tramp.
+ */
+void
+tramp_journal_patch(void *dest, const void *src, size_t count);
+
+/*
+ * tramp_forget_range - stop undoing, redoing or switching patches made
+ * between start and end, because the library mapped there has been unloaded.
+ *
+ * Called by bin_check_unloaded.
+ */
+void
+tramp_forget_range(void *start, void *end);
+
+/*
+ * tramp_backtrace - return addresses of the trampolined function's caller,
+ * its caller, and so on.
+ *
+ * Given:
+ *  - frame: the handler's frame address (__builtin_frame_address(0)).
+ *  - pcs:   where to store the return addresses.
+ *  - max:   the most return addresses to store.
+ *
+ * Handlers are reached either straight from a patched GOT entry, or
+ * through a stage 2 trampoline from a patched call site; in the latter case
+ * the trampoline's own frame is skipped.
+ *
+ * Everything past the first caller is found by following frame pointers,
+ * so the walk stops early at the first frame that was built without them
+ * (or that doesn't look like it is further up the same stack).
+ *
+ * Returns the number of return addresses stored.
+ */
+int
+tramp_backtrace(void *frame, void **pcs, int max);
 #endif
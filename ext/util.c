@@ -1,3 +1,4 @@
+#include <cpuid.h>
 #include <stdlib.h>
 #include <time.h>
 #include <util.h>
@@ -97,3 +98,116 @@ timeofday_ms()
   gettimeofday(&tv, NULL);
   return (uint64_t)tv.tv_sec*1e3 + (uint64_t)tv.tv_usec*1e-3;
 }
+
+uint64_t
+timeofday_ns()
+{
+  struct timeval tv;
+#ifdef CLOCK_MONOTONIC
+  struct timespec tp;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &tp) == 0)
+    return (uint64_t)tp.tv_sec * 1000000000 + tp.tv_nsec;
+#endif
+  gettimeofday(&tv, NULL);
+  return (uint64_t)tv.tv_sec * 1000000000 + (uint64_t)tv.tv_usec * 1000;
+}
+
+static clock_source_t clock_source = CLOCK_SOURCE_OFF;
+static double tsc_ticks_per_us = 0;
+
+static inline uint64_t
+rdtsc()
+{
+  uint32_t lo, hi;
+  __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+  return ((uint64_t)hi << 32) | lo;
+}
+
+static int
+tsc_is_invariant()
+{
+  unsigned int eax, ebx, ecx, edx;
+
+  if (!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) || eax < 0x80000007)
+    return 0;
+
+  __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+  return (edx & (1 << 8)) != 0;
+}
+
+static int
+tsc_calibrate()
+{
+  struct timespec pause = { 0, 10 * 1000 * 1000 };
+  uint64_t ns_start, ns_end, tsc_start, tsc_end;
+
+  if (!tsc_is_invariant()) {
+    dbg_printf("TSC is not invariant, not using it as a clock source\n");
+    return -1;
+  }
+
+  ns_start = timeofday_ns();
+  tsc_start = rdtsc();
+  nanosleep(&pause, NULL);
+  ns_end = timeofday_ns();
+  tsc_end = rdtsc();
+
+  if (ns_end <= ns_start || tsc_end <= tsc_start)
+    return -1;
+
+  tsc_ticks_per_us = (double)(tsc_end - tsc_start) * 1000 / (ns_end - ns_start);
+  dbg_printf("calibrated TSC at %f ticks/us\n", tsc_ticks_per_us);
+  return 0;
+}
+
+int
+clock_source_set(clock_source_t source)
+{
+  if (source == CLOCK_SOURCE_TSC && tsc_ticks_per_us == 0 && tsc_calibrate() != 0)
+    return -1;
+
+  clock_source = source;
+  return 0;
+}
+
+clock_source_t
+clock_source_get()
+{
+  return clock_source;
+}
+
+uint64_t
+clock_ticks()
+{
+  switch (clock_source) {
+    case CLOCK_SOURCE_TSC:
+      return rdtsc();
+
+    case CLOCK_SOURCE_COARSE:
+#ifdef CLOCK_MONOTONIC_COARSE
+    {
+      struct timespec tp;
+      if (clock_gettime(CLOCK_MONOTONIC_COARSE, &tp) == 0)
+        return (uint64_t)tp.tv_sec * 1000000000 + tp.tv_nsec;
+    }
+#endif
+      return timeofday_ns();
+
+    default:
+      return 0;
+  }
+}
+
+uint64_t
+clock_ticks_to_us(uint64_t ticks)
+{
+  switch (clock_source) {
+    case CLOCK_SOURCE_TSC:
+      return (uint64_t)(ticks / tsc_ticks_per_us);
+    case CLOCK_SOURCE_COARSE:
+      return ticks / 1000;
+    default:
+      return 0;
+  }
+}
@@ -40,6 +40,7 @@ struct memprof_config {
   void *heaps_used;
   void *finalizer_table;
 
+  /* everything from here up to pagesize is saved in the config cache */
   size_t sizeof_RVALUE;
   size_t sizeof_heaps_slot;
 
@@ -79,11 +80,56 @@ gnu_debuglink_crc32 (unsigned long crc, unsigned char *buf, size_t len);
 double
 timeofday();
 
-/* Use this function for time tracking. It will (interally) try to use an
- * appropriately granual timing function.
- */
+/* Wall clock time in milliseconds, for timestamps. */
 uint64_t
 timeofday_ms();
 
-#define TVAL_TO_INT64(tv) ((int64_t)tv.tv_sec*1e3 + (int64_t)tv.tv_usec*1e-3)
+/* Use this function for time tracking. It reads the monotonic clock (where
+ * available) and returns nanoseconds, so even very short calls can be
+ * measured.
+ */
+uint64_t
+timeofday_ns();
+
+/* Clock sources used to timestamp object allocations. */
+typedef enum {
+  CLOCK_SOURCE_OFF,
+  CLOCK_SOURCE_TSC,
+  CLOCK_SOURCE_COARSE,
+} clock_source_t;
+
+/*
+ * clock_source_set - select the clock used by clock_ticks().
+ *
+ * CLOCK_SOURCE_TSC reads the cpu's timestamp counter, and is calibrated
+ * against the monotonic clock the first time it is selected. It is only
+ * available on cpus with an invariant TSC.
+ *
+ * CLOCK_SOURCE_COARSE uses CLOCK_MONOTONIC_COARSE where available, which is
+ * served from the vDSO without reading any hardware counter.
+ *
+ * Returns 0 on success, or -1 if the requested source is not available.
+ */
+int
+clock_source_set(clock_source_t source);
+
+clock_source_t
+clock_source_get();
+
+/*
+ * clock_ticks - read the current clock source.
+ *
+ * Ticks are only meaningful relative to each other, and only for the clock
+ * source they were read from. Always returns 0 if the clock is off.
+ */
+uint64_t
+clock_ticks();
+
+/*
+ * clock_ticks_to_us - convert a number of ticks to microseconds.
+ */
+uint64_t
+clock_ticks_to_us(uint64_t ticks);
+
+#define TVAL_TO_NS(tv) ((int64_t)(tv).tv_sec*1000000000 + (int64_t)(tv).tv_usec*1000)
 #endif
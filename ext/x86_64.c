@@ -86,7 +86,10 @@ arch_check_ins(struct inline_st1_base *base)
 
       /* maybe. read the REX byte to find out for sure */
       (base->rex == 0x48 ||
-       base->rex == 0x4c)) {
+       base->rex == 0x4c) &&
+
+      /* and it has to store to a %rip relative address, like freelist */
+      (base->src_reg & 0xc7) == 0x05) {
 
       /* success */
       return 1;
@@ -188,4 +191,22 @@ arch_insert_inline_st2_tramp(void *addr, void *marker, void *trampoline, void *t
 
   return 1;
 }
+/*
+ * The stage 2 trampoline pushes %rbx and %rbp and points %rbp at them before
+ * realigning the stack, so the handler's saved %rbp is the trampoline's frame
+ * and the caller's return address sits just above the two saved registers.
+ */
+void *
+arch_tramp_caller(void *frame)
+{
+  void **tramp_frame = *(void ***)frame;
+  return tramp_frame[2];
+}
+
+void *
+arch_tramp_caller_frame(void *frame)
+{
+  void **tramp_frame = *(void ***)frame;
+  return tramp_frame[0];
+}
 #endif
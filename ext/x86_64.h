@@ -21,34 +21,43 @@
  * push %rbp                      # save previous stack frame's %rbp
  * mov  %rsp, %rbp                # update %rbp to be current stack pointer
  * andl 0xFFFFFFFFFFFFFFF0, %rsp  # align stack pointer as per the ABI
+ * nopl 0x0(%rax,%rax,1)          # pad so ADDR below is 8 byte aligned
  * mov  ADDR, %rbx                # move address of handler into %rbx
  * callq *%rbx                    # call handler
  * pop %rbx                       # restore %rbx
  * leave                          # restore %rbp, move stack pointer back
  * ret                            # return
+ *
+ * Entries are 32 bytes and ADDR sits at offset 16, so it can be switched
+ * between the handler and the original function with a single atomic store
+ * while other threads may be running through the trampoline.
  */
 static struct tramp_st2_entry {
   unsigned char push_rbx;
   unsigned char push_rbp;
   unsigned char save_rsp[3];
   unsigned char align_rsp[4];
+  unsigned char pad[5];
   unsigned char mov[2];
   void *addr;
   unsigned char call[2];
   unsigned char leave;
   unsigned char rbx_restore;
   unsigned char ret;
+  unsigned char tail[3];
 } __attribute__((__packed__)) default_st2_tramp = {
   .push_rbx      = 0x53,
   .push_rbp      = 0x55,
   .save_rsp      = {0x48, 0x89, 0xe5},
   .align_rsp     = {0x48, 0x83, 0xe4, 0xf0},
+  .pad           = {0x0f, 0x1f, 0x44, 0x00, 0x00},
   .mov           = {0x48, 0xbb},
   .addr          = 0,
   .call          = {0xff, 0xd3},
   .rbx_restore   = 0x5b,
   .leave         = 0xc9,
   .ret           = 0xc3,
+  .tail          = {0xcc, 0xcc, 0xcc},
 };
 
 /*
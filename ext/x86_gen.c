@@ -1,7 +1,15 @@
 #include <assert.h>
 #include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "arch.h"
 #include "x86_gen.h"
+#include "util.h"
 
 /*
  * arch_insert_st1_tramp - architecture specific stage 1 trampoline insert
@@ -42,6 +50,408 @@ arch_insert_st1_tramp(void *start, void *trampee, void *tramp)
   return 1;
 }
 
+/*
+ * Every `call rel32` in a text segment, sorted by target.
+ *
+ * Finding the calls to a function used to mean looking at every byte of the
+ * text segment, once per function hooked. Instead, the segment is scanned
+ * once (16 bytes at a time with SSE2) for 0xe8 opcodes whose target lands
+ * inside the segment, and each hook looks its callers up from there.
+ *
+ * The scan can't tell a real call from an 0xe8 that happens to sit inside
+ * some other instruction, so callers can have each site decoded from the
+ * start of its function before it is patched. Sites are also checked again
+ * before they are patched: they stay in the index once patched, and simply
+ * fail that check for their old target.
+ */
+#define CALL_INDEX_MAX 8
+
+struct call_site {
+  void *target;
+  unsigned char *site;
+};
+
+struct call_index {
+  unsigned char *text;
+  size_t len;
+  struct call_site *sites;
+  size_t count;
+  size_t map_size;
+};
+
+static struct call_index call_indexes[CALL_INDEX_MAX];
+static size_t num_call_indexes;
+
+static inline size_t
+add_call_site(unsigned char *text, size_t len, size_t off, struct call_site *sites, size_t count)
+{
+  int32_t displacement;
+  unsigned char *target;
+
+  if (off + sizeof(struct st1_base) > len)
+    return count;
+
+  memcpy(&displacement, text + off + 1, sizeof(displacement));
+  target = text + off + sizeof(struct st1_base) + displacement;
+
+  if (target < text || target >= text + len)
+    return count;
+
+  if (sites) {
+    sites[count].target = target;
+    sites[count].site = text + off;
+  }
+  return count + 1;
+}
+
+/*
+ * scan_calls - find calls into the segment, counting them if sites is NULL.
+ */
+static size_t
+scan_calls(unsigned char *text, size_t len, struct call_site *sites)
+{
+  size_t off = 0, count = 0;
+
+#if defined(__SSE2__)
+  const __m128i call = _mm_set1_epi8((char)0xe8);
+  unsigned int mask;
+
+  for (; off + 16 <= len; off += 16) {
+    mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(text + off)), call));
+    while (mask) {
+      count = add_call_site(text, len, off + __builtin_ctz(mask), sites, count);
+      mask &= mask - 1;
+    }
+  }
+#endif
+
+  for (; off < len; off++) {
+    if (text[off] == 0xe8)
+      count = add_call_site(text, len, off, sites, count);
+  }
+
+  return count;
+}
+
+static int
+call_site_cmp(const void *a, const void *b)
+{
+  const struct call_site *sa = a, *sb = b;
+
+  if (sa->target != sb->target)
+    return sa->target < sb->target ? -1 : 1;
+  return sa->site < sb->site ? -1 : sa->site > sb->site;
+}
+
+static struct call_index *
+get_call_index(unsigned char *text, size_t len)
+{
+  struct call_index *index = NULL;
+  size_t i, count;
+
+  for (i = 0; i < num_call_indexes; i++) {
+    if (call_indexes[i].text == text && call_indexes[i].len == len)
+      return &call_indexes[i];
+  }
+
+  if (num_call_indexes == CALL_INDEX_MAX)
+    return NULL;
+
+  count = scan_calls(text, len, NULL);
+  index = &call_indexes[num_call_indexes];
+  index->map_size = (count ? count : 1) * sizeof(struct call_site);
+
+  /* mapped directly, so building the index never shows up in a malloc trace */
+  index->sites = mmap(NULL, index->map_size, PROT_READ|PROT_WRITE, MAP_ANON|MAP_PRIVATE, -1, 0);
+  if (index->sites == MAP_FAILED) {
+    dbg_printf("unable to map a call site index of %zd bytes\n", index->map_size);
+    return NULL;
+  }
+
+  index->text = text;
+  index->len = len;
+  index->count = scan_calls(text, len, index->sites);
+  assert(index->count == count);
+  qsort(index->sites, index->count, sizeof(struct call_site), call_site_cmp);
+
+  num_call_indexes++;
+  dbg_printf("indexed %zd call sites in %p-%p\n", index->count, text, text + len);
+  return index;
+}
+
+/*
+ * arch_insert_st1_tramps - redirect every call to trampee in a text segment.
+ *
+ * Returns the number of call sites patched.
+ */
+int
+arch_insert_st1_tramps(void *text, size_t len, void *trampee, void *tramp,
+                       int (*is_insn)(void *site))
+{
+  struct call_index *index = get_call_index(text, len);
+  size_t lo = 0, hi = 0, mid = 0;
+  unsigned char *byte = text;
+  int num = 0;
+
+  /* couldn't index it, so fall back to looking at every byte */
+  if (!index) {
+    for (; byte < (unsigned char *)text + len; byte++) {
+      if (byte[0] == 0xe8 && is_insn && !is_insn(byte))
+        continue;
+      if (arch_insert_st1_tramp(byte, trampee, tramp) == 0)
+        num++;
+    }
+    return num;
+  }
+
+  hi = index->count;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (index->sites[mid].target < trampee)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  for (; lo < index->count && index->sites[lo].target == trampee; lo++) {
+    if (is_insn && !is_insn(index->sites[lo].site)) {
+      dbg_printf("skipping %p, which is inside another instruction\n", index->sites[lo].site);
+      continue;
+    }
+    if (arch_insert_st1_tramp(index->sites[lo].site, trampee, tramp) == 0)
+      num++;
+  }
+
+  return num;
+}
+
+/*
+ * An x86 instruction length decoder.
+ *
+ * Patching code safely means knowing where instructions start: an 0xe8 or
+ * a mov to freelist can just as well be a few bytes in the middle of some
+ * other instruction. This decodes just enough of each instruction (prefixes,
+ * opcode, ModRM, SIB, displacement and immediate) to find its length. Each
+ * opcode's table entry says which of those it has.
+ *
+ * Anything unusual enough to be missing from the tables (VEX encoded AVX
+ * instructions, 16 bit addressing, 3DNow!, ...) makes the decoder give up.
+ */
+#define INSN_MODRM 0x01
+#define INSN_IMM8  0x02
+#define INSN_IMM16 0x04
+/* a 16 or 32 bit immediate, depending on the operand size */
+#define INSN_IMMZ  0x08
+/* mov reg, imm: like INSN_IMMZ, but 64 bits with REX.W */
+#define INSN_IMMV  0x10
+/* a memory offset the size of an address */
+#define INSN_MOFFS 0x20
+/* test has an immediate, the rest of the group doesn't */
+#define INSN_GRP3  0x40
+#define INSN_BAD   0x80
+
+#if defined(_ARCH_x86_64_)
+/* valid only outside of 64 bit mode */
+#define INSN_32(flags) INSN_BAD
+#else
+#define INSN_32(flags) (flags)
+#endif
+
+static const unsigned char insn_onebyte[256] = {
+  [0x00 ... 0x03] = INSN_MODRM, [0x04] = INSN_IMM8, [0x05] = INSN_IMMZ,
+  [0x06 ... 0x07] = INSN_32(0),
+  [0x08 ... 0x0b] = INSN_MODRM, [0x0c] = INSN_IMM8, [0x0d] = INSN_IMMZ,
+  [0x0e] = INSN_32(0),
+  [0x10 ... 0x13] = INSN_MODRM, [0x14] = INSN_IMM8, [0x15] = INSN_IMMZ,
+  [0x16 ... 0x17] = INSN_32(0),
+  [0x18 ... 0x1b] = INSN_MODRM, [0x1c] = INSN_IMM8, [0x1d] = INSN_IMMZ,
+  [0x1e ... 0x1f] = INSN_32(0),
+  [0x20 ... 0x23] = INSN_MODRM, [0x24] = INSN_IMM8, [0x25] = INSN_IMMZ,
+  [0x27] = INSN_32(0),
+  [0x28 ... 0x2b] = INSN_MODRM, [0x2c] = INSN_IMM8, [0x2d] = INSN_IMMZ,
+  [0x2f] = INSN_32(0),
+  [0x30 ... 0x33] = INSN_MODRM, [0x34] = INSN_IMM8, [0x35] = INSN_IMMZ,
+  [0x37] = INSN_32(0),
+  [0x38 ... 0x3b] = INSN_MODRM, [0x3c] = INSN_IMM8, [0x3d] = INSN_IMMZ,
+  [0x3f] = INSN_32(0),
+  [0x60 ... 0x61] = INSN_32(0), [0x62] = INSN_32(INSN_MODRM), [0x63] = INSN_MODRM,
+  [0x68] = INSN_IMMZ, [0x69] = INSN_MODRM|INSN_IMMZ,
+  [0x6a] = INSN_IMM8, [0x6b] = INSN_MODRM|INSN_IMM8,
+  [0x70 ... 0x7f] = INSN_IMM8,
+  [0x80] = INSN_MODRM|INSN_IMM8, [0x81] = INSN_MODRM|INSN_IMMZ,
+  [0x82] = INSN_32(INSN_MODRM|INSN_IMM8), [0x83] = INSN_MODRM|INSN_IMM8,
+  [0x84 ... 0x8f] = INSN_MODRM,
+  /* far calls and jumps take a 16 bit segment and an offset */
+  [0x9a] = INSN_32(INSN_IMM16|INSN_IMMZ),
+  [0xa0 ... 0xa3] = INSN_MOFFS,
+  [0xa8] = INSN_IMM8, [0xa9] = INSN_IMMZ,
+  [0xb0 ... 0xb7] = INSN_IMM8, [0xb8 ... 0xbf] = INSN_IMMV,
+  [0xc0 ... 0xc1] = INSN_MODRM|INSN_IMM8, [0xc2] = INSN_IMM16,
+  /* les and lds outside of 64 bit mode, VEX prefixes in it */
+  [0xc4 ... 0xc5] = INSN_32(INSN_MODRM),
+  [0xc6] = INSN_MODRM|INSN_IMM8, [0xc7] = INSN_MODRM|INSN_IMMZ,
+  [0xc8] = INSN_IMM16|INSN_IMM8, [0xca] = INSN_IMM16, [0xcd] = INSN_IMM8,
+  [0xce] = INSN_32(0),
+  [0xd0 ... 0xd3] = INSN_MODRM, [0xd4 ... 0xd5] = INSN_32(INSN_IMM8), [0xd6] = INSN_BAD,
+  [0xd8 ... 0xdf] = INSN_MODRM,
+  [0xe0 ... 0xe7] = INSN_IMM8, [0xe8 ... 0xe9] = INSN_IMMZ,
+  [0xea] = INSN_32(INSN_IMM16|INSN_IMMZ), [0xeb] = INSN_IMM8,
+  [0xf6 ... 0xf7] = INSN_MODRM|INSN_GRP3,
+  [0xfe ... 0xff] = INSN_MODRM,
+};
+
+static const unsigned char insn_twobyte[256] = {
+  [0x00 ... 0x03] = INSN_MODRM, [0x04] = INSN_BAD, [0x0a] = INSN_BAD,
+  [0x0c] = INSN_BAD, [0x0d] = INSN_MODRM, [0x0f] = INSN_BAD,
+  [0x10 ... 0x23] = INSN_MODRM, [0x24 ... 0x27] = INSN_BAD,
+  [0x28 ... 0x2f] = INSN_MODRM,
+  [0x36] = INSN_BAD, [0x39] = INSN_BAD, [0x3b ... 0x3f] = INSN_BAD,
+  [0x40 ... 0x6f] = INSN_MODRM, [0x70 ... 0x73] = INSN_MODRM|INSN_IMM8,
+  [0x74 ... 0x76] = INSN_MODRM, [0x78 ... 0x79] = INSN_MODRM,
+  [0x7a ... 0x7b] = INSN_BAD, [0x7c ... 0x7f] = INSN_MODRM,
+  [0x80 ... 0x8f] = INSN_IMMZ, [0x90 ... 0x9f] = INSN_MODRM,
+  [0xa3] = INSN_MODRM, [0xa4] = INSN_MODRM|INSN_IMM8, [0xa5] = INSN_MODRM,
+  [0xa6 ... 0xa7] = INSN_BAD,
+  [0xab] = INSN_MODRM, [0xac] = INSN_MODRM|INSN_IMM8, [0xad ... 0xb9] = INSN_MODRM,
+  [0xba] = INSN_MODRM|INSN_IMM8, [0xbb ... 0xc1] = INSN_MODRM,
+  [0xc2] = INSN_MODRM|INSN_IMM8, [0xc3] = INSN_MODRM,
+  [0xc4 ... 0xc6] = INSN_MODRM|INSN_IMM8, [0xc7] = INSN_MODRM,
+  [0xd0 ... 0xff] = INSN_MODRM,
+};
+
+/* make sure the next n bytes are still part of the instruction stream */
+#define INSN_NEED(n) do { \
+    if ((size_t)(byte - (const unsigned char *)ins) + (n) > max) \
+      return 0; \
+  } while (0)
+
+size_t
+arch_insn_length(const void *ins, size_t max)
+{
+  const unsigned char *byte = ins;
+  unsigned char opcode, flags, modrm, sib;
+  int opsize16 = 0, addrsize_alt = 0, rexw = 0, prefixes = 0;
+  size_t len = 0, imm = 0, disp = 0, zsize = 0;
+
+  assert(ins != NULL);
+
+  /* legacy prefixes, which can come in any order */
+  for (;; byte++, prefixes++) {
+    INSN_NEED(1);
+    if (prefixes > 14)
+      return 0;
+
+    if (*byte == 0x66)
+      opsize16 = 1;
+    else if (*byte == 0x67)
+      addrsize_alt = 1;
+    else if (*byte != 0xf0 && *byte != 0xf2 && *byte != 0xf3 &&
+             *byte != 0x2e && *byte != 0x36 && *byte != 0x3e &&
+             *byte != 0x26 && *byte != 0x64 && *byte != 0x65)
+      break;
+  }
+
+#if defined(_ARCH_x86_64_)
+  /* a REX prefix has to come right before the opcode */
+  if ((*byte & 0xf0) == 0x40) {
+    rexw = *byte & 0x08;
+    byte++;
+    INSN_NEED(1);
+  }
+#else
+  /* 16 bit addressing has a different ModRM layout, which isn't worth decoding */
+  if (addrsize_alt)
+    return 0;
+#endif
+
+  opcode = *byte++;
+  if (opcode == 0x0f) {
+    INSN_NEED(1);
+    opcode = *byte++;
+    if (opcode == 0x38 || opcode == 0x3a) {
+      INSN_NEED(1);
+      byte++;
+      flags = (opcode == 0x38) ? INSN_MODRM : INSN_MODRM|INSN_IMM8;
+    } else {
+      flags = insn_twobyte[opcode];
+    }
+    /* the group 3 flag only applies to the one byte opcodes */
+    opcode = 0;
+  } else {
+    flags = insn_onebyte[opcode];
+  }
+
+  if (flags & INSN_BAD)
+    return 0;
+
+  zsize = opsize16 ? 2 : 4;
+
+  if (flags & INSN_MODRM) {
+    INSN_NEED(1);
+    modrm = *byte++;
+
+    if ((flags & INSN_GRP3) && ((modrm >> 3) & 7) < 2)
+      imm += (opcode == 0xf6) ? 1 : zsize;
+
+    switch (modrm >> 6) {
+      case 0:
+        if ((modrm & 7) == 5)
+          disp = 4;
+        break;
+      case 1:
+        disp = 1;
+        break;
+      case 2:
+        disp = 4;
+        break;
+    }
+
+    if ((modrm >> 6) != 3 && (modrm & 7) == 4) {
+      INSN_NEED(1);
+      sib = *byte++;
+      if ((modrm >> 6) == 0 && (sib & 7) == 5)
+        disp = 4;
+    }
+  }
+
+  if (flags & INSN_IMM8)
+    imm += 1;
+  if (flags & INSN_IMM16)
+    imm += 2;
+  if (flags & INSN_IMMZ)
+    imm += zsize;
+  if (flags & INSN_IMMV)
+    imm += rexw ? 8 : zsize;
+  if (flags & INSN_MOFFS) {
+#if defined(_ARCH_x86_64_)
+    imm += addrsize_alt ? 4 : 8;
+#else
+    imm += 4;
+#endif
+  }
+
+  len = (byte - (const unsigned char *)ins) + disp + imm;
+  if (len > 15 || len > max)
+    return 0;
+
+  return len;
+}
+
+int
+arch_insn_boundary(const void *start, size_t len, const void *addr)
+{
+  const unsigned char *byte = start, *end = (const unsigned char *)start + len;
+  size_t n;
+
+  while (byte < (const unsigned char *)addr) {
+    if ((n = arch_insn_length(byte, end - byte)) == 0)
+      return -1;
+    byte += n;
+  }
+
+  return byte == addr;
+}
+
 /*
  * arch_get_st2_tramp - architecture specific stage 2 tramp accessor. This
  * function returns a pointer to the default stage 2 trampoline setting size
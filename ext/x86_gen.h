@@ -7,6 +7,7 @@
 #include <string.h>
 #include <sys/mman.h>
 #include "arch.h"
+#include "tramp.h"
 
 /*
  * st1_base - stage 1 base instruction sequence
@@ -40,6 +41,9 @@ page_align(void *addr)
 /*
  * copy_instructions - copy count bytes from src to dest, taking care to use
  * mprotect to mark the section read/write.
+ *
+ * The bytes being overwritten are journaled, so the trampoline being
+ * inserted can be removed again.
  */
 static void
 copy_instructions(void *dest, void *src, size_t count)
@@ -54,6 +58,7 @@ copy_instructions(void *dest, void *src, size_t count)
    */
 
   mprotect(aligned_addr, (dest - aligned_addr) + count, PROT_READ|PROT_WRITE|PROT_EXEC);
+  tramp_journal_patch(dest, src, count);
   memcpy(dest, src, count);
 
   /*
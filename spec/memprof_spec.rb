@@ -5,6 +5,7 @@ require 'bacon'
 Bacon.summary_on_exit
 
 require 'tempfile'
+require 'rbconfig'
 
 describe Memprof do
   @tempfile = Tempfile.new('memprof_spec')
@@ -21,6 +22,13 @@ describe Memprof do
     Memprof.stop
   end
 
+  should 'hook the freelist without tripping over an instruction' do
+    ruby = File.join(RbConfig::CONFIG['bindir'], RbConfig::CONFIG['ruby_install_name'])
+    output = `#{ruby} -e 'require "#{File.dirname(__FILE__)}/../ext/memprof"; Memprof.start; Memprof.stop' 2>&1`
+    $?.should.be.success
+    output.should.not =~ /memprof: couldn't/
+  end
+
   should 'print stats to a file' do
     Memprof.start
     "abc"
@@ -48,6 +56,50 @@ describe Memprof do
     filedata.strip.should.be.empty
   end
 
+  def alloc_string
+    "abc"
+  end
+
+  should 'group stats by backtrace' do
+    Memprof.start(:frames => 2)
+    alloc_string
+    Memprof.stats(filename)
+
+    filedata.strip.should == "1 #{__FILE__}:#{__LINE__-8}:String <- #{__FILE__}:#{__LINE__-3}"
+  end
+
+  should 'return per-site counters' do
+    Memprof.start
+    3.times{ "abc" }
+    counters = Memprof.site_counters["#{__FILE__}:#{__LINE__-1}:String"]
+
+    counters[:allocated].should == 3
+    counters[:live].should == counters[:allocated] - counters[:freed]
+  end
+
+  should 'scale up counts when sampling' do
+    Memprof.start(:sample_rate => 10)
+    10_000.times{ "abc" }
+    Memprof.stats(filename)
+
+    count = filedata.strip.split("\n").first.to_i
+    count.should.be > 5_000
+    count.should.be < 15_000
+    (count % 10).should == 0
+  end
+
+  should 'report tracking overhead' do
+    Memprof.start
+    "abc"
+    Memprof.overhead[:trackers][:count].should.be > 0
+    Memprof.overhead[:trackers][:bytes].should.be > 0
+    Memprof.stop
+
+    Memprof.overhead[:trackers][:bytes].should == 0
+    Memprof.overhead[:tramps][:count].should.be > 0
+    Memprof.overhead[:tramps][:bytes].should.be > 0
+  end
+
   should 'collect stats via ::track' do
     Memprof.track(filename) do
       "abc"
@@ -72,6 +124,15 @@ describe Memprof do
     lambda{ Memprof.dump }.should.raise(RuntimeError).message.should =~ /Memprof.start/
   end
 
+  should 'omit allocation times when the clock is off' do
+    Memprof.start(:clock => :off)
+    1.23+1
+    Memprof.dump(filename)
+
+    filedata.should =~ /"line":#{__LINE__-3}/
+    filedata.should.not =~ /"time":/
+  end
+
   should 'dump objects created for block' do
     Memprof.dump(filename) do
       2.45+1
@@ -93,6 +154,66 @@ describe Memprof do
     obj.should =~ /"_id":"0x(\w+?)"/
   end
 
+  should 'dump out the entire heap in binary' do
+    Memprof.stop
+    Memprof.dump_all(filename, :format => :binary)
+    Memprof.convert_dump(filename, "#{filename}.json")
+
+    obj = File.open("#{filename}.json", 'r').readlines.find do |line|
+      line =~ /"dump out the entire heap in binary"/
+    end
+
+    obj.should =~ /"length":34/
+    obj.should =~ /"type":"string"/
+    File.size(filename).should.be < File.size("#{filename}.json")
+    File.unlink("#{filename}.json")
+  end
+
+  should 'take dump_all options without a filename' do
+    lambda{ Memprof.dump_all(:format => :yaml) }.should.raise(ArgumentError)
+  end
+
+  should 'dump out the entire heap using several threads' do
+    Memprof.stop
+    Memprof.dump_all(filename, :threads => 4)
+
+    lines = File.open(filename, 'r').readlines
+    obj = lines.find do |line|
+      line =~ /"dump out the entire heap using several threads"/
+    end
+
+    obj.should =~ /"length":46/
+    lines.reject{ |line| line =~ /^\{.*\}$/ }.should.be.empty
+    Dir["#{filename}.IN_PROGRESS*"].should.be.empty
+  end
+
+  should 'dump out a compressed heap' do
+    Memprof.stop
+    Memprof.dump_all("#{filename}.gz")
+
+    obj = IO.popen("gzip -dc #{filename}.gz").readlines.find do |line|
+      line =~ /"dump out a compressed heap"/
+    end
+
+    obj.should =~ /"length":26/
+    obj.should =~ /"type":"string"/
+    File.unlink("#{filename}.gz")
+  end
+
+  should 'convert a compressed binary dump' do
+    Memprof.stop
+    Memprof.dump_all("#{filename}.gz", :format => :binary)
+    Memprof.convert_dump("#{filename}.gz", "#{filename}.json")
+
+    obj = File.open("#{filename}.json", 'r').readlines.find do |line|
+      line =~ /"convert a compressed binary dump"/
+    end
+
+    obj.should =~ /"type":"string"/
+    File.unlink("#{filename}.gz")
+    File.unlink("#{filename}.json")
+  end
+
   should 'dump out the entire heap with tracking info' do
     Memprof.start
     @str = "some random" + " string"
@@ -43,6 +43,27 @@ describe 'Memprof tracers' do
     time.should.be.close(150, 10)
   end
 
+  should 'record latency percentiles for select' do
+    Memprof.trace(filename) do
+      select(nil, nil, nil, 0.01)
+      3.times{ select(nil, nil, nil, 0.05) }
+    end
+
+    filedata.should =~ /"select":\{"calls":4,"time":[\d.]+,"p50":[\d.]+,"p90":[\d.]+,"p99":[\d.]+,"max":[\d.]+/
+    filedata[/"p50":([\d.]+)/, 1].to_f.should.be.close(50, 10)
+    filedata[/"max":([\d.]+)/, 1].to_f.should.be.close(50, 10)
+    filedata[/"max":([\d.]+)/, 1].to_f.should >= 50
+    filedata[/"max":([\d.]+)/, 1].to_f.should >= filedata[/"p99":([\d.]+)/, 1].to_f
+  end
+
+  should 'time fd calls with microsecond precision' do
+    Memprof.trace(filename) do
+      File.read(__FILE__)
+    end
+
+    filedata.should =~ /"read":\{"calls":\d+,"time":\d+\.\d{3},/
+  end
+
   should 'trace objects created for block' do
     Memprof.trace(filename) do
       10.times{1.1+1.2}
@@ -68,6 +89,54 @@ describe 'Memprof tracers' do
     filedata.should =~ /"realloc":\{"calls":10/
   end
 
+  should 'reinsert tracers removed at the end of a trace' do
+    2.times do
+      Memprof.trace(filename) do
+        10.times{ "abc" << "def" }
+      end
+
+      filedata.should =~ /"malloc":\{"calls":10/
+    end
+  end
+
+  should 'track malloc size classes and live bytes' do
+    Memprof.trace(filename) do
+      @strings = (1..10).map{ "x" * 100 }
+    end
+
+    filedata.should =~ /"<=128":\{"calls":\d+,"bytes":\d+\}/
+    filedata.should =~ /"callers":\[\{"address":/
+    live = filedata[/"live":(-?\d+)/, 1].to_i
+    filedata[/"live_max":(\d+)/, 1].to_i.should >= live
+  end
+
+  should 'record native malloc callers with backtraces' do
+    Memprof.malloc_frames = 4
+    Memprof.trace(filename) do
+      @strings = (1..10).map{ "x" * 100 }
+    end
+    Memprof.malloc_frames = 1
+
+    filedata.should =~ /"callers":\[\{"address":"0x[0-9a-f]+","name":[^,]+,"object":/
+    lambda{ Memprof.malloc_frames = 0 }.should.raise(ArgumentError)
+  end
+
+  should 'skip disabled tracers until they are enabled again' do
+    Memprof.disable_tracer(:memory).should == true
+    Memprof.trace(filename) do
+      10.times{ "abc" << "def" }
+    end
+    filedata.should.not =~ /"memory":/
+
+    Memprof.enable_tracer('memory')
+    Memprof.trace(filename) do
+      10.times{ "abc" << "def" }
+    end
+    filedata.should =~ /"malloc":\{"calls":10/
+
+    lambda{ Memprof.disable_tracer(:nonexistent) }.should.raise(ArgumentError)
+  end
+
   if defined? Mysql
     begin
       conn = Mysql.connect('localhost', 'root')
@@ -133,3 +202,29 @@ describe 'Memprof request tracing' do
     filedata.should =~ /"REQUEST_PATH":"value"/
   end
 end
+
+describe 'Memprof rolling tracing' do
+  @tempfile = Tempfile.new('tracing_spec')
+
+  def filename
+    @tempfile.path
+  end
+
+  should 'write a record per interval' do
+    File.open(filename, 'w'){}
+    Memprof.trace_start(filename, :interval => 1).should == true
+    lambda{ Memprof.trace{} }.should.raise(RuntimeError)
+    sleep 2.5
+    Memprof.trace_stop.should == true
+    Memprof.trace_stop.should == false
+
+    records = File.readlines(filename)
+    # one a second, plus the partial one written by trace_stop
+    records.size.should >= 2
+    records.each{ |r| r.should =~ /^\{"start":\d+,"tracers":\{.*\},"time":[\d.]+\}$/ }
+  end
+
+  should 'take trace_start options without a filename' do
+    lambda{ Memprof.trace_start(:interval => 0) }.should.raise(ArgumentError)
+  end
+end